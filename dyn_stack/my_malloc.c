@@ -8,6 +8,17 @@ This implementation of malloc saves heap space by minimizing the segment header
 
 #include "my_malloc.h"
 
+//Static tracepoints for perf, bpftrace and SystemTap, which cost a nop each while no tracer is attached
+#ifdef MY_MALLOC_USDT
+#if !__has_include(<sys/sdt.h>)
+#error "MY_MALLOC_USDT needs <sys/sdt.h> from SystemTap (e.g. the systemtap-sdt-dev package)"
+#endif
+#include <sys/sdt.h>
+#define usdt_probe(...)		STAP_PROBEV(my_malloc, __VA_ARGS__)
+#else
+#define usdt_probe(...)
+#endif
+
 
 typedef unsigned char uchar;
 
@@ -50,6 +61,7 @@ static int pointer_is_valid(void* p)
 	if((uchar*)p < malloc_break || (uchar*)p < malloc_heap_end || (uchar*)p > malloc_heap_start)
 	{
 		fprintf(stderr,"p is not within the current heap range!\n");
+		usdt_probe(invalid_pointer, p, "out of heap");
 		return 0;
 	}
 	
@@ -58,6 +70,7 @@ static int pointer_is_valid(void* p)
 	{
 		fprintf(stderr,"p does not seem to be a valid allocation entry!\n");
 		fprintf(stderr,"P: %p, Size: %zu, Next: %p\n", p, p_entry->size, p_entry->next);
+		usdt_probe(invalid_pointer, p, "bad header");
 		return 0;
 	}
 	
@@ -88,6 +101,7 @@ static void* grow_malloc_break(size_t amount)			//Similar to sbrk() in unix
 		return NULL;
 	}	
 	malloc_break = new_break;
+	usdt_probe(break_grow, malloc_break, amount);
 	
 	return malloc_break;
 }
@@ -176,7 +190,7 @@ void* my_malloc(size_t len)
 	
 	
 	/*Find the first Freelist large enough to fit the length requested*/
-	for(current_piece = freelist_head; current_piece; current_piece = current_piece->next, previous_piece = current_piece)
+	for(current_piece = freelist_head; current_piece; previous_piece = current_piece, current_piece = current_piece->next)
 	{
 		//Found an exact piece
 		if(current_piece->size == len)
@@ -209,6 +223,7 @@ void* my_malloc(size_t len)
 		printf("malloc: Using an exact piece of size %zu at %p\n", len, exact_piece);
 		#endif
 
+		usdt_probe(malloc_exact, retaddr, len);
 		return retaddr;
 	}
 	
@@ -239,6 +254,7 @@ void* my_malloc(size_t len)
 		printf("malloc: Piece 2 (free): size %zu at %p\n", next_smallest_piece->size, next_smallest_piece);
 		#endif
 
+		usdt_probe(malloc_split, retaddr, len, next_smallest_piece->size);
 		return retaddr;
 	}
 	
@@ -262,6 +278,7 @@ void* my_malloc(size_t len)
 		#endif
 		
 		write_seg_header(retaddr - sizeof(Heap_Seg), len, NULL);
+		usdt_probe(malloc_grow, retaddr, len);
 		return retaddr;
 	}
 	
@@ -345,6 +362,7 @@ void my_free(void *p)
 		{
 			//There should never be an occurance where p_entry is in the freelist. This might be a double free attempt
 			fprintf(stderr, "Double free detected! Free Piece %p, size %zu, next %p\n", current_piece, current_piece->size, current_piece->next);
+			usdt_probe(invalid_pointer, p, "double free");
 			return;
 		}
 		
@@ -384,16 +402,16 @@ void my_free(void *p)
 		
 		//Update freelist
 		if(closest_left_prev)
-		{
 			closest_left_prev->next = p_entry;
-			p_entry_prev = closest_left_prev;
-		}
 		else
 			freelist_head = p_entry;
+		p_entry_prev = closest_left_prev;
 		
 		#ifdef DEBUG_MY_FREE
 		printf("free: Merged with adjacent left piece. New size %zu at %p\n", p_entry->size, p_entry);
 		#endif
+		
+		usdt_probe(free_merge_left, p_entry, p_entry->size);
 	}
 	
 	
@@ -417,6 +435,8 @@ void my_free(void *p)
 		#ifdef DEBUG_MY_FREE
 		printf("free: Merged with adjacent right piece. New size %zu at %p\n", p_entry->size, p_entry);
 		#endif
+		
+		usdt_probe(free_merge_right, p_entry, p_entry->size);
 	}
 	
 	
@@ -439,6 +459,8 @@ void my_free(void *p)
 		#ifdef DEBUG_MY_FREE
 		printf("free: Eliminated new free piece by reducing malloc break to %p\n", malloc_break);
 		#endif
+		
+		usdt_probe(break_shrink, malloc_break);
 	}
 }
 
@@ -458,11 +480,10 @@ void my_free(void *p)
 void* my_realloc(void *p, size_t len)
 {
 	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
-	Heap_Seg *old_entry = p_entry;
 	Heap_Seg *new_entry;
 	
 	int size_diff;
-	uchar* new_break;
+	size_t old_size;
 	uchar* retaddr = NULL;
 	
 	Heap_Seg *current_piece = NULL;
@@ -473,15 +494,17 @@ void* my_realloc(void *p, size_t len)
 	if(!pointer_is_valid(p))
 		return NULL;
 	
+	old_size = p_entry->size;
+	
 	
 	/****************************************/
 	/*				Shrinking				*/
 	/****************************************/
 	
-	size_diff = len - p_entry->size;
+	size_diff = len - old_size;
 	
 	#ifdef DEBUG_MY_REALLOC
-	printf("realloc: Resizing %p, current size %zu. Size difference: %d\n", p_entry, p_entry->size, size_diff);
+	printf("realloc: Resizing %p, current size %zu. Size difference: %d\n", p_entry, old_size, size_diff);
 	#endif
 	
 	if(size_diff == 0)
@@ -489,7 +512,7 @@ void* my_realloc(void *p, size_t len)
 	
 	else if(size_diff < 0)
 	{
-		size_diff = p_entry->size - len;		//Make size_diff positive
+		size_diff = old_size - len;				//Make size_diff positive
 		
 		//Don't shrink if the size difference isn't big enough to insert a new segment header
 		if(size_diff <= sizeof(Heap_Seg))
@@ -500,50 +523,25 @@ void* my_realloc(void *p, size_t len)
 			return p;
 		}
 		
-		//Write a new segment entry above the requested length
-		retaddr = (uchar*)p + size_diff;
-		write_seg_header(retaddr - sizeof(Heap_Seg), len, NULL);
+		//Keep the data where it is, and carve the unused space above the requested length into its own piece
+		p_entry->size = len;
+		new_entry = (Heap_Seg*)segment_end(p_entry);
+		write_seg_header(new_entry, size_diff - sizeof(Heap_Seg), NULL);
 		
 		#ifdef DEBUG_MY_REALLOC
-		printf("realloc: New shrunk piece of size %zu at %p\n", len, retaddr - sizeof(Heap_Seg));
-		printf("realloc: Freeing the space above the shrunk piece (size %zu at %p)\n", old_entry->size, old_entry);
+		printf("realloc: New shrunk piece of size %zu at %p\n", len, p_entry);
+		printf("realloc: Freeing the space above the shrunk piece (size %zu at %p)\n", new_entry->size, new_entry);
 		#endif
 		
-		//Rewrite the old segment header and mark it as free
-		old_entry->size = size_diff - sizeof(Heap_Seg);
-		my_free(p);	
+		my_free((uchar*)new_entry + sizeof(Heap_Seg));
 		
-		return retaddr;
-	}
-	
-	
-	/****************************************/
-	/*	Growing In-place, At the break		*/
-	/****************************************/	
-	
-	//If the expanding piece is at the malloc break, simply grow the break to accomodate the new length
-	if((uchar*)p_entry == malloc_break)
-	{
-		if(!grow_malloc_break(len + sizeof(Heap_Seg)))
-			return NULL;
-		
-		//Write a new segment entry above the requested length
-		retaddr = malloc_break + sizeof(Heap_Seg);
-		write_seg_header(malloc_break, len, NULL);	
-		
-		//Shift existing data over
-		memcpy(retaddr, p, p_entry->size);
-		
-		#ifdef DEBUG_MY_REALLOC
-		printf("realloc: Expanding malloc break to %p for growth\n", malloc_break);
-		#endif
-
-		return retaddr;	
+		usdt_probe(realloc_in_place, p, len);
+		return p;
 	}
 	
 	
 	
-	//Iterate the freelist and find the closest adjacent free pieces to p, if the expanding piece is not at the break
+	//Iterate the freelist and find the closest adjacent free pieces to p
 	for(current_piece = freelist_head; current_piece; current_piece = current_piece->next)
 	{
 		if(current_piece > p_entry)
@@ -561,6 +559,7 @@ void* my_realloc(void *p, size_t len)
 		{
 			//There should never be an occurance where p_entry is in the freelist. This might be a double free attempt
 			fprintf(stderr, "Double free detected! Free Piece %p, size %zu, next %p\n", current_piece, current_piece->size, current_piece->next);
+			usdt_probe(invalid_pointer, p, "double free");
 			return NULL;
 		}
 	}
@@ -571,6 +570,8 @@ void* my_realloc(void *p, size_t len)
 	/*	Growing In-place, adjacent left		*/
 	/****************************************/
 	
+	//The left piece sits above the data, so growing into it never moves anything. Always try it first.
+	
 	if(closest_left && segment_end(p_entry) == (uchar*)closest_left)
 	{			
 		//Merging with adjacent left piece if it fits exactly (with the header consumed)
@@ -592,6 +593,7 @@ void* my_realloc(void *p, size_t len)
 			printf("realloc: Merging with adjacent left piece yields exact size. New size %zu at %p\n", p_entry->size, p_entry);
 			#endif
 			
+			usdt_probe(realloc_in_place, p, len);
 			return p;
 		}
 		
@@ -625,12 +627,41 @@ void* my_realloc(void *p, size_t len)
 			printf("realloc: Expanded Piece: size %zu at %p\n", len, p_entry);
 			printf("realloc: Free Piece: size %zu at %p\n", new_entry->size, new_entry);
 			#endif
+			
+			usdt_probe(realloc_in_place, p, len);
 			return p;
 		}
 	}
 	
+	
+	
+	/****************************************/
+	/*	Growing In-place, At the break		*/
+	/****************************************/	
+	
+	/*If the expanding piece is at the malloc break, grow the break by exactly the size difference.
+	The payload has to start lower, so the data is shifted down by that amount. The old header is simply overwritten,
+	and no space is left behind.*/
+	
+	if((uchar*)p_entry == malloc_break)
+	{
+		if(!grow_malloc_break(size_diff))
+			return NULL;
+		
+		retaddr = malloc_break + sizeof(Heap_Seg);
+		memmove(retaddr, p, old_size);
+		write_seg_header(malloc_break, len, NULL);	
+		
+		#ifdef DEBUG_MY_REALLOC
+		printf("realloc: Expanding malloc break to %p for growth\n", malloc_break);
+		#endif
 
+		usdt_probe(realloc_move, p, retaddr, len);
+		return retaddr;	
+	}
 	
+	
+
 	/****************************************/
 	/*	Growing In-place, adjacent right	*/
 	/****************************************/
@@ -641,21 +672,22 @@ void* my_realloc(void *p, size_t len)
 		if(closest_right->size + sizeof(Heap_Seg) == size_diff)
 		{
 			retaddr = (uchar*)closest_right + sizeof(Heap_Seg);
-			write_seg_header(closest_right, len, NULL);	
 			
 			//Update freelist
 			if(closest_right_prev)
-				closest_right_prev = closest_right->next;
+				closest_right_prev->next = closest_right->next;
 			else 
 				freelist_head = closest_right->next;
 			
-			//Shift existing data over
-			memcpy(retaddr, p, p_entry->size);
+			//Shift existing data over, then claim the free piece's header
+			memmove(retaddr, p, old_size);
+			write_seg_header(closest_right, len, NULL);	
 			
 			#ifdef DEBUG_MY_REALLOC
 			printf("realloc: Merging with top piece yields exact size. New piece at %p, size %zu\n", closest_right, closest_right->size);
 			#endif
 			
+			usdt_probe(realloc_move, p, retaddr, len);
 			return retaddr;	
 		}
 		
@@ -667,19 +699,20 @@ void* my_realloc(void *p, size_t len)
 			#endif
 			
 			retaddr = (uchar*)p - size_diff;
-			write_seg_header(retaddr - sizeof(Heap_Seg), len, NULL);
 			
 			//Update the free piece's original entry and reduce its free size
 			closest_right->size -= size_diff;
 			
 			//Shift existing data over
-			memcpy(retaddr, p, p_entry->size);
+			memmove(retaddr, p, old_size);
+			write_seg_header(retaddr - sizeof(Heap_Seg), len, NULL);
 			
 			#ifdef DEBUG_MY_REALLOC
 			printf("realloc: Piece 1: size %zu at %p\n", len, retaddr - sizeof(Heap_Seg));
 			printf("realloc: Piece 2 (free): size %zu at %p\n", closest_right->size, closest_right);
 			#endif
 			
+			usdt_probe(realloc_move, p, retaddr, len);
 			return retaddr;	
 		}
 	}
@@ -701,9 +734,10 @@ void* my_realloc(void *p, size_t len)
 	if(!retaddr) 
 		return NULL;
 	
-	memcpy(retaddr, p, p_entry->size);
+	memcpy(retaddr, p, old_size);
 	my_free(p);
 
+	usdt_probe(realloc_move, p, retaddr, len);
 	return retaddr;
 }
 
@@ -12,10 +12,15 @@
 #endif
 
 
-//Enable debug prints
+//Enable debug prints (define MY_MALLOC_QUIET when building to compile them out, e.g. for the simulator)
+#ifndef MY_MALLOC_QUIET
 #define DEBUG_MY_MALLOC
 #define DEBUG_MY_FREE
 #define DEBUG_MY_REALLOC
+#endif
+
+//Uncomment, or pass -DMY_MALLOC_USDT when building, for static tracepoints (needs <sys/sdt.h> from SystemTap)
+//#define MY_MALLOC_USDT
 
 
 /*
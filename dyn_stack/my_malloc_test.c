@@ -468,6 +468,274 @@ void test_realloc()
 }
 
 
+/*
+*	Walks the segments from the break up to the heap start and checks them against the freelist, which is kept in 
+*	descending address order. Returns 0 if they disagree, and otherwise the number of free pieces and bytes.
+*/
+#define CHECK_MAX_FREE	256
+
+static int heap_consistent(size_t *free_pieces, size_t *free_bytes)
+{
+	Malloc_Param param = save_malloc_param();
+	Heap_Seg *free_list[CHECK_MAX_FREE], *piece, *seg;
+	unsigned char *cursor;
+	size_t n = 0;
+	int prev_free = 0;
+	
+	for(piece = param.freelist_head; piece; piece = piece->next)
+	{
+		if(n == CHECK_MAX_FREE || (n && piece >= free_list[n - 1]))
+			return 0;
+		free_list[n++] = piece;
+	}
+	
+	*free_pieces = n;
+	*free_bytes = 0;
+	
+	for(cursor = param.malloc_break; cursor < param.malloc_heap_start; cursor += sizeof(Heap_Seg) + seg->size)
+	{
+		seg = (Heap_Seg*)cursor;
+		if(seg->size > (size_t)(param.malloc_heap_start - cursor) - sizeof(Heap_Seg))
+			return 0;
+		
+		if(n && seg == free_list[n - 1])
+		{
+			//Adjacent free pieces should have been merged
+			if(prev_free)
+				return 0;
+			*free_bytes += seg->size;
+			prev_free = 1;
+			n--;
+		}
+		else if(seg->next)
+			return 0;
+		else
+			prev_free = 0;
+	}
+	
+	return cursor == param.malloc_heap_start && !n;
+}
+
+
+static void fill(char *p, size_t len, int seed)
+{
+	size_t i;
+	
+	for(i = 0; i < len; i++)
+		p[i] = (char)(seed * 31 + i);
+}
+
+static int verify(char *p, size_t len, int seed)
+{
+	size_t i;
+	
+	for(i = 0; i < len; i++)
+		if(p[i] != (char)(seed * 31 + i))
+			return 0;
+	return 1;
+}
+
+
+static void report(size_t pieces, size_t bytes, int ok)
+{
+	size_t free_pieces, free_bytes;
+	int consistent = heap_consistent(&free_pieces, &free_bytes);
+	
+	printf("%zu free pieces, %zu free bytes: %s\n\n", free_pieces, free_bytes, 
+		ok && consistent && free_pieces == pieces && free_bytes == bytes ? "passed" : "FAILED");
+}
+
+
+
+//One case for each realloc path, and for the bugs fixed in malloc and free. The first block allocated is the highest one.
+void test_realloc_paths()
+{
+	char memory[4096];
+	char *str[6], *p;
+	unsigned char *old_break;
+	
+	printf("\n****************************************\n");
+	printf("\tEXACT PIECE AFTER THE FREELIST HEAD\n");
+	printf("****************************************\n\n");
+	
+	init_malloc(&memory[4095], &memory[1024]);
+	str[0] = malloc_dbg(32);
+	malloc_dbg(16);
+	str[1] = malloc_dbg(48);
+	malloc_dbg(16);
+	str[2] = malloc_dbg(64);
+	malloc_dbg(16);
+	free_dbg(str[0]);
+	free_dbg(str[1]);
+	free_dbg(str[2]);
+	
+	printf("Allocating (48) out of free pieces of (32), (48) and (64)...\n");
+	p = malloc_dbg(48);
+	report(2, 32 + 64, p == str[1]);
+	
+	
+	printf("\n****************************************\n");
+	printf("\tFREE MERGING ON BOTH SIDES\n");
+	printf("****************************************\n\n");
+	
+	init_malloc(&memory[4095], &memory[1024]);
+	str[0] = malloc_dbg(32);
+	str[1] = malloc_dbg(32);
+	str[2] = malloc_dbg(32);
+	malloc_dbg(32);
+	free_dbg(str[0]);
+	free_dbg(str[2]);
+	
+	printf("Freeing the block between the freelist head and the piece below it...\n");
+	free_dbg(str[1]);
+	report(1, 3 * 32 + 2 * sizeof(Heap_Seg), 1);
+	
+	
+	printf("\n****************************************\n");
+	printf("\tRIGHTWARD GROWTH EXACT, NOT AT THE HEAD\n");
+	printf("****************************************\n\n");
+	
+	init_malloc(&memory[4095], &memory[1024]);
+	str[0] = malloc_dbg(32);
+	malloc_dbg(16);
+	str[1] = malloc_dbg(40);
+	str[2] = malloc_dbg(48);
+	malloc_dbg(16);
+	fill(str[1], 40, 1);
+	free_dbg(str[0]);
+	free_dbg(str[2]);
+	
+	printf("Expanding (40) to (%zu) into the free piece below it...\n", 40 + 48 + sizeof(Heap_Seg));
+	p = realloc_dbg(str[1], 40 + 48 + sizeof(Heap_Seg));
+	report(1, 32, p == str[2] && verify(p, 40, 1));
+	
+	
+	printf("\n****************************************\n");
+	printf("\tRIGHTWARD GROWTH BY LESS THAN THE DATA\n");
+	printf("****************************************\n\n");
+	
+	init_malloc(&memory[4095], &memory[1024]);
+	str[0] = malloc_dbg(64);
+	str[1] = malloc_dbg(200);
+	malloc_dbg(16);
+	fill(str[0], 64, 2);
+	free_dbg(str[1]);
+	
+	printf("Expanding (64) to (80), shifting the data down by 16 over itself...\n");
+	p = realloc_dbg(str[0], 80);
+	report(1, 200 - 16, p == str[0] - 16 && verify(p, 64, 2));
+	
+	
+	printf("\n****************************************\n");
+	printf("\tGROWTH AT MALLOC BREAK BY THE DIFFERENCE\n");
+	printf("****************************************\n\n");
+	
+	init_malloc(&memory[4095], &memory[1024]);
+	malloc_dbg(32);
+	str[0] = malloc_dbg(40);
+	fill(str[0], 40, 3);
+	old_break = save_malloc_param().malloc_break;
+	
+	printf("Expanding (40) to (100) at the break...\n");
+	p = realloc_dbg(str[0], 100);
+	report(0, 0, p == str[0] - 60 && save_malloc_param().malloc_break == old_break - 60 && verify(p, 40, 3));
+	
+	
+	printf("\n****************************************\n");
+	printf("\tLEFTWARD GROWTH BEFORE THE BREAK\n");
+	printf("****************************************\n\n");
+	
+	init_malloc(&memory[4095], &memory[1024]);
+	str[0] = malloc_dbg(100);
+	str[1] = malloc_dbg(40);
+	fill(str[1], 40, 4);
+	free_dbg(str[0]);
+	old_break = save_malloc_param().malloc_break;
+	
+	printf("Expanding (40) at the break to (60), into the free piece above it...\n");
+	p = realloc_dbg(str[1], 60);
+	report(1, 100 - 20, p == str[1] && save_malloc_param().malloc_break == old_break && verify(p, 40, 4));
+	
+	
+	printf("\n****************************************\n");
+	printf("\tSHRINKING IN PLACE\n");
+	printf("****************************************\n\n");
+	
+	init_malloc(&memory[4095], &memory[1024]);
+	str[0] = malloc_dbg(100);
+	malloc_dbg(16);
+	fill(str[0], 100, 5);
+	
+	printf("Shrinking (100) to (40)...\n");
+	p = realloc_dbg(str[0], 40);
+	report(1, 100 - 40 - sizeof(Heap_Seg), p == str[0] && verify(p, 40, 5));
+}
+
+
+
+/*
+*	Random malloc, realloc and free over a set of slots, checking the contents of every live block and the consistency
+*	of the heap after each call.
+*/
+#define CHURN_SLOTS		32
+#define CHURN_ROUNDS	20000
+
+void test_realloc_churn()
+{
+	static char memory[1 << 16];
+	char *slots[CHURN_SLOTS] = {0}, *p;
+	size_t sizes[CHURN_SLOTS], free_pieces, free_bytes, len;
+	int seeds[CHURN_SLOTS];
+	unsigned int rng = 1;
+	int i, j, slot, ok = 1;
+	
+	init_malloc((unsigned char*)&memory[sizeof(memory) - 1], (unsigned char*)&memory[0]);
+	
+	printf("\n****************************************\n");
+	printf("\tRANDOM REALLOC CHURN\n");
+	printf("****************************************\n\n");
+	
+	for(i = 0; i < CHURN_ROUNDS && ok; i++)
+	{
+		rng = rng * 1103515245 + 12345;
+		slot = (rng >> 16) % CHURN_SLOTS;
+		len = (rng >> 4) % 400 + 1;
+		
+		if(!slots[slot])
+		{
+			if((slots[slot] = my_malloc(len)) != NULL)
+			{
+				sizes[slot] = len;
+				seeds[slot] = i;
+				fill(slots[slot], len, i);
+			}
+		}
+		else if(rng % 4 == 0)
+		{
+			my_free(slots[slot]);
+			slots[slot] = NULL;
+		}
+		else if((p = my_realloc(slots[slot], len)) != NULL)
+		{
+			ok = verify(p, len < sizes[slot] ? len : sizes[slot], seeds[slot]);
+			slots[slot] = p;
+			sizes[slot] = len;
+			seeds[slot] = i;
+			fill(p, len, i);
+		}
+		
+		for(j = 0; j < CHURN_SLOTS && ok; j++)
+			if(slots[j] && !verify(slots[j], sizes[j], seeds[j]))
+				ok = 0;
+		
+		if(ok && !heap_consistent(&free_pieces, &free_bytes))
+			ok = 0;
+	}
+	
+	printf("%d rounds, contents and heap checked after each: %s\n", i, ok ? "passed" : "FAILED");
+}
+
+
 int main()
 {
 	
@@ -475,5 +743,7 @@ int main()
 	//test_calloc();
 	//test_free();
 	test_realloc();
+	test_realloc_paths();
+	test_realloc_churn();
 	
 }
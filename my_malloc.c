@@ -6,8 +6,99 @@ Adding an offset to a memory address will make it go down (shrinking), and subtr
 This implementation of malloc saves heap space by minimizing the segment header (only stores segment size and next pointer), at the cost of runtime (no previous pointer).
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE					//pthread_getattr_np() and MAP_FIXED_NOREPLACE, used by MY_MALLOC_STACK_GUARD
+#endif
+
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
 #include "my_malloc.h"
 
+#ifdef MY_MALLOC_STACK_GUARD
+#ifndef __linux__
+#error "MY_MALLOC_STACK_GUARD is only implemented for Linux"
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef MY_MALLOC_OS_HEAP
+#ifndef __linux__
+#error "MY_MALLOC_OS_HEAP is only implemented for Linux"
+#endif
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef MY_MALLOC_DECAY
+#ifndef __linux__
+#error "MY_MALLOC_DECAY is only implemented for Linux"
+#endif
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef MY_MALLOC_PERCPU
+#ifndef __linux__
+#error "MY_MALLOC_PERCPU is only implemented for Linux"
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#if defined(__GLIBC__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU_RSEQ
+#endif
+#endif
+
+#ifdef MY_MALLOC_PROFILE
+#if !__has_include(<execinfo.h>)
+#error "MY_MALLOC_PROFILE needs backtrace() from <execinfo.h>"
+#endif
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <math.h>
+#endif
+
+#ifdef MY_MALLOC_LATENCY
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LATENCY_TSC
+#endif
+#endif
+
+//Static tracepoints for perf, bpftrace and SystemTap, which cost a nop each while no tracer is attached
+#ifdef MY_MALLOC_USDT
+#if !__has_include(<sys/sdt.h>)
+#error "MY_MALLOC_USDT needs <sys/sdt.h> from SystemTap (e.g. the systemtap-sdt-dev package)"
+#endif
+#include <sys/sdt.h>
+#define usdt_probe(...)		STAP_PROBEV(my_malloc, __VA_ARGS__)
+#else
+#define usdt_probe(...)
+#endif
+
+#if defined(MY_MALLOC_QUARANTINE) && defined(MY_MALLOC_PERSISTENT)
+#error "MY_MALLOC_QUARANTINE cannot be combined with MY_MALLOC_PERSISTENT, quarantined blocks would leak on a crash"
+#endif
+
+#if defined(MY_MALLOC_FASTBINS) && defined(MY_MALLOC_PERSISTENT)
+#error "MY_MALLOC_FASTBINS cannot be combined with MY_MALLOC_PERSISTENT, blocks held in fastbins would leak on a crash"
+#endif
+
+#if defined(MY_MALLOC_DECAY) && defined(MY_MALLOC_QUARANTINE)
+#error "MY_MALLOC_DECAY cannot be combined with MY_MALLOC_QUARANTINE, purged free memory would lose its poison"
+#endif
+
+#if defined(MY_MALLOC_PERCPU) && defined(MY_MALLOC_PERSISTENT)
+#error "MY_MALLOC_PERCPU cannot be combined with MY_MALLOC_PERSISTENT, blocks held in per-CPU caches would leak on a crash"
+#endif
+
 
 typedef unsigned char uchar;
 
@@ -17,410 +108,4404 @@ static uchar* malloc_heap_end;						//Absolute end of the memory segment for the
 static uchar* malloc_break;							//Also referred as "brk", the current end for the allocated heap	
 static Heap_Seg *freelist_head;						//Head of the first heap free list entry
 
+static unsigned long heap_generation;				//Bumped by every call that may change the heap, restarts incremental heap checks
+
+static int placement_policy = PLACEMENT_BEST_FIT;	//How malloc picks a free piece, see M_PLACEMENT
+static size_t best_fit_tolerance;					//Best fit stops at the first piece wasting at most this many bytes
+static Heap_Seg *next_fit_rover;					//Next fit resumes after this free piece, or from the head if NULL
+
+static size_t trim_threshold;						//Free only lowers the break once the tail piece reaches this many bytes
+static size_t top_pad;								//Bytes of free space kept at the tail when growing or trimming the break
+static size_t grow_chunk = 1;						//The break grows in multiples of this
+static uchar* reserve_end;							//Free never lowers the break below this, see my_reserve()
+
+#ifdef MY_MALLOC_OS_HEAP
+static size_t os_page_size;							//Page size of a heap mapped by init_malloc_os(), 0 for any other heap
+static uchar* os_dirty_end;							//Pages between the break and this may still be backed by memory
+
+#define heap_grow_chunk()		(grow_chunk > os_page_size ? grow_chunk : os_page_size)
+#define heap_trim_threshold()	(trim_threshold > os_page_size ? trim_threshold : os_page_size)
+
+static void os_release_tail(void);
+#else
+#define heap_grow_chunk()		grow_chunk
+#define heap_trim_threshold()	trim_threshold
+#define os_release_tail()
+#endif
+
 
 
 /************************************************************************/
-/*								HELPERS			 						*/
+/*							PERSISTENCE			 						*/
 /************************************************************************/
 
-#define MAX_HEAP_SIZE	(size_t)(malloc_heap_start - malloc_heap_end)
+/*
+*	With MY_MALLOC_PERSISTENT, the first bytes of the heap region hold a Heap_Root describing the heap, so that the heap
+*	can be attached again after the process exits (e.g. when the region is a MAP_SHARED mapping of a file).
+*
+*	Every write to heap metadata made by malloc, free and realloc is preceded by an undo log entry holding the old value 
+*	of the word. The log is cleared after the root has been updated, which is the commit point of an operation. If the 
+*	process dies in the middle of an operation, attach_malloc() replays the log backwards and the heap returns to its
+*	state before the interrupted call. Recovery only touches the logged words, so it never has to walk the heap.
+*
+*	Freelist pointers are absolute addresses, so the region must be mapped at the same address every time it is attached.
+*	The write ordering below protects against the process dying; surviving a power loss also requires the mapping to be
+*	flushed (e.g. msync) at the commit point.
+*/
 
-#define segment_end(p_entry)	((uchar*)p_entry + sizeof(Heap_Seg) + p_entry->size)
+#ifdef MY_MALLOC_PERSISTENT
 
-/*Implement this function properly if you want to prevent the heap from smashing into the stack.
-This function is called by grow_malloc_break(), and it passes a new malloc break location (end of heap) for testing.
-If this new break location would smash into the stack (or violates it in any ways), return 0. 
-Return 1 if no issues will arise*/
+#define HEAP_ROOT_MAGIC		0x434F4C4C414D594DULL		//"MYMALLOC"
+#define UNDO_LOG_SLOTS		64
 
-static int check_stack_integrity(void* new_break)
-{
-	return 1;
-}
+typedef struct {
+	
+	size_t *addr;
+	size_t old_value;
+	
+}Undo_Entry;
 
+typedef struct {
+	
+	uint64_t magic;
+	uchar* base;								//Where the region was mapped when the heap was created
+	uchar* heap_end;
+	uchar* malloc_break;
+	Heap_Seg *freelist_head;
+	
+	#ifdef MY_MALLOC_HARDENED
+	uintptr_t pointer_secret;
+	uintptr_t canary_secret;
+	#endif
+	
+	size_t undo_count;							//Non-zero while an operation is in flight
+	Undo_Entry undo[UNDO_LOG_SLOTS];
+	
+}Heap_Root;
 
-/*Used by free() and realloc(), makes sure p is a valid pointer on the heap first*/
-static int pointer_is_valid(void* p)
+static Heap_Root *heap_root;					//Lives at the start of the heap region
+static int tx_depth;							//realloc calls malloc and free internally, only the outermost call commits
+
+//Keeps the compiler from reordering metadata writes around the log updates
+#define write_barrier()		__asm__ __volatile__("" ::: "memory")
+
+static void undo_log(void* addr)
 {
-	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
-	
-	if(p == NULL)
-		return 0;
+	Undo_Entry *entry;
 	
-	//Make sure p is within the heap's bound
-	if((uchar*)p > malloc_break || (uchar*)p > malloc_heap_end || (uchar*)p < malloc_heap_start)
+	if(heap_root->undo_count >= UNDO_LOG_SLOTS)
 	{
-		fprintf(stderr,"p is not within the current heap range!\n");
-		return 0;
+		fprintf(stderr,"Undo log overflow! Heap metadata can no longer be kept consistent.\n");
+		abort();
 	}
 	
-	//Make sure p's allocation entry fields appears "sane"
-	if(p_entry->size >= MAX_HEAP_SIZE || p_entry->next != NULL)
-	{
-		fprintf(stderr,"p does not seem to be a valid allocation entry!\n");
-		fprintf(stderr,"P: %p, Size: %zu, Next: %p\n", p, p_entry->size, p_entry->next);
-		return 0;
-	}
+	entry = &heap_root->undo[heap_root->undo_count];
+	entry->addr = addr;
+	entry->old_value = *(size_t*)addr;
 	
-	return 1;
+	write_barrier();
+	heap_root->undo_count++;
+	write_barrier();
 }
 
+//Logs the old value of a word of heap metadata before overwriting it
+#define heap_set(lvalue, value)		do{ undo_log(&(lvalue)); (lvalue) = (value); }while(0)
 
-static inline void write_seg_header(void* p_entry, size_t len, Heap_Seg* next)
+static inline void tx_begin(void)
 {
-	((Heap_Seg*)p_entry)->size = len;
-	((Heap_Seg*)p_entry)->next = next;
+	tx_depth++;
 }
 
-
-static inline void print_seg_header(void* p_entry)
+static void tx_commit(void)
 {
-	printf("header start: %p, size %zu, next %p\n", (Heap_Seg*)p_entry, ((Heap_Seg*)p_entry)->size, ((Heap_Seg*)p_entry)->next);
+	if(--tx_depth > 0)
+		return;
+	
+	//Publish the new break and freelist head, then retire the log. Clearing undo_count is the commit point.
+	heap_set(heap_root->malloc_break, malloc_break);
+	heap_set(heap_root->freelist_head, freelist_head);
+	
+	write_barrier();
+	heap_root->undo_count = 0;
+	write_barrier();
 }
 
-
-static void* grow_malloc_break(size_t amount)			//Similar to sbrk() in unix
+static void undo_recover(Heap_Root *root)
 {
-	uchar* new_break = malloc_break + amount;
+	size_t i;
 	
-	if(new_break > malloc_heap_end || new_break < malloc_heap_start || !check_stack_integrity(new_break))
-	{
-		fprintf(stderr,"Cannot continue. Allocation will exceed heap or smash into stack.\n");
-		return NULL;
-	}	
-	malloc_break = new_break;
+	for(i = root->undo_count; i > 0; i--)
+		*root->undo[i-1].addr = root->undo[i-1].old_value;
 	
-	return malloc_break;
+	write_barrier();
+	root->undo_count = 0;
 }
 
+#else
 
-void* get_malloc_break()			//Similar to brk() in unix
-{
-	return malloc_break;
-}
+#define heap_set(lvalue, value)		((lvalue) = (value))
+#define tx_begin()
+#define tx_commit()
+
+#endif
 
 
 
 /************************************************************************/
-/*							INITIALIZATION		 						*/
+/*							STATISTICS			 						*/
 /************************************************************************/
 
-int init_malloc(uchar* start, uchar* end)
+/*
+*	With MY_MALLOC_STATS, the number and total size of free and allocated pieces, along with log2 histograms of their sizes,
+*	are updated by malloc, free and realloc whenever they create, split, merge or release a segment. Sizes exclude headers.
+*	Values that would need a scan (largest free piece, fragmentation ratios) are only computed when a snapshot is taken.
+*/
+
+#ifdef MY_MALLOC_STATS
+
+static Malloc_Stats stats;
+
+static inline unsigned int size_bucket(size_t size)
 {
-	if(start > end)
-	{
-		fprintf(stderr,"Heap starting address must be lesser than end address!\n");
-		return 0;
-	}
-	
-	malloc_heap_start 	= start;
-	malloc_heap_end 	= end;
-	malloc_break 		= malloc_heap_start;	
-	freelist_head 		= NULL;
-	
-	#ifdef DEBUG_MY_MALLOC
-	printf("Heap Start: %p, Heap End: %p\n\n", malloc_heap_start, malloc_heap_end);
-	#endif
-	return 1;
+	return size ? (sizeof(size_t) * 8 - 1) - __builtin_clzl(size) : 0;
 }
 
+static inline void stats_free_add(size_t size)
+{
+	stats.free_bytes += size;
+	stats.free_pieces++;
+	stats.free_hist[size_bucket(size)]++;
+}
 
-Malloc_Param save_malloc_param(void)
+static inline void stats_free_remove(size_t size)
 {
-	Malloc_Param p;
-	
-	p.malloc_heap_start 	= malloc_heap_start;
-	p.malloc_heap_end 		= malloc_heap_end;
-	p.malloc_break 			= malloc_break;
-	p.freelist_head 		= freelist_head;
-	
-	return p;
+	stats.free_bytes -= size;
+	stats.free_pieces--;
+	stats.free_hist[size_bucket(size)]--;
 }
 
+static inline void stats_alloc_add(size_t size)
+{
+	stats.alloc_bytes += size;
+	stats.alloc_pieces++;
+	stats.alloc_hist[size_bucket(size)]++;
+}
 
-void load_malloc_param(Malloc_Param p)
+static inline void stats_alloc_remove(size_t size)
 {
-	malloc_heap_start 	= p.malloc_heap_start;
-	malloc_heap_end 	= p.malloc_heap_end;
-	malloc_break 		= p.malloc_break;
-	freelist_head 		= p.freelist_head;
+	stats.alloc_bytes -= size;
+	stats.alloc_pieces--;
+	stats.alloc_hist[size_bucket(size)]--;
 }
 
+#else
 
+#define stats_free_add(size)
+#define stats_free_remove(size)
+#define stats_alloc_add(size)
+#define stats_alloc_remove(size)
 
+#endif
 
 
 
+/************************************************************************/
+/*								HELPERS			 						*/
+/************************************************************************/
 
+#define MAX_HEAP_SIZE	(size_t)(malloc_heap_start - malloc_heap_end)
 
+#define segment_end(p_entry)	((uchar*)p_entry + sizeof(Heap_Seg) + p_entry->size)
 
+/*
+*	In hardened builds, freelist links are stored as their distance from a random per-heap secret, the links of the 
+*	fastbins and per-CPU caches are stored XORed with that secret and the address of the link itself, and the next field 
+*	of an allocated piece holds a canary derived from a second secret, its address and its size, instead of NULL. 
+*	Freelist walks step through the stored links and read each header at the secret plus the link, see link_size(). The 
+*	secret is then the base of the load address, so a hop takes no longer than in a regular build, where any demangling 
+*	step would delay the load of the next link. The secret is drawn below the heap, so that the sum never wraps.
+*	Overwriting a header (e.g. by overrunning the piece before it) breaks its canary, and since a freed piece no longer 
+*	carries the canary, a double free is caught in O(1) without scanning the freelist. A link forged without the secret 
+*	leads out of the heap or out of address order, which malloc() refuses, see free_link_valid().
+*/
 
+#ifdef MY_MALLOC_HARDENED
 
-/************************************************************************/
-/*								MALLOC		  							*/
-/************************************************************************/
+static uintptr_t pointer_secret;
+static uintptr_t canary_secret;
 
-void* my_malloc(size_t len)
-{
-	
-	Heap_Seg *current_piece = NULL, *previous_piece = NULL;
-	Heap_Seg *exact_piece = NULL, *exact_piece_prev = NULL;
-	Heap_Seg *next_smallest_piece = NULL;
-	
-	uchar* retaddr = NULL;
+#define mangle_ptr(where, link)		((Heap_Seg*)(pointer_secret ^ (uintptr_t)(where) ^ (uintptr_t)(link)))
+#define mangle_next(link)			((Heap_Seg*)((uintptr_t)(link) - pointer_secret))
+#define demangle_next(link)			((Heap_Seg*)((uintptr_t)(link) + pointer_secret))
 
-	/*If stack has not yet been initialized, skip to step 3*/
+//The size and next fields of the piece a stored link (other than the one ending the freelist) leads to. Each gets its 
+//own address expression, so that the compiler folds the secret into both loads instead of adding it up front.
+#define link_size(link)				(*(size_t*)((uchar*)pointer_secret + (uintptr_t)(link)))
+#define link_next(link)				(*(Heap_Seg**)((uchar*)pointer_secret + ((uintptr_t)(link) + sizeof(size_t))))
 
-	/************************************************/
-	/*		Attempt 1: Find an exact piece		    */
-	/************************************************/
-	
-	
-	/*Find the first Freelist large enough to fit the length requested*/
-	for(current_piece = freelist_head; current_piece; current_piece = current_piece->next, previous_piece = current_piece)
-	{
-		//Found an exact piece
-		if(current_piece->size == len)
-		{
-			exact_piece = current_piece;
-			exact_piece_prev = previous_piece;
-			break;
-		}
-		
-		//Record the smallest piece of memory available (of at least length "len"), if exact piece is not yet found
-		if(current_piece->size > len + sizeof(Heap_Seg) && (!next_smallest_piece || current_piece->size < next_smallest_piece->size))
-			next_smallest_piece = current_piece;
-	}
+#define seg_canary(seg, len)		((Heap_Seg*)(canary_secret ^ (uintptr_t)(seg) ^ (len)))
 
+static uintptr_t random_secret(void)
+{
+	uintptr_t secret = 0;
+	FILE *urandom = fopen("/dev/urandom", "rb");
 	
-	//Grant the exact piece if available
-	if(exact_piece)
+	if(urandom)
 	{
-		retaddr = (uchar*)exact_piece + sizeof(Heap_Seg);
-			
-		//Disconnect the current piece from the fl chain
-		//If the piece used have no previous free piece, that means this is also freelist_head
-		if(exact_piece_prev)
-			exact_piece_prev->next = exact_piece->next;
-		else
-			freelist_head = exact_piece->next;	
-		exact_piece->next = NULL;
-		
-		#ifdef DEBUG_MY_MALLOC
-		printf("malloc: Using an exact piece of size %zu at %p\n", len, exact_piece);
-		#endif
-
-		return retaddr;
+		if(fread(&secret, sizeof(secret), 1, urandom) != 1)
+			secret = 0;
+		fclose(urandom);
 	}
 	
+	//No entropy source available, fall back to what varies between runs
+	if(!secret)
+		secret = ((uintptr_t)time(NULL) * 0x9E3779B97F4A7C15ULL) ^ (uintptr_t)&secret ^ (uintptr_t)clock();
 	
-	/************************************************/
-	/*		Attempt 2: Split an larger piece	   	*/
-	/************************************************/
-
-	if(next_smallest_piece)
-	{	
-		#ifdef DEBUG_MY_MALLOC
-		printf("malloc: Planning to split a piece of size %zu at %p\n", next_smallest_piece->size, next_smallest_piece);
-		#endif
-		
-		//Shrink the size of the original segment to accomodate the requested lengths and a new seg header
-		next_smallest_piece->size -= len + sizeof(Heap_Seg);
-		
-		//Calculate the expected return address for the granted memory
-		retaddr = (uchar*)next_smallest_piece + sizeof(Heap_Seg);			//The actual start of the original segment
-		retaddr += next_smallest_piece->size + sizeof(Heap_Seg);			//The actual start of the splitted piece to be returned
+	return secret;
+}
 
-	
-		//Write a new allocation entry for the new splitted segment to be returned. 
-		//The shrunken free piece is still at its original location (LEFT side of the splitted/allocated piece)
-		write_seg_header(retaddr - sizeof(Heap_Seg), len, NULL);
-		
-		#ifdef DEBUG_MY_MALLOC
-		printf("malloc: Piece 1: size %zu at %p\n", len, retaddr - sizeof(Heap_Seg));
-		printf("malloc: Piece 2 (free): size %zu at %p\n", next_smallest_piece->size, next_smallest_piece);
-		#endif
+#else
 
-		return retaddr;
-	}
-	
-	
-	/************************************************/
-	/*		Attempt 3: Allocate more heap space 	*/
-	/************************************************/
-	
-	//Calculate the return address for the request (in advance, assuming additional heap will be granted)
-	
-	if(malloc_break == malloc_heap_start)				//Heap is currently unallocated
-		retaddr = malloc_heap_start + sizeof(Heap_Seg);				
-	else												//No existing free pieces available on the heap
-		retaddr = malloc_break + sizeof(Heap_Seg);
+#define mangle_ptr(where, link)		(link)
+#define mangle_next(link)			(link)
+#define demangle_next(link)			(link)
+#define link_size(link)				((link)->size)
+#define link_next(link)				((link)->next)
+#define seg_canary(seg, len)		NULL
 
-	//Allocate additional heap space needed for the requested length and a new header
-	if(grow_malloc_break(len + sizeof(Heap_Seg)))
-	{
-		#ifdef DEBUG_MY_MALLOC
-		printf("malloc: Using a new piece of size %zu at %p; Malloc break at %p\n", len, retaddr, malloc_break);
-		#endif
-		
-		write_seg_header(retaddr - sizeof(Heap_Seg), len, NULL);
-		return retaddr;
-	}
-	
-	//If we are unable to grow the break, there's nothing more we can do :(
-	return NULL;
-}
+#endif
 
+//Blocks held in quarantine carry the inverted canary, so they are neither allocated nor free
+#define seg_quarantined(seg, len)	((Heap_Seg*)~(uintptr_t)seg_canary(seg, len))
 
+//Likewise for blocks held in a fastbin, which carry the canary with its lowest bit flipped
+#define seg_binned(seg, len)		((Heap_Seg*)((uintptr_t)seg_canary(seg, len) ^ 1))
 
+//And for blocks held in a per-CPU cache, with the second lowest bit flipped
+#define seg_cached(seg, len)		((Heap_Seg*)((uintptr_t)seg_canary(seg, len) ^ 2))
 
+#ifdef MY_MALLOC_STACK_GUARD
 
+/*
+*	init_malloc() looks up the bounds of the calling thread's stack. If the heap would grow into it, the break is limited
+*	to below the stack, and a PROT_NONE guard region is placed between the two, so that the stack overflowing downwards
+*	faults instead of silently running into the heap. Checking a new break then only takes one compare.
+*	The guard starts at the break limit and never reaches past the end of the heap region. Only the current heap has one: 
+*	it is removed when a heap is initialized, attached or switched to, and placed again for a heap switched back to.
+*/
 
+static uchar* break_limit;							//The break never grows past this
+static uchar* guard_start;							//The guard in place, if guard_size is not 0
+static size_t guard_size;
+static int guard_mapped;							//Whether the guard was mapped into a gap, rather than protected in place
 
+static int check_stack_integrity(void* new_break)
+{
+	return (uchar*)new_break <= break_limit;
+}
 
 
+//Makes the guard accessible again, or unmaps it if it was mapped into a gap below the stack
+static void remove_guard(void)
+{
+	if(!guard_size)
+		return;
+	
+	if(guard_mapped ? munmap(guard_start, guard_size) : mprotect(guard_start, guard_size, PROT_READ | PROT_WRITE))
+		fprintf(stderr,"Cannot remove the guard at %p\n", guard_start);
+	guard_size = 0;
+}
 
-/************************************************************************/
-/*								CALLOC		  							*/
-/************************************************************************/
 
-void* my_calloc(size_t nitems, size_t size)
+//Places the guard at the break limit, on the whole pages between it and the end of the heap region
+static void place_guard(uchar* limit, uchar* end)
 {
-	size_t total_len = nitems * size;
-	void *retaddr = my_malloc(total_len); 
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	size_t size = MY_MALLOC_STACK_GUARD_SIZE;
 	
-	if(!retaddr)
-		return NULL;
-	memset(retaddr, 0, total_len);
+	if(size > (size_t)(end - limit))
+		size = (end - limit) & ~(page - 1);
+	if(!size)
+		return;
 	
-	return retaddr;
+	//The guard may lie in mapped memory (the heap region itself), or in the unmapped gap below the stack
+	if(!mprotect(limit, size, PROT_NONE))
+		guard_mapped = 0;
+	else if(mmap(limit, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != MAP_FAILED)
+		guard_mapped = 1;
+	else
+	{
+		if(errno != EEXIST)
+			fprintf(stderr,"Cannot place a guard below the stack at %p, the break is still limited to it\n", limit);
+		return;
+	}
+	
+	guard_start = limit;
+	guard_size 	= size;
 }
 
 
+static uchar* find_break_limit(uchar* start, uchar* end)
+{
+	pthread_attr_t attr;
+	void *stack_addr;
+	size_t stack_size;
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uchar *guard;
+	
+	remove_guard();
+	
+	if(pthread_getattr_np(pthread_self(), &attr))
+	{
+		fprintf(stderr,"Cannot find the stack bounds, the heap is not guarded against the stack!\n");
+		return end;
+	}
+	pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+	pthread_attr_destroy(&attr);
+	
+	guard = (uchar*)(((uintptr_t)stack_addr - MY_MALLOC_STACK_GUARD_SIZE) & ~(page - 1));
+	
+	//A heap ending below the guard cannot reach the stack, and one starting inside the stack is an array on the stack itself
+	if(end < guard || start >= (uchar*)stack_addr)
+		return end;
+	
+	if(guard <= start)
+	{
+		fprintf(stderr,"The heap starts right below the stack, there is no room left for it!\n");
+		return start;
+	}
+	
+	place_guard(guard, end);
+	
+	#ifdef DEBUG_MY_MALLOC
+	printf("Stack starts at %p, the break is limited to %p\n", stack_addr, guard);
+	#endif
+	
+	return guard;
+}
 
+#else
 
+/*Implement this function properly if you want to prevent the heap from smashing into the stack.
+This function is called by grow_malloc_break(), and it passes a new malloc break location (end of heap) for testing.
+If this new break location would smash into the stack (or violates it in any ways), return 0. 
+Return 1 if no issues will arise. On Linux, MY_MALLOC_STACK_GUARD provides an implementation.*/
 
+static int check_stack_integrity(void* new_break)
+{
+	return 1;
+}
 
+#endif
 
 
+//Whether p, and the header in front of it, lie within the heap's bound
+#define pointer_in_heap(p)		((uchar*)(p) <= malloc_break && (uchar*)(p) <= malloc_heap_end && (uchar*)(p) >= malloc_heap_start + sizeof(Heap_Seg))
 
 
-/************************************************************************/
-/*								FREE		  							*/
-/************************************************************************/
-
-void my_free(void *p)
+/*Used by free() and realloc(), makes sure p is a valid pointer on the heap first*/
+static int pointer_is_valid(void* p)
 {
 	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
-	Heap_Seg *p_entry_prev = NULL;
 	
-	Heap_Seg *current_piece = NULL;
-	Heap_Seg *closest_left = NULL, *closest_left_prev = NULL;
-	Heap_Seg *closest_right = NULL, *closest_right_prev = NULL;
+	if(p == NULL)
+		return 0;
 	
+	//Make sure p is within the heap's bound
+	if(!pointer_in_heap(p))
+	{
+		fprintf(stderr,"p is not within the current heap range!\n");
+		usdt_probe(invalid_pointer, p, "out of heap");
+		return 0;
+	}
+	
+	#ifdef MY_MALLOC_QUARANTINE
+	if(p_entry->next == seg_quarantined(p_entry, p_entry->size))
+	{
+		fprintf(stderr,"Double free detected! %p (size %zu) is in quarantine\n", p, p_entry->size);
+		usdt_probe(invalid_pointer, p, "double free");
+		return 0;
+	}
+	#endif
+	
+	#ifdef MY_MALLOC_FASTBINS
+	if(p_entry->next == seg_binned(p_entry, p_entry->size))
+	{
+		fprintf(stderr,"Double free detected! %p (size %zu) is in a fastbin\n", p, p_entry->size);
+		usdt_probe(invalid_pointer, p, "double free");
+		return 0;
+	}
+	#endif
+	
+	#ifdef MY_MALLOC_PERCPU
+	if(p_entry->next == seg_cached(p_entry, p_entry->size))
+	{
+		fprintf(stderr,"Double free detected! %p (size %zu) is in a per-CPU cache\n", p, p_entry->size);
+		usdt_probe(invalid_pointer, p, "double free");
+		return 0;
+	}
+	#endif
+	
+	//Make sure p's allocation entry fields appears "sane"
+	if(p_entry->size >= MAX_HEAP_SIZE || p_entry->next != seg_canary(p_entry, p_entry->size))
+	{
+		#ifdef MY_MALLOC_HARDENED
+		fprintf(stderr,"p's header canary does not match. It was freed already, or its header was overwritten!\n");
+		#else
+		fprintf(stderr,"p does not seem to be a valid allocation entry!\n");
+		#endif
+		fprintf(stderr,"P: %p, Size: %zu, Next: %p\n", p, p_entry->size, p_entry->next);
+		usdt_probe(invalid_pointer, p, "bad header");
+		return 0;
+	}
+	
+	return 1;
+}
+
+
+static inline Heap_Seg* seg_next(Heap_Seg* p_entry)
+{
+	return demangle_next(p_entry->next);
+}
+
+
+static inline void set_seg_next(Heap_Seg* p_entry, Heap_Seg* next)
+{
+	heap_set(p_entry->next, mangle_next(next));
+}
+
+
+#ifdef MY_MALLOC_HARDENED
+//The freelist is address ordered and coalesced, so a free piece lies in the heap above the end of the one before it, 
+//and links to a piece above its own end. A link forged without the secret demangles to an address that fails this.
+static inline int free_link_valid(Heap_Seg* prev, Heap_Seg* p_entry)
+{
+	Heap_Seg *next;
+	
+	if((uchar*)p_entry < malloc_heap_start || (uchar*)p_entry + sizeof(Heap_Seg) > malloc_break)
+		return 0;
+	
+	if(p_entry->size > (size_t)(malloc_break - ((uchar*)p_entry + sizeof(Heap_Seg))))
+		return 0;
+	
+	if(prev && (uchar*)p_entry <= segment_end(prev))
+		return 0;
+	
+	next = seg_next(p_entry);
+	return !next || ((uchar*)next > segment_end(p_entry) && (uchar*)next < malloc_break);
+}
+#endif
+
+
+static inline int seg_is_allocated(Heap_Seg* p_entry)
+{
+	return p_entry->next == seg_canary(p_entry, p_entry->size);
+}
+
+
+//Allocated, or held in quarantine, a fastbin or a per-CPU cache
+static inline int seg_is_in_use(Heap_Seg* p_entry)
+{
+	#ifdef MY_MALLOC_QUARANTINE
+	if(p_entry->next == seg_quarantined(p_entry, p_entry->size))
+		return 1;
+	#endif
+	
+	#ifdef MY_MALLOC_FASTBINS
+	if(p_entry->next == seg_binned(p_entry, p_entry->size))
+		return 1;
+	#endif
+	
+	#ifdef MY_MALLOC_PERCPU
+	if(p_entry->next == seg_cached(p_entry, p_entry->size))
+		return 1;
+	#endif
+	
+	return seg_is_allocated(p_entry);
+}
+
+
+//Header of a free piece
+static inline void write_seg_header(void* p_entry, size_t len, Heap_Seg* next)
+{
+	heap_set(((Heap_Seg*)p_entry)->size, len);
+	set_seg_next(p_entry, next);
+}
+
+
+//Header of an allocated piece
+static inline void write_alloc_header(void* p_entry, size_t len)
+{
+	heap_set(((Heap_Seg*)p_entry)->size, len);
+	heap_set(((Heap_Seg*)p_entry)->next, seg_canary(p_entry, len));
+}
+
+
+static inline void print_seg_header(void* p_entry)
+{
+	printf("header start: %p, size %zu, next %p\n", (Heap_Seg*)p_entry, ((Heap_Seg*)p_entry)->size, ((Heap_Seg*)p_entry)->next);
+}
+
+
+/*
+*	With MY_MALLOC_QUARANTINE and a non-zero quarantine budget, the payload of every free piece is filled with POISON_BYTE,
+*	including the headers erased when pieces are merged. The pattern is verified when a block leaves the quarantine and 
+*	when free memory is handed out again, so writes through dangling pointers are caught.
+*/
+
+#ifdef MY_MALLOC_QUARANTINE
+
+#define POISON_BYTE		0xDB
+
+static size_t quarantine_budget = MY_MALLOC_QUARANTINE_BYTES;
+
+static inline void poison(void* p, size_t len)
+{
+	if(quarantine_budget)
+		memset(p, POISON_BYTE, len);
+}
+
+
+static void check_poison(void* p, size_t len, const char* when)
+{
+	uchar* byte;
+	
+	if(!quarantine_budget)
+		return;
+	
+	for(byte = p; byte < (uchar*)p + len; byte++)
+	{
+		if(*byte != POISON_BYTE)
+		{
+			fprintf(stderr,"Use after free detected %s! Block %p (size %zu) was modified at offset %zu\n", when, p, len, (size_t)(byte - (uchar*)p));
+			return;
+		}
+	}
+}
+
+
+//Erases the header of a free piece being merged into its neighbour
+static inline void wipe_seg_header(void* p_entry)
+{
+	if(quarantine_budget)
+		memset(p_entry, POISON_BYTE, sizeof(Heap_Seg));
+	else
+		write_seg_header(p_entry, 0, NULL);
+}
+
+static void quarantine_flush(void);
+static void quarantine_reset(void);
+
+#else
+
+#define poison(p, len)
+#define check_poison(p, len, when)
+#define wipe_seg_header(p_entry)	write_seg_header(p_entry, 0, NULL)
+
+#endif
+
+
+#ifdef MY_MALLOC_FASTBINS
+
+//Freed blocks of up to fastbin_max bytes are kept in LIFO stacks, one per size, linked through their first payload word.
+//The links are mangled in hardened builds.
+#define FASTBIN_MIN		sizeof(Heap_Seg*)
+#define fastbin_link(p_entry)				((Heap_Seg**)((uchar*)(p_entry) + sizeof(Heap_Seg)))
+#define fastbin_next(p_entry)				mangle_ptr(fastbin_link(p_entry), *fastbin_link(p_entry))
+#define set_fastbin_next(p_entry, next)		(*fastbin_link(p_entry) = mangle_ptr(fastbin_link(p_entry), next))
+
+static Heap_Seg *fastbins[MY_MALLOC_FASTBIN_MAX + 1];
+static size_t fastbin_bytes;										//Total payload held in all fastbins
+static size_t fastbin_max = MY_MALLOC_FASTBIN_MAX;
+static size_t fastbin_threshold = MY_MALLOC_FASTBIN_BYTES;
+
+static void fastbin_consolidate(void);
+static void fastbin_reset(void);
+
+#endif
+
+
+#ifdef MY_MALLOC_PERCPU
+
+static void percpu_flush(void);
+static void percpu_reset(void);
+static int percpu_reclaim(void);
+
+#endif
+
+
+#ifdef MY_MALLOC_DECAY
+
+static size_t decay_ms = MY_MALLOC_DECAY_MS;					//Free pieces unused for longer are purged, (size_t)-1 for never
+static Heap_Seg *decay_cursor;									//Next free piece of the pass in progress, NULL between passes
+
+static void decay_stamp(Heap_Seg *p_entry);
+static void decay_tick(void);
+
+#else
+
+#define decay_stamp(p_entry)
+#define decay_tick()
+
+#endif
+
+
+#ifdef MY_MALLOC_LATENCY
+
+#define LATENCY_NONE		-1
+
+//Path taken by the current call, set along the way and recorded by the entry point
+#ifdef MY_MALLOC_PERCPU
+static __thread int latency_path = LATENCY_NONE;
+#else
+static int latency_path = LATENCY_NONE;
+#endif
+
+#define latency_mark(path)			(latency_path = (path))
+#define latency_mark_merge_left()	(latency_path = (latency_path == LATENCY_MERGE_RIGHT ? LATENCY_MERGE_BOTH : LATENCY_MERGE_LEFT))
+
+#else
+
+#define latency_mark(path)			((void)0)
+#define latency_mark_merge_left()	((void)0)
+
+#endif
+
+
+#ifdef MY_MALLOC_PROFILE
+
+static void profile_forget_range(void* start, void* end);
+
+#else
+
+#define profile_forget_range(start, end)
+
+#endif
+
+
+#ifdef MY_MALLOC_FREE_INDEX
+
+static int free_index_valid;							//Cleared when the index no longer mirrors the freelist, see FREE INDEX
+
+#define free_index_invalidate()		(free_index_valid = 0)
+
+#else
+
+#define free_index_invalidate()
+
+#endif
+
+
+static void* grow_malloc_break(size_t amount)			//Similar to sbrk() in unix
+{
+	uchar* new_break = malloc_break + amount;
+	
+	if(new_break > malloc_heap_end || new_break < malloc_heap_start || !check_stack_integrity(new_break))
+	{
+		fprintf(stderr,"Cannot continue. Allocation will exceed heap or smash into stack.\n");
+		return NULL;
+	}	
+	malloc_break = new_break;
+	usdt_probe(break_grow, malloc_break, amount);
+	
+	#ifdef MY_MALLOC_OS_HEAP
+	if(malloc_break > os_dirty_end)
+		os_dirty_end = malloc_break;
+	#endif
+	
+	return malloc_break;
+}
+
+
+void* get_malloc_break()			//Similar to brk() in unix
+{
+	return malloc_break;
+}
+
+
+//How far the break can still grow, up to the same limit grow_malloc_break() enforces
+static size_t break_room(void)
+{
+	uchar* limit = malloc_heap_end;
+	
+	#ifdef MY_MALLOC_STACK_GUARD
+	if(break_limit < limit)
+		limit = break_limit;
+	#endif
+	
+	return limit > malloc_break ? (size_t)(limit - malloc_break) : 0;
+}
+
+
+/*
+*	How far to grow the break to fit len bytes (and a header) at the tail of the heap, when the last have bytes below the
+*	break are already part of it. That is what is missing, unless it can be done exactly: room is then also left for 
+*	top_pad bytes (one byte at least) of wilderness after the piece, and the growth is rounded up to grow_chunk.
+*/
+static size_t tail_growth(size_t len, size_t have)
+{
+	size_t grow = len + sizeof(Heap_Seg) - have, padded, chunk = heap_grow_chunk();
+	
+	if(top_pad || chunk > 1 || have > len + sizeof(Heap_Seg))
+	{
+		padded = len + 2*sizeof(Heap_Seg) + (top_pad ? top_pad : 1) - have;
+		padded = (padded + chunk - 1) / chunk * chunk;
+		
+		//Fall back to the exact growth if the padding does not fit in the heap anymore
+		if(padded <= break_room() || have > len + sizeof(Heap_Seg))
+			grow = padded;
+	}
+	
+	return grow;
+}
+
+
+
+/************************************************************************/
+/*							INITIALIZATION		 						*/
+/************************************************************************/
+
+int init_malloc(uchar* start, uchar* end)
+{
+	if(start > end)
+	{
+		fprintf(stderr,"Heap starting address must be lesser than end address!\n");
+		return 0;
+	}
+	
+	#ifdef MY_MALLOC_PERSISTENT
+	if((size_t)(end - start) <= sizeof(Heap_Root))
+	{
+		fprintf(stderr,"Heap is too small to hold its persistent root!\n");
+		return 0;
+	}
+	
+	//The root occupies the start of the region, the heap begins right after it
+	heap_root = (Heap_Root*)start;
+	heap_root->magic = 0;
+	start += sizeof(Heap_Root);
+	#endif
+	
+	malloc_heap_start 	= start;
+	malloc_heap_end 	= end;
+	malloc_break 		= malloc_heap_start;	
+	freelist_head 		= NULL;
+	next_fit_rover 		= NULL;
+	reserve_end 		= NULL;
+	heap_generation++;
+	free_index_invalidate();
+	
+	#ifdef MY_MALLOC_STACK_GUARD
+	break_limit 		= find_break_limit(start, end);
+	#endif
+	
+	#ifdef MY_MALLOC_OS_HEAP
+	os_page_size 		= 0;
+	os_dirty_end 		= malloc_break;
+	#endif
+	
+	#ifdef MY_MALLOC_QUARANTINE
+	quarantine_reset();
+	#endif
+	
+	#ifdef MY_MALLOC_FASTBINS
+	fastbin_reset();
+	#endif
+	
+	#ifdef MY_MALLOC_PERCPU
+	percpu_reset();
+	#endif
+	
+	//Samples of blocks in a previous heap over the same region are stale
+	profile_forget_range(start, end);
+	
+	#ifdef MY_MALLOC_HARDENED
+	pointer_secret 		= random_secret() % (uintptr_t)malloc_heap_start;
+	canary_secret 		= random_secret();
+	#endif
+	
+	#ifdef MY_MALLOC_DECAY
+	decay_cursor 		= NULL;
+	#endif
+	
+	#ifdef MY_MALLOC_STATS
+	memset(&stats, 0, sizeof(stats));
+	#endif
+	
+	#ifdef MY_MALLOC_PERSISTENT
+	heap_root->base 			= (uchar*)heap_root;
+	heap_root->heap_end 		= malloc_heap_end;
+	heap_root->malloc_break 	= malloc_break;
+	heap_root->freelist_head 	= freelist_head;
+	heap_root->undo_count 		= 0;
+	
+	#ifdef MY_MALLOC_HARDENED
+	heap_root->pointer_secret 	= pointer_secret;
+	heap_root->canary_secret 	= canary_secret;
+	#endif
+	
+	tx_depth 					= 0;
+	
+	//Written last, so a partially initialized root is never attached
+	write_barrier();
+	heap_root->magic = HEAP_ROOT_MAGIC;
+	#endif
+	
+	#ifdef DEBUG_MY_MALLOC
+	printf("Heap Start: %p, Heap End: %p\n\n", malloc_heap_start, malloc_heap_end);
+	#endif
+	return 1;
+}
+
+
+Malloc_Param save_malloc_param(void)
+{
+	Malloc_Param p;
+	
+	//Cached, quarantined and binned blocks belong to this heap, so they are released before the heap can be switched out
+	#ifdef MY_MALLOC_PERCPU
+	percpu_flush();
+	#endif
+	
+	#ifdef MY_MALLOC_QUARANTINE
+	quarantine_flush();
+	#endif
+	
+	#ifdef MY_MALLOC_FASTBINS
+	fastbin_consolidate();
+	#endif
+	
+	p.malloc_heap_start 	= malloc_heap_start;
+	p.malloc_heap_end 		= malloc_heap_end;
+	p.malloc_break 			= malloc_break;
+	p.freelist_head 		= freelist_head;
+	
+	p.placement_policy 		= placement_policy;
+	p.best_fit_tolerance 	= best_fit_tolerance;
+	p.next_fit_rover 		= next_fit_rover;
+	p.reserve_end 			= reserve_end;
+	
+	#ifdef MY_MALLOC_STACK_GUARD
+	p.break_limit 			= break_limit;
+	#endif
+	
+	#ifdef MY_MALLOC_OS_HEAP
+	p.os_page_size 			= os_page_size;
+	p.os_dirty_end 			= os_dirty_end;
+	#endif
+	
+	#ifdef MY_MALLOC_PERSISTENT
+	p.heap_root 			= heap_root;
+	#endif
+	
+	#ifdef MY_MALLOC_HARDENED
+	p.pointer_secret 		= pointer_secret;
+	p.canary_secret 		= canary_secret;
+	#endif
+	
+	#ifdef MY_MALLOC_STATS
+	p.stats 				= stats;
+	#endif
+	
+	return p;
+}
+
+
+void load_malloc_param(Malloc_Param p)
+{
+	malloc_heap_start 	= p.malloc_heap_start;
+	malloc_heap_end 	= p.malloc_heap_end;
+	malloc_break 		= p.malloc_break;
+	freelist_head 		= p.freelist_head;
+	heap_generation++;
+	free_index_invalidate();
+	
+	placement_policy 	= p.placement_policy;
+	best_fit_tolerance 	= p.best_fit_tolerance;
+	next_fit_rover 		= p.next_fit_rover;
+	reserve_end 		= p.reserve_end;
+	
+	#ifdef MY_MALLOC_STACK_GUARD
+	break_limit 		= p.break_limit;
+	remove_guard();
+	if(break_limit > malloc_heap_start && break_limit < malloc_heap_end)
+		place_guard(break_limit, malloc_heap_end);
+	#endif
+	
+	#ifdef MY_MALLOC_OS_HEAP
+	os_page_size 		= p.os_page_size;
+	os_dirty_end 		= p.os_dirty_end;
+	#endif
+	
+	#ifdef MY_MALLOC_DECAY
+	decay_cursor 		= NULL;
+	#endif
+	
+	#ifdef MY_MALLOC_QUARANTINE
+	quarantine_reset();
+	#endif
+	
+	#ifdef MY_MALLOC_FASTBINS
+	fastbin_reset();
+	#endif
+	
+	#ifdef MY_MALLOC_PERCPU
+	percpu_reset();
+	#endif
+	
+	#ifdef MY_MALLOC_PERSISTENT
+	heap_root 			= p.heap_root;
+	#endif
+	
+	#ifdef MY_MALLOC_HARDENED
+	pointer_secret 		= p.pointer_secret;
+	canary_secret 		= p.canary_secret;
+	#endif
+	
+	#ifdef MY_MALLOC_STATS
+	stats 				= p.stats;
+	#endif
+}
+
+
+#ifdef MY_MALLOC_PERSISTENT
+/*Attaches to a persistent heap created earlier by init_malloc() over the same region, 
+rolling back any operation that was interrupted by a crash*/
+int attach_malloc(uchar* start, uchar* end)
+{
+	Heap_Root *root = (Heap_Root*)start;
+	
+	if(root->magic != HEAP_ROOT_MAGIC || root->base != start || root->heap_end != end)
+	{
+		fprintf(stderr,"No persistent heap was created at %p with this end address!\n", start);
+		return 0;
+	}
+	
+	if(root->undo_count)
+	{
+		#ifdef DEBUG_MY_MALLOC
+		printf("Recovering persistent heap: undoing %zu metadata writes\n", root->undo_count);
+		#endif
+		undo_recover(root);
+	}
+	
+	heap_root 			= root;
+	tx_depth 			= 0;
+	malloc_heap_start 	= start + sizeof(Heap_Root);
+	malloc_heap_end 	= end;
+	malloc_break 		= root->malloc_break;
+	freelist_head 		= root->freelist_head;
+	next_fit_rover 		= NULL;
+	reserve_end 		= NULL;
+	heap_generation++;
+	free_index_invalidate();
+	
+	#ifdef MY_MALLOC_STACK_GUARD
+	break_limit 		= find_break_limit(start, end);
+	#endif
+	
+	#ifdef MY_MALLOC_OS_HEAP
+	os_page_size 		= 0;
+	os_dirty_end 		= malloc_break;
+	#endif
+	
+	#ifdef MY_MALLOC_HARDENED
+	pointer_secret 		= root->pointer_secret;
+	canary_secret 		= root->canary_secret;
+	#endif
+	
+	#ifdef MY_MALLOC_DECAY
+	decay_cursor 		= NULL;
+	#endif
+	
+	#ifdef DEBUG_MY_MALLOC
+	printf("Heap Start: %p, Heap End: %p, Malloc break at %p\n\n", malloc_heap_start, malloc_heap_end, malloc_break);
+	#endif
+	return 1;
+}
+#endif
+
+
+
+
+/************************************************************************/
+/*							OS-BACKED HEAPS		 						*/
+/************************************************************************/
+
+#ifdef MY_MALLOC_OS_HEAP
+
+/*
+*	init_malloc_os() maps the heap region itself, aligned to the page size it is backed with. The whole region is 
+*	reserved up front with MAP_NORESERVE, so the OS only supplies memory for the pages that are touched and growing 
+*	the break needs no system call. The break grows and is trimmed in whole pages (at least, see M_GROW_CHUNK and 
+*	M_TRIM_THRESHOLD), and the pages above a trimmed break are handed back with MADV_DONTNEED.
+*
+*	With huge pages, far fewer TLB entries cover the heap, which helps freelist walks that touch headers all over it.
+*/
+
+static size_t huge_page_size(void)
+{
+	FILE* meminfo = fopen("/proc/meminfo", "r");
+	char line[128];
+	size_t kb = 2048;
+	
+	while(meminfo && fgets(line, sizeof(line), meminfo))
+		if(sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+			break;
+	
+	if(meminfo)
+		fclose(meminfo);
+	return kb * 1024;
+}
+
+
+//Returns the start of the heap region, or NULL if it cannot be mapped
+void* init_malloc_os(size_t size, int pages)
+{
+	size_t page = pages == HEAP_PAGES_SMALL ? (size_t)sysconf(_SC_PAGESIZE) : huge_page_size();
+	uchar *region = MAP_FAILED, *raw;
+	
+	size = (size + page - 1) / page * page;
+	
+	if(pages == HEAP_PAGES_HUGETLB)
+	{
+		//Not MAP_NORESERVE: the huge pages are reserved here, so running out of them fails now instead of raising SIGBUS later
+		region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(region == MAP_FAILED)
+		{
+			fprintf(stderr,"Cannot map the heap from hugetlbfs, using transparent huge pages instead\n");
+			pages = HEAP_PAGES_TRANSPARENT;
+		}
+	}
+	
+	if(region == MAP_FAILED)
+	{
+		//Map one page more than needed, then cut the region down to a page aligned one
+		raw = mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(raw == MAP_FAILED)
+		{
+			fprintf(stderr,"Cannot map a heap of %zu bytes!\n", size);
+			return NULL;
+		}
+		
+		region = (uchar*)(((uintptr_t)raw + page - 1) & ~(uintptr_t)(page - 1));
+		if(region > raw)
+			munmap(raw, region - raw);
+		munmap(region + size, raw + page - region);
+		
+		if(pages == HEAP_PAGES_TRANSPARENT && madvise(region, size, MADV_HUGEPAGE))
+			fprintf(stderr,"Transparent huge pages are not available, the heap uses small pages\n");
+	}
+	
+	if(!init_malloc(region, region + size))
+	{
+		munmap(region, size);
+		return NULL;
+	}
+	
+	os_page_size = page;
+	return region;
+}
+
+
+//Hands the whole pages above the break back to the OS
+static void os_release_tail(void)
+{
+	uchar *from, *to;
+	
+	if(!os_page_size)
+		return;
+	
+	from = (uchar*)(((uintptr_t)malloc_break + os_page_size - 1) & ~(uintptr_t)(os_page_size - 1));
+	to = (uchar*)(((uintptr_t)os_dirty_end + os_page_size - 1) & ~(uintptr_t)(os_page_size - 1));
+	
+	if(from >= to)
+		return;
+	
+	madvise(from, to - from, MADV_DONTNEED);
+	os_dirty_end = from;
+	
+	#ifdef DEBUG_MY_FREE
+	printf("free: Released %zu bytes above the malloc break back to the OS\n", (size_t)(to - from));
+	#endif
+}
+
+#endif
+
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*								FREE INDEX	  							*/
+/************************************************************************/
+
+/*
+*	With MY_MALLOC_FREE_INDEX, the address and size of every free piece are also kept in free_index, a dense array in
+*	the same address order as the freelist. Placement searches scan it instead of following the freelist from header to
+*	header, and free and realloc find the neighbours of a block with a binary search. The headers of the free pieces a
+*	search passes over are never read; only the piece that is used and the one before it in the freelist are touched.
+*
+*	The index is updated next to the statistics hooks, wherever a free piece is created, resized, moved or removed. 
+*	Inserting and removing shift the entries above, which moves dense memory instead of chasing headers through the heap.
+*	The index is rebuilt from the freelist after the heap is initialized, attached or switched. While there are more free
+*	pieces than MY_MALLOC_FREE_INDEX_SLOTS, it is dropped, and searches walk the freelist until a rebuild fits again.
+*/
+
+#ifdef MY_MALLOC_FREE_INDEX
+
+#define FREE_INDEX_RETRY		1024			//Searches made on the freelist before an index that overflowed is rebuilt
+
+typedef struct {
+	
+	Heap_Seg *seg;
+	size_t size;
+	
+}Free_Desc;
+
+static Free_Desc free_index[MY_MALLOC_FREE_INDEX_SLOTS];
+static size_t free_index_count;
+static size_t free_index_backoff;
+
+
+static void free_index_overflow(void)
+{
+	#ifdef DEBUG_MY_MALLOC
+	printf("free index: More than %d free pieces, searching the freelist instead\n", MY_MALLOC_FREE_INDEX_SLOTS);
+	#endif
+	
+	free_index_valid = 0;
+	free_index_backoff = FREE_INDEX_RETRY;
+}
+
+
+static int free_index_rebuild(void)
+{
+	Heap_Seg *current_piece;
+	
+	if(free_index_backoff)
+	{
+		free_index_backoff--;
+		return 0;
+	}
+	
+	free_index_count = 0;
+	for(current_piece = freelist_head; current_piece; current_piece = seg_next(current_piece))
+	{
+		if(free_index_count == MY_MALLOC_FREE_INDEX_SLOTS)
+		{
+			free_index_overflow();
+			return 0;
+		}
+		
+		free_index[free_index_count].seg = current_piece;
+		free_index[free_index_count].size = current_piece->size;
+		free_index_count++;
+	}
+	
+	free_index_valid = 1;
+	return 1;
+}
+
+#define free_index_ready()		(free_index_valid || free_index_rebuild())
+
+
+//Position of the first entry at or above seg
+static inline size_t free_index_find(Heap_Seg *seg)
+{
+	size_t low = 0, high = free_index_count, mid;
+	
+	while(low < high)
+	{
+		mid = (low + high) / 2;
+		
+		if(free_index[mid].seg < seg)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+
+//A free piece was added to the freelist
+static void free_index_add(Heap_Seg *seg, size_t size)
+{
+	size_t i;
+	
+	if(!free_index_valid)
+		return;
+	
+	if(free_index_count == MY_MALLOC_FREE_INDEX_SLOTS)
+	{
+		free_index_overflow();
+		return;
+	}
+	
+	i = free_index_find(seg);
+	memmove(&free_index[i + 1], &free_index[i], (free_index_count - i) * sizeof(Free_Desc));
+	free_index[i].seg = seg;
+	free_index[i].size = size;
+	free_index_count++;
+}
+
+
+//A free piece left the freelist
+static void free_index_remove(Heap_Seg *seg)
+{
+	size_t i;
+	
+	if(!free_index_valid)
+		return;
+	
+	i = free_index_find(seg);
+	memmove(&free_index[i], &free_index[i + 1], (free_index_count - i - 1) * sizeof(Free_Desc));
+	free_index_count--;
+}
+
+
+//A free piece was resized, or its header moved to new_seg without passing another free piece
+static void free_index_update(Heap_Seg *seg, Heap_Seg *new_seg, size_t size)
+{
+	size_t i;
+	
+	if(!free_index_valid)
+		return;
+	
+	i = free_index_find(seg);
+	free_index[i].seg = new_seg;
+	free_index[i].size = size;
+}
+
+
+/*Finds the free pieces closest to p_entry on either side, and the one preceding the left one, as the freelist walks of
+free and realloc do. *right is p_entry itself if it is free. Returns 0 if the index cannot be used.*/
+static int free_index_around(Heap_Seg *p_entry, Heap_Seg **left_prev, Heap_Seg **left, Heap_Seg **right)
+{
+	size_t i;
+	
+	if(!free_index_ready())
+		return 0;
+	
+	i = free_index_find(p_entry);
+	*left_prev = i > 1 ? free_index[i - 2].seg : NULL;
+	*left = i > 0 ? free_index[i - 1].seg : NULL;
+	*right = i < free_index_count ? free_index[i].seg : NULL;
+	return 1;
+}
+
+
+//Finds the last free piece and the one preceding it. Returns 0 if the index cannot be used.
+static int free_index_last(Heap_Seg **last_prev, Heap_Seg **last)
+{
+	if(!free_index_ready())
+		return 0;
+	
+	*last_prev = free_index_count > 1 ? free_index[free_index_count - 2].seg : NULL;
+	*last = free_index_count ? free_index[free_index_count - 1].seg : NULL;
+	return 1;
+}
+
+
+//Compares the index with the freelist, for heap_check()
+static int free_index_check(void)
+{
+	Heap_Seg *current_piece = freelist_head;
+	size_t i;
+	
+	if(!free_index_valid)
+		return 1;
+	
+	for(i = 0; i < free_index_count; i++, current_piece = seg_next(current_piece))
+	{
+		if(current_piece != free_index[i].seg || current_piece->size != free_index[i].size)
+		{
+			fprintf(stderr,"heap check: Free index entry %zu (%p, size %zu) does not match the free piece %p!\n", i, free_index[i].seg, free_index[i].size, current_piece);
+			return 0;
+		}
+	}
+	
+	if(current_piece)
+	{
+		fprintf(stderr,"heap check: Free piece %p is missing from the free index!\n", current_piece);
+		return 0;
+	}
+	return 1;
+}
+
+#else
+
+#define free_index_add(seg, size)
+#define free_index_remove(seg)
+#define free_index_update(seg, new_seg, size)
+#define free_index_around(p_entry, left_prev, left, right)	0
+#define free_index_last(last_prev, last)					0
+#define free_index_check()									1
+
+#endif
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*								PLACEMENT	  							*/
+/************************************************************************/
+
+//A free piece can hold len bytes if it fits exactly, or if it can be split with room for a new header
+#define size_fits(size, len)	((size) == (len) || (size) > (len) + sizeof(Heap_Seg))
+#define piece_fits(piece, len)	size_fits((piece)->size, len)
+
+
+/*Called whenever a free piece stops existing (allocated whole, merged into a neighbour, moved or trimmed away), 
+so that next fit and the decay pass never resume from a stale header*/
+static inline void forget_free_piece(Heap_Seg* piece)
+{
+	if(piece == next_fit_rover)
+		next_fit_rover = NULL;
+	
+	#ifdef MY_MALLOC_DECAY
+	if(piece == decay_cursor)
+		decay_cursor = NULL;
+	#endif
+}
+
+
+#ifdef MY_MALLOC_FREE_INDEX
+//The same searches as find_free_piece() below, over the free index
+static Heap_Seg* index_find_free_piece(size_t len, Heap_Seg **prev)
+{
+	size_t i, start, best = free_index_count;
+	
+	switch(placement_policy)
+	{
+		case PLACEMENT_FIRST_FIT:
+			for(i = 0; i < free_index_count && !size_fits(free_index[i].size, len); i++);
+			break;
+		
+		case PLACEMENT_NEXT_FIT:
+			start = next_fit_rover ? free_index_find(next_fit_rover) + 1 : 0;
+			for(i = start; i < free_index_count && !size_fits(free_index[i].size, len); i++);
+			
+			if(i == free_index_count && start)
+			{
+				for(i = 0; i < start && !size_fits(free_index[i].size, len); i++);
+				if(i == start)
+					i = free_index_count;
+			}
+			break;
+		
+		default:
+			for(i = 0; i < free_index_count; i++)
+			{
+				if(!size_fits(free_index[i].size, len) || (best < free_index_count && free_index[i].size >= free_index[best].size))
+					continue;
+				
+				best = i;
+				if(free_index[i].size - len <= best_fit_tolerance)
+					break;
+			}
+			i = best;
+	}
+	
+	if(i >= free_index_count)
+		return NULL;
+	
+	*prev = i ? free_index[i - 1].seg : NULL;
+	return free_index[i].seg;
+}
+#endif
+
+
+/*
+*	Picks the free piece malloc should use for len bytes according to placement_policy, and stores the free piece 
+*	preceding it in *prev (NULL if it is the freelist head). Returns NULL if no piece fits.
+*/
+static Heap_Seg* find_free_piece(size_t len, Heap_Seg **prev)
+{
+	Heap_Seg *link, *previous_link;
+	Heap_Seg *best_piece = NULL;
+	
+	#ifdef MY_MALLOC_FREE_INDEX
+	if(free_index_ready())
+		return index_find_free_piece(len, prev);
+	#endif
+	
+	switch(placement_policy)
+	{
+		//The freelist is address ordered, so the first piece that fits is also the lowest addressed one
+		case PLACEMENT_FIRST_FIT:
+			for(previous_link = mangle_next(NULL), link = mangle_next(freelist_head); link != mangle_next(NULL); previous_link = link, link = link_next(link))
+			{
+				if(size_fits(link_size(link), len))
+				{
+					*prev = demangle_next(previous_link);
+					return demangle_next(link);
+				}
+			}
+			return NULL;
+		
+		
+		//First fit, starting after the rover and wrapping around to the head up to (and including) the rover itself
+		case PLACEMENT_NEXT_FIT:
+			previous_link = mangle_next(next_fit_rover);
+			link = next_fit_rover ? next_fit_rover->next : mangle_next(freelist_head);
+			
+			for(; link != mangle_next(NULL); previous_link = link, link = link_next(link))
+			{
+				if(size_fits(link_size(link), len))
+				{
+					*prev = demangle_next(previous_link);
+					return demangle_next(link);
+				}
+			}
+			
+			if(!next_fit_rover)
+				return NULL;
+			
+			for(previous_link = mangle_next(NULL), link = mangle_next(freelist_head); link != mangle_next(NULL); previous_link = link, link = link_next(link))
+			{
+				if(size_fits(link_size(link), len))
+				{
+					*prev = demangle_next(previous_link);
+					return demangle_next(link);
+				}
+				
+				if(link == mangle_next(next_fit_rover))
+					break;
+			}
+			return NULL;
+		
+		
+		//The smallest piece that fits. An exact piece, or one within the tolerance, ends the search right away.
+		default:
+			for(previous_link = mangle_next(NULL), link = mangle_next(freelist_head); link != mangle_next(NULL); previous_link = link, link = link_next(link))
+			{
+				if(!size_fits(link_size(link), len) || (best_piece && link_size(link) >= best_piece->size))
+					continue;
+				
+				best_piece = demangle_next(link);
+				*prev = demangle_next(previous_link);
+				
+				if(link_size(link) - len <= best_fit_tolerance)
+					break;
+			}
+			return best_piece;
+	}
+}
+
+
+static int set_placement_policy(size_t policy)
+{
+	if(policy != PLACEMENT_BEST_FIT && policy != PLACEMENT_FIRST_FIT && policy != PLACEMENT_NEXT_FIT)
+	{
+		fprintf(stderr,"mallopt: Unknown placement policy %zu\n", policy);
+		return 0;
+	}
+	
+	placement_policy = policy;
+	next_fit_rover = NULL;
+	return 1;
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*								MALLOC		  							*/
+/************************************************************************/
+
+static void* do_malloc(size_t len)
+{
+	
+	Heap_Seg *piece = NULL, *piece_prev = NULL, *next_piece;
+	
+	uchar* retaddr = NULL;
+	size_t grow;
+
+	/*If stack has not yet been initialized, skip to step 3*/
+	
+	#ifdef MY_MALLOC_FASTBINS
+	//Reuse a recently freed block of the same size without searching or splitting anything
+	if(len <= fastbin_max && fastbins[len])
+	{
+		piece = fastbins[len];
+		fastbins[len] = fastbin_next(piece);
+		fastbin_bytes -= len;
+		write_alloc_header(piece, len);
+		
+		#ifdef DEBUG_MY_MALLOC
+		printf("malloc: Reusing a piece of size %zu at %p from its fastbin\n", len, piece);
+		#endif
+		
+		latency_mark(LATENCY_EXACT);
+		usdt_probe(malloc_fastbin, (uchar*)piece + sizeof(Heap_Seg), len);
+		return (uchar*)piece + sizeof(Heap_Seg);
+	}
+	#endif
+	
+	piece = find_free_piece(len, &piece_prev);
+	
+	#ifdef MY_MALLOC_FASTBINS
+	//Requests too large for the fastbins may fit once their blocks are coalesced, and so may any request once the heap is full
+	if(!piece && fastbin_bytes && (len > fastbin_max || len + sizeof(Heap_Seg) > (size_t)(malloc_heap_end - malloc_break)))
+	{
+		fastbin_consolidate();
+		piece = find_free_piece(len, &piece_prev);
+	}
+	#endif
+	
+	#ifdef MY_MALLOC_HARDENED
+	//Handing out a piece reached through a forged link would let the next write land anywhere
+	if(piece && !free_link_valid(piece_prev, piece))
+	{
+		fprintf(stderr, "Freelist corruption detected! Piece %p (size %zu, next %p) is out of place\n", piece, piece->size, seg_next(piece));
+		return NULL;
+	}
+	#endif
+	
+	
+	/************************************************/
+	/*		Attempt 1: Use an exact piece		    */
+	/************************************************/
+	
+	//Grant the exact piece if available
+	if(piece && piece->size == len)
+	{
+		retaddr = (uchar*)piece + sizeof(Heap_Seg);
+			
+		//Disconnect the current piece from the fl chain
+		//If the piece used have no previous free piece, that means this is also freelist_head
+		if(piece_prev)
+			set_seg_next(piece_prev, seg_next(piece));
+		else
+			freelist_head = seg_next(piece);	
+		write_alloc_header(piece, len);
+		check_poison(retaddr, len, "when reusing a free piece");
+		
+		stats_free_remove(len);
+		stats_alloc_add(len);
+		free_index_remove(piece);
+		
+		//Next fit carries on with the piece that followed this one
+		next_fit_rover = piece_prev;
+		
+		#ifdef DEBUG_MY_MALLOC
+		printf("malloc: Using an exact piece of size %zu at %p\n", len, piece);
+		#endif
+
+		latency_mark(LATENCY_EXACT);
+		usdt_probe(malloc_exact, retaddr, len);
+		return retaddr;
+	}
+	
+	
+	/************************************************/
+	/*		Attempt 2: Split an larger piece	   	*/
+	/************************************************/
+
+	//Splitting the wilderness takes the new piece from its low end instead, so that the free space stays at the tail
+	if(piece && segment_end(piece) == malloc_break)
+	{
+		#ifdef DEBUG_MY_MALLOC
+		printf("malloc: Planning to split the wilderness of size %zu at %p\n", piece->size, piece);
+		#endif
+		
+		retaddr = (uchar*)piece + sizeof(Heap_Seg);
+		next_piece = (Heap_Seg*)(retaddr + len);
+		
+		stats_free_remove(piece->size);
+		write_seg_header(next_piece, piece->size - (len + sizeof(Heap_Seg)), NULL);
+		decay_stamp(next_piece);
+		stats_free_add(next_piece->size);
+		stats_alloc_add(len);
+		free_index_update(piece, next_piece, next_piece->size);
+		
+		if(piece_prev)
+			set_seg_next(piece_prev, next_piece);
+		else
+			freelist_head = next_piece;
+		
+		forget_free_piece(piece);
+		write_alloc_header(piece, len);
+		check_poison(retaddr, len, "when splitting a free piece");
+		next_fit_rover = piece_prev;
+		
+		#ifdef DEBUG_MY_MALLOC
+		printf("malloc: Piece 1: size %zu at %p\n", len, piece);
+		printf("malloc: Piece 2 (free): size %zu at %p\n", next_piece->size, next_piece);
+		#endif
+		
+		latency_mark(LATENCY_SPLIT);
+		usdt_probe(malloc_split, retaddr, len, next_piece->size);
+		return retaddr;
+	}
+	
+	else if(piece)
+	{	
+		#ifdef DEBUG_MY_MALLOC
+		printf("malloc: Planning to split a piece of size %zu at %p\n", piece->size, piece);
+		#endif
+		
+		//Shrink the size of the original segment to accomodate the requested lengths and a new seg header
+		stats_free_remove(piece->size);
+		heap_set(piece->size, piece->size - (len + sizeof(Heap_Seg)));
+		stats_free_add(piece->size);
+		stats_alloc_add(len);
+		free_index_update(piece, piece, piece->size);
+		
+		//Calculate the expected return address for the granted memory
+		retaddr = (uchar*)piece + sizeof(Heap_Seg);			//The actual start of the original segment
+		retaddr += piece->size + sizeof(Heap_Seg);			//The actual start of the splitted piece to be returned
+
+	
+		//Write a new allocation entry for the new splitted segment to be returned. 
+		//The shrunken free piece is still at its original location (LEFT side of the splitted/allocated piece)
+		write_alloc_header(retaddr - sizeof(Heap_Seg), len);
+		check_poison(retaddr, len, "when splitting a free piece");
+		
+		//Next fit tries the rest of this piece first
+		next_fit_rover = piece_prev;
+		
+		#ifdef DEBUG_MY_MALLOC
+		printf("malloc: Piece 1: size %zu at %p\n", len, retaddr - sizeof(Heap_Seg));
+		printf("malloc: Piece 2 (free): size %zu at %p\n", piece->size, piece);
+		#endif
+
+		latency_mark(LATENCY_SPLIT);
+		usdt_probe(malloc_split, retaddr, len, piece->size);
+		return retaddr;
+	}
+	
+	
+	/************************************************/
+	/*		Attempt 3: Allocate more heap space 	*/
+	/************************************************/
+	
+	//The new piece starts at the free piece at the tail of the heap (the "wilderness") if there is one, or at the break
+	
+	if(!free_index_last(&piece_prev, &piece))
+		for(piece = freelist_head, piece_prev = NULL; piece && seg_next(piece); piece_prev = piece, piece = seg_next(piece));
+	
+	if(piece && segment_end(piece) == malloc_break)
+		retaddr = (uchar*)piece + sizeof(Heap_Seg);
+	else
+	{
+		//The wilderness created after the new piece, if any, follows the last free piece
+		piece_prev = piece;
+		piece = NULL;
+		retaddr = malloc_break + sizeof(Heap_Seg);
+	}
+	
+	grow = tail_growth(len, malloc_break - (retaddr - sizeof(Heap_Seg)));
+
+	//Allocate additional heap space needed for the requested length and a new header
+	if(grow_malloc_break(grow))
+	{
+		#ifdef DEBUG_MY_MALLOC
+		printf("malloc: Using a new piece of size %zu at %p; Malloc break at %p\n", len, retaddr, malloc_break);
+		#endif
+		
+		if(piece)
+		{
+			stats_free_remove(piece->size);
+			free_index_remove(piece);
+			forget_free_piece(piece);
+		}
+		
+		write_alloc_header(retaddr - sizeof(Heap_Seg), len);
+		stats_alloc_add(len);
+		
+		//What is left after the new piece becomes the wilderness, replacing the old one in the freelist
+		if(malloc_break > retaddr + len)
+		{
+			piece = (Heap_Seg*)(retaddr + len);
+			write_seg_header(piece, malloc_break - (uchar*)piece - sizeof(Heap_Seg), NULL);
+			poison((uchar*)piece + sizeof(Heap_Seg), piece->size);
+			decay_stamp(piece);
+			stats_free_add(piece->size);
+			free_index_add(piece, piece->size);
+			
+			#ifdef DEBUG_MY_MALLOC
+			printf("malloc: Wilderness of size %zu at %p\n", piece->size, piece);
+			#endif
+		}
+		else
+			piece = NULL;
+		
+		if(piece_prev)
+			set_seg_next(piece_prev, piece);
+		else
+			freelist_head = piece;
+		
+		latency_mark(LATENCY_GROW);
+		usdt_probe(malloc_grow, retaddr, len);
+		return retaddr;
+	}
+	
+	//If we are unable to grow the break, there's nothing more we can do :(
+	return NULL;
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*								CALLOC		  							*/
+/************************************************************************/
+
+void* my_calloc(size_t nitems, size_t size)
+{
+	size_t total_len = nitems * size;
+	void *retaddr = my_malloc(total_len); 
+	
+	if(!retaddr)
+		return NULL;
+	memset(retaddr, 0, total_len);
+	
+	return retaddr;
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*								FREE		  							*/
+/************************************************************************/
+
+//Bytes the tail piece keeps when the break is lowered: top_pad, or more to keep the break at reserve_end
+static inline size_t tail_keep(Heap_Seg *p_entry)
+{
+	uchar *payload = (uchar*)p_entry + sizeof(Heap_Seg);
+	
+	if(reserve_end > payload && (size_t)(reserve_end - payload) > top_pad)
+		return reserve_end - payload;
+	return top_pad;
+}
+
+
+static void do_free(void *p)
+{
+	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
+	Heap_Seg *p_entry_prev = NULL;
+	size_t keep;
+	
+	#ifdef MY_MALLOC_HARDENED
+	Heap_Seg *next_entry;
+	#endif
+	
+	Heap_Seg *current_piece = NULL, *link;
+	Heap_Seg *closest_left = NULL, *closest_left_prev = NULL;
+	Heap_Seg *closest_right = NULL, *closest_right_prev = NULL;
+	
+	
+	if(!pointer_is_valid(p))
+		return;
+	
+	#ifdef DEBUG_MY_FREE
+	printf("free: Freeing %p of size %zu\n", p_entry, p_entry->size);
+	#endif
+	
+	/************************************************/
+	/*		Step 1: Freeing the requested piece 	*/
+	/************************************************/
+	
+	//Locate the closest neighbouring free segments to p in the free index, or by iterating through the current freelist
+	if(!free_index_around(p_entry, &closest_left_prev, &closest_left, &closest_right))
+	{
+		for(link = mangle_next(freelist_head); link != mangle_next(NULL); link = link_next(link))
+		{
+			current_piece = demangle_next(link);
+			if(current_piece < p_entry)
+			{
+				closest_left_prev = closest_left;
+				closest_left = current_piece;
+			}
+			else
+			{
+				closest_right_prev = closest_left;
+				closest_right = current_piece;
+				break;
+			}
+		}
+	}
+	
+	//There should never be an occurance where p_entry is in the freelist. This might be a double free attempt
+	if(closest_right == p_entry)
+	{
+		fprintf(stderr, "Double free detected! Free Piece %p, size %zu, next %p\n", closest_right, closest_right->size, seg_next(closest_right));
+		usdt_probe(invalid_pointer, p, "double free");
+		return;
+	}
+	
+	#ifdef MY_MALLOC_HARDENED
+	//The header right after p must be the next free piece, or an allocated piece with an intact canary. Otherwise p was overrun.
+	next_entry = (Heap_Seg*)segment_end(p_entry);
+	if((uchar*)next_entry < malloc_break && next_entry != closest_right && !seg_is_in_use(next_entry))
+	{
+		fprintf(stderr, "Heap overflow detected! The header after %p (size %zu) was overwritten\n", p_entry, p_entry->size);
+		usdt_probe(invalid_pointer, p, "overflow");
+		return;
+	}
+	#endif
+	
+	//Write a new freelist entry at the beginning of the freed block
+	stats_alloc_remove(p_entry->size);
+	stats_free_add(p_entry->size);
+	free_index_add(p_entry, p_entry->size);
+	
+	if(!closest_left)
+	{
+		set_seg_next(p_entry, freelist_head);
+		freelist_head = p_entry;
+	}
+	else
+	{
+		set_seg_next(p_entry, seg_next(closest_left));
+		set_seg_next(closest_left, p_entry);
+		p_entry_prev = closest_left;
+	}
+	
+	latency_mark(LATENCY_INSERT);
+	
+	
+	/************************************************/
+	/*	Step 2: Merge with adjacent right piece	 	*/
+	/************************************************/
+	
+	if(closest_right && segment_end(p_entry) == (uchar*)closest_right)
+	{
+		//Update new header, and erase the old one
+		stats_free_remove(p_entry->size);
+		stats_free_remove(closest_right->size);
+		heap_set(p_entry->size, p_entry->size + closest_right->size + sizeof(Heap_Seg));
+		stats_free_add(p_entry->size);
+		free_index_remove(closest_right);
+		free_index_update(p_entry, p_entry, p_entry->size);
+		set_seg_next(p_entry, seg_next(closest_right));
+		forget_free_piece(closest_right);
+		wipe_seg_header(closest_right);
+		
+		#ifdef DEBUG_MY_FREE
+		printf("free: Merged with adjacent right piece. New size %zu at %p\n", p_entry->size, p_entry);
+		#endif
+		
+		latency_mark(LATENCY_MERGE_RIGHT);
+		usdt_probe(free_merge_right, p_entry, p_entry->size);
+	}
+	
+	
+	/************************************************/
+	/*	Step 3: Merge with adjacent left piece	 	*/
+	/************************************************/
+	
+	if(closest_left && segment_end(closest_left) == (uchar*)p_entry)
+	{	
+		//Update the header new header, and erase the old one
+		stats_free_remove(closest_left->size);
+		stats_free_remove(p_entry->size);
+		heap_set(closest_left->size, closest_left->size + p_entry->size + sizeof(Heap_Seg));
+		stats_free_add(closest_left->size);
+		free_index_remove(p_entry);
+		free_index_update(closest_left, closest_left, closest_left->size);
+		set_seg_next(closest_left, seg_next(p_entry));
+		forget_free_piece(p_entry);
+		wipe_seg_header(p_entry);
+		p_entry = closest_left;
+		p_entry_prev = closest_left_prev;
+		
+		#ifdef DEBUG_MY_FREE
+		printf("free: Merged with adjacent left piece. New size %zu at %p\n", p_entry->size, p_entry);
+		#endif
+		
+		latency_mark_merge_left();
+		usdt_probe(free_merge_left, p_entry, p_entry->size);
+	}
+	
+	decay_stamp(p_entry);
+	
+
+	/************************************************/
+	/*			Step 4: Reduce Malloc Break		 	*/
+	/************************************************/
+	
+	//The tail piece is kept as the wilderness until it reaches trim_threshold bytes, and is then trimmed down to top_pad bytes
+	if(segment_end(p_entry) == malloc_break && !seg_next(p_entry) && p_entry->size + sizeof(Heap_Seg) >= heap_trim_threshold())
+	{
+		keep = tail_keep(p_entry);
+		
+		if(!keep)
+		{
+			//Reduce the break to where the tail piece ends, and erase the old header
+			stats_free_remove(p_entry->size);
+			free_index_remove(p_entry);
+			malloc_break = (uchar*)p_entry;
+			forget_free_piece(p_entry);
+			write_seg_header(p_entry, 0, NULL);
+			
+			//Update freelist
+			if(p_entry_prev)
+				set_seg_next(p_entry_prev, NULL);
+			else
+				freelist_head = NULL;
+			
+			#ifdef DEBUG_MY_FREE
+			printf("free: Eliminated new free piece by reducing malloc break to %p\n", malloc_break);
+			#endif
+			
+			usdt_probe(break_shrink, malloc_break);
+			os_release_tail();
+		}
+		else if(p_entry->size > keep)
+		{
+			stats_free_remove(p_entry->size);
+			heap_set(p_entry->size, keep);
+			stats_free_add(p_entry->size);
+			free_index_update(p_entry, p_entry, p_entry->size);
+			malloc_break = segment_end(p_entry);
+			
+			#ifdef DEBUG_MY_FREE
+			printf("free: Trimmed the tail piece to %zu bytes, reducing malloc break to %p\n", keep, malloc_break);
+			#endif
+			
+			usdt_probe(break_shrink, malloc_break);
+			os_release_tail();
+		}
+	}
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							FASTBINS		  							*/
+/************************************************************************/
+
+/*
+*	Small blocks are often freed and then allocated again at the same size. Instead of coalescing such a block with its 
+*	neighbours (only for malloc to split it off again), free pushes it onto the fastbin for its exact size, and malloc pops
+*	it back in O(1). Binned blocks are consolidated into the freelist in one batch, once the fastbins hold more than 
+*	fastbin_threshold bytes, or when malloc cannot otherwise serve a request larger than fastbin_max or grow the heap.
+*/
+
+#ifdef MY_MALLOC_FASTBINS
+
+static void fastbin_free(void *p)
+{
+	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
+	size_t len;
+	
+	if(!pointer_is_valid(p))
+		return;
+	
+	len = p_entry->size;
+	if(len < FASTBIN_MIN || len > fastbin_max)
+	{
+		do_free(p);
+		return;
+	}
+	
+	p_entry->next = seg_binned(p_entry, len);
+	set_fastbin_next(p_entry, fastbins[len]);
+	fastbins[len] = p_entry;
+	fastbin_bytes += len;
+	
+	#ifdef DEBUG_MY_FREE
+	printf("free: Holding %p of size %zu in its fastbin (%zu bytes binned)\n", p_entry, len, fastbin_bytes);
+	#endif
+	
+	if(fastbin_bytes > fastbin_threshold)
+		fastbin_consolidate();
+	
+	latency_mark(LATENCY_DEFERRED);
+}
+
+
+static void fastbin_consolidate(void)
+{
+	Heap_Seg *p_entry;
+	size_t len;
+	
+	#ifdef DEBUG_MY_FREE
+	if(fastbin_bytes)
+		printf("free: Consolidating %zu bytes from the fastbins\n", fastbin_bytes);
+	#endif
+	
+	for(len = FASTBIN_MIN; len <= MY_MALLOC_FASTBIN_MAX; len++)
+	{
+		while(fastbins[len])
+		{
+			p_entry = fastbins[len];
+			fastbins[len] = fastbin_next(p_entry);
+			
+			//The link overwrote the start of the block, which free memory must have poisoned when the quarantine is on
+			poison((uchar*)p_entry + sizeof(Heap_Seg), sizeof(Heap_Seg*));
+			write_alloc_header(p_entry, len);
+			do_free((uchar*)p_entry + sizeof(Heap_Seg));
+		}
+	}
+	
+	fastbin_bytes = 0;
+}
+
+
+//Forgets the fastbins without touching the blocks, used when the heap they belong to is replaced
+static void fastbin_reset(void)
+{
+	memset(fastbins, 0, sizeof(fastbins));
+	fastbin_bytes = 0;
+}
+
+
+static int set_fastbin_max(size_t max)
+{
+	if(max > MY_MALLOC_FASTBIN_MAX)
+	{
+		fprintf(stderr,"mallopt: Fastbins hold at most %d bytes\n", MY_MALLOC_FASTBIN_MAX);
+		return 0;
+	}
+	
+	//Blocks above the new limit would otherwise stay binned
+	fastbin_consolidate();
+	fastbin_max = max;
+	return 1;
+}
+
+#else
+
+#define fastbin_free(p)		do_free(p)
+
+#endif
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							QUARANTINE		  							*/
+/************************************************************************/
+
+/*
+*	Freed blocks are poisoned and held in a FIFO before they are really freed, so that a dangling pointer keeps pointing at
+*	poisoned memory for a while. The oldest blocks are released once the quarantine holds more than quarantine_budget bytes
+*	(or runs out of slots), after checking that their poison is still intact.
+*/
+
+#ifdef MY_MALLOC_QUARANTINE
+
+static Heap_Seg *quarantine[MY_MALLOC_QUARANTINE_SLOTS];
+static size_t quarantine_first;							//Index of the oldest block
+static size_t quarantine_count;
+static size_t quarantine_bytes;
+
+
+static void quarantine_release_oldest(void)
+{
+	Heap_Seg *p_entry = quarantine[quarantine_first];
+	
+	quarantine_first = (quarantine_first + 1) % MY_MALLOC_QUARANTINE_SLOTS;
+	quarantine_count--;
+	quarantine_bytes -= p_entry->size;
+	
+	check_poison((uchar*)p_entry + sizeof(Heap_Seg), p_entry->size, "while in quarantine");
+	
+	#ifdef DEBUG_MY_FREE
+	printf("free: Releasing %p of size %zu from quarantine\n", p_entry, p_entry->size);
+	#endif
+	
+	write_alloc_header(p_entry, p_entry->size);
+	fastbin_free((uchar*)p_entry + sizeof(Heap_Seg));
+}
+
+
+static void quarantine_free(void *p)
+{
+	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
+	
+	if(!quarantine_budget)
+	{
+		fastbin_free(p);
+		return;
+	}
+	
+	if(!pointer_is_valid(p))
+		return;
+	
+	poison(p, p_entry->size);
+	heap_set(p_entry->next, seg_quarantined(p_entry, p_entry->size));
+	
+	quarantine[(quarantine_first + quarantine_count) % MY_MALLOC_QUARANTINE_SLOTS] = p_entry;
+	quarantine_count++;
+	quarantine_bytes += p_entry->size;
+	
+	#ifdef DEBUG_MY_FREE
+	printf("free: Holding %p of size %zu in quarantine (%zu bytes held)\n", p_entry, p_entry->size, quarantine_bytes);
+	#endif
+	
+	while(quarantine_count && (quarantine_bytes > quarantine_budget || quarantine_count == MY_MALLOC_QUARANTINE_SLOTS))
+		quarantine_release_oldest();
+	
+	latency_mark(LATENCY_DEFERRED);
+}
+
+
+static void quarantine_flush(void)
+{
+	while(quarantine_count)
+		quarantine_release_oldest();
+}
+
+
+//Forgets the quarantine without touching the blocks, used when the heap it belongs to is replaced
+static void quarantine_reset(void)
+{
+	quarantine_first = 0;
+	quarantine_count = 0;
+	quarantine_bytes = 0;
+}
+
+
+static void set_quarantine_budget(size_t budget)
+{
+	Heap_Seg *current_piece;
+	
+	//Free memory was not poisoned while the quarantine was off
+	if(budget && !quarantine_budget)
+	{
+		quarantine_budget = budget;
+		for(current_piece = freelist_head; current_piece; current_piece = seg_next(current_piece))
+			poison((uchar*)current_piece + sizeof(Heap_Seg), current_piece->size);
+	}
+	
+	//Release what no longer fits while the poison is still being checked
+	while(quarantine_count && quarantine_bytes > budget)
+		quarantine_release_oldest();
+	
+	quarantine_budget = budget;
+}
+
+#else
+
+#define quarantine_free(p)		fastbin_free(p)
+
+#endif
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*								REALLOC		  							*/
+/************************************************************************/
+
+//Gives the space past len back to the heap, unless it is too small to hold a header of its own
+static void shrink_in_place(Heap_Seg *p_entry, size_t len)
+{
+	Heap_Seg *new_entry;
+	size_t size_diff = p_entry->size - len;
+	
+	//Don't shrink if the size difference isn't big enough to insert a new segment header
+	if(size_diff <= sizeof(Heap_Seg))
+	{
+		#ifdef DEBUG_MY_REALLOC
+		printf("realloc: size difference too insignificant. The piece will not be shrunk.\n");
+		#endif
+		return;
+	}
+	
+	stats_alloc_remove(p_entry->size);
+	write_alloc_header(p_entry, len);
+	stats_alloc_add(len);
+	
+	//Write a new header for the free piece above the shrunk piece and mark it free
+	new_entry = (Heap_Seg*)segment_end(p_entry);
+	write_alloc_header(new_entry, size_diff - sizeof(Heap_Seg));
+	poison((uchar*)new_entry + sizeof(Heap_Seg), new_entry->size);
+	stats_alloc_add(new_entry->size);
+	
+	#ifdef DEBUG_MY_REALLOC
+	printf("realloc: New shrunk piece of size %zu at %p\n", len, p_entry);
+	printf("realloc: Freeing the space above the shrunk piece (size %zu at %p)\n", new_entry->size, new_entry);
+	#endif
+	
+	do_free((uchar*)new_entry + sizeof(Heap_Seg));
+}
+
+
+/*
+*	Grows p_entry to len bytes without moving it, either at the break or into its adjacent right piece. right is the 
+*	closest free piece after p_entry and right_prev the one before it in the freelist, both NULL if there are none.
+*	Returns 0 and leaves the piece untouched if neither has enough room.
+*/
+static int grow_in_place(Heap_Seg *p_entry, size_t len, Heap_Seg *right, Heap_Seg *right_prev)
+{
+	Heap_Seg *new_entry, *last;
+	size_t old_size = p_entry->size, size_diff = len - old_size, new_size, grow;
+	
+	#ifdef MY_MALLOC_FREE_INDEX
+	Heap_Seg *last_prev;
+	#endif
+	
+	
+	/****************************************/
+	/*	Growing In-place, At the break		*/
+	/****************************************/
+
+	//If the expanding piece is at the malloc break, grow the break like malloc does, so that a piece growing a little 
+	//at a time does not move the break on every call
+	if(segment_end(p_entry) == malloc_break)
+	{
+		grow = tail_growth(len, old_size + sizeof(Heap_Seg));
+		if(grow > break_room() || !grow_malloc_break(grow))
+			return 0;
+		
+		stats_alloc_remove(p_entry->size);
+		write_alloc_header(p_entry, len);
+		stats_alloc_add(len);
+		
+		//The padding becomes the wilderness, after every other free piece
+		if(malloc_break > segment_end(p_entry))
+		{
+			if(!free_index_last(&last_prev, &last))
+				for(last = freelist_head; last && seg_next(last); last = seg_next(last));
+			
+			new_entry = (Heap_Seg*)segment_end(p_entry);
+			write_seg_header(new_entry, malloc_break - (uchar*)new_entry - sizeof(Heap_Seg), NULL);
+			poison((uchar*)new_entry + sizeof(Heap_Seg), new_entry->size);
+			decay_stamp(new_entry);
+			stats_free_add(new_entry->size);
+			free_index_add(new_entry, new_entry->size);
+			
+			if(last)
+				set_seg_next(last, new_entry);
+			else
+				freelist_head = new_entry;
+		}
+		
+		#ifdef DEBUG_MY_REALLOC
+		printf("realloc: Expanding malloc break to %p for growth\n", malloc_break);
+		#endif
+		
+		return 1;
+	}
+	
+	
+	
+	/****************************************/
+	/*	Growing In-place, adjacent right	*/
+	/****************************************/
+	
+	if(!right || segment_end(p_entry) != (uchar*)right)
+		return 0;
+	
+	//If the right piece is the wilderness but too small, grow the break first, the same way as at the break
+	if(segment_end(right) == malloc_break && right->size + sizeof(Heap_Seg) < size_diff
+		&& (grow = tail_growth(len, malloc_break - (uchar*)p_entry)) <= break_room()
+		&& grow_malloc_break(grow))
+	{
+		stats_free_remove(right->size);
+		heap_set(right->size, malloc_break - (uchar*)right - sizeof(Heap_Seg));
+		stats_free_add(right->size);
+		free_index_update(right, right, right->size);
+		
+		#ifdef DEBUG_MY_REALLOC
+		printf("realloc: Expanding malloc break to %p to grow the wilderness\n", malloc_break);
+		#endif
+	}
+	
+	//Merging with adjacent right piece yields excess free spaces (with a new header added)
+	if(right->size > size_diff)
+	{
+		#ifdef DEBUG_MY_REALLOC
+		printf("realloc: Planning to split adjacent right piece of size %zu at %p for merging\n", right->size, right);
+		#endif
+		
+		stats_free_remove(right->size);
+		stats_alloc_remove(p_entry->size);
+		write_alloc_header(p_entry, len);
+		stats_alloc_add(len);
+		
+		//Write a free segment entry for the left over free space
+		new_entry = (Heap_Seg*)segment_end(p_entry);
+		forget_free_piece(right);
+		write_seg_header(new_entry, right->size - size_diff, seg_next(right));
+		decay_stamp(new_entry);
+		stats_free_add(new_entry->size);
+		free_index_update(right, new_entry, new_entry->size);
+		
+		//Update Freelist chain
+		if(right_prev)
+			set_seg_next(right_prev, new_entry);
+		else
+			freelist_head = new_entry;
+		
+		#ifdef DEBUG_MY_REALLOC
+		printf("realloc: Expanded Piece: size %zu at %p\n", len, p_entry);
+		printf("realloc: Free Piece: size %zu at %p\n", new_entry->size, new_entry);
+		#endif
+		
+		//Wipe the old seg entry, as it's now part of the allocated memory
+		if(size_diff > sizeof(Heap_Seg))
+			write_seg_header(right, 0, NULL);
+			
+		return 1;
+	}
+	
+	//Merging with the whole adjacent right piece (with the header consumed). 
+	//If the fit isn't exact, the few bytes left over are too small for a header and stay with the expanded piece.
+	if(right->size + sizeof(Heap_Seg) >= size_diff)
+	{
+		new_size = old_size + sizeof(Heap_Seg) + right->size;
+		
+		stats_free_remove(right->size);
+		stats_alloc_remove(old_size);
+		write_alloc_header(p_entry, new_size);
+		stats_alloc_add(new_size);
+		free_index_remove(right);
+		
+		//Update Freelist chain
+		if(right_prev)
+			set_seg_next(right_prev, seg_next(right));
+		else
+			freelist_head = seg_next(right);
+
+		//Wipe the old seg entry, as it's now part of the allocated memory
+		forget_free_piece(right);
+		write_seg_header(right, 0, NULL);
+		
+		#ifdef DEBUG_MY_REALLOC
+		printf("realloc: Merging with the whole adjacent right piece. New size %zu at %p\n", p_entry->size, p_entry);
+		#endif
+		
+		return 1;
+	}
+	
+	return 0;
+}
+
+
+static void* do_realloc(void *p, size_t len)
+{
+	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
+	
+	size_t old_size;
+	uchar* retaddr = NULL;
+	
+	Heap_Seg *current_piece = NULL;
+	Heap_Seg *closest_left = NULL;
+	Heap_Seg *closest_right = NULL, *closest_right_prev = NULL;
+	
+	//Only the paths growing leftwards need these, and the free index fills in closest_left_prev regardless
+	#if !defined(MY_MALLOC_PERSISTENT) || defined(MY_MALLOC_FREE_INDEX)
+	Heap_Seg *closest_left_prev = NULL;
+	#endif
+	
+	#ifndef MY_MALLOC_PERSISTENT
+	Heap_Seg *new_entry = NULL;
+	size_t size_diff, new_size;
+	#endif
+	
+	
+	if(!pointer_is_valid(p))
+		return NULL;
+	
+	old_size = p_entry->size;
+	
+	#ifdef DEBUG_MY_REALLOC
+	printf("realloc: Resizing %p, current size %zu, new size %zu\n", p_entry, p_entry->size, len);
+	#endif
+	
+	if(len == old_size)
+		return p;
+	
+	//Shrinking always happens in place
+	else if(len < old_size)
+	{
+		shrink_in_place(p_entry, len);
+		return p;
+	}
+	
+	//A piece at the break grows without looking for its neighbours
+	if(segment_end(p_entry) == malloc_break && grow_in_place(p_entry, len, NULL, NULL))
+		return p;
+	
+	
+	//Find the closest adjacent free pieces to p in the free index or the freelist
+	if(free_index_around(p_entry, &closest_left_prev, &closest_left, &closest_right))
+		closest_right_prev = closest_left;
+	else
+	{
+		for(current_piece = freelist_head; current_piece; current_piece = seg_next(current_piece))
+		{
+			if(current_piece < p_entry)
+			{
+				#ifndef MY_MALLOC_PERSISTENT
+				closest_left_prev = closest_left;
+				#endif
+				closest_left = current_piece;
+			}
+			else
+			{
+				closest_right_prev = closest_left;
+				closest_right = current_piece;
+				break;
+			}
+		}
+	}
+	
+	//There should never be an occurance where p_entry is in the freelist. This might be a double free attempt
+	if(closest_right == p_entry)
+	{
+		fprintf(stderr, "Double free detected! Free Piece %p, size %zu, next %p\n", closest_right, closest_right->size, seg_next(closest_right));
+		return NULL;
+	}
+	
+	if(segment_end(p_entry) != malloc_break && grow_in_place(p_entry, len, closest_right, closest_right_prev))
+		return p;
+	
+	
+	
+	/****************************************/
+	/*	Growing In-place, adjacent left		*/
+	/****************************************/
+	
+	//Shifting the data leftwards overwrites the original copy, which an undo log cannot bring back after a crash.
+	//Persistent heaps take the copying path below instead, which leaves the original intact until it is freed.
+	#ifndef MY_MALLOC_PERSISTENT
+	size_diff = len - old_size;
+	
+	if(closest_left && segment_end(closest_left) == (uchar*)p_entry)
+	{	
+		//Merging with adjacent left piece yields excess free spaces
+		if(closest_left->size > size_diff)
+		{
+			#ifdef DEBUG_MY_REALLOC
+			printf("realloc: Planning to split adjacent left piece of size %zu at %p for merging\n", closest_left->size, closest_left);
+			#endif
+			
+			stats_free_remove(closest_left->size);
+			stats_alloc_remove(old_size);
+			stats_alloc_add(len);
+			closest_left->size -= size_diff;
+			stats_free_add(closest_left->size);
+			free_index_update(closest_left, closest_left, closest_left->size);
+			
+			//Shift existing data over, then write a new segment header at the expanded location.
+			//Both the data and the new header may overlap the old piece.
+			new_entry = (Heap_Seg*)segment_end(closest_left);
+			retaddr = (uchar*)new_entry + sizeof(Heap_Seg);
+			memmove(retaddr, p, old_size);
+			write_alloc_header(new_entry, len);
+			
+			
+			#ifdef DEBUG_MY_REALLOC
+			printf("realloc: Expanded Piece: size %zu at %p\n", new_entry->size, new_entry);
+			printf("realloc: Free Piece: size %zu at %p\n", closest_left->size, closest_left);
+			#endif
+			
+			return retaddr;
+		}
+		
+		//Merging with the whole adjacent left piece (with the header consumed)
+		else if(closest_left->size + sizeof(Heap_Seg) >= size_diff)
+		{
+			new_size = closest_left->size + sizeof(Heap_Seg) + old_size;
+			
+			#ifdef DEBUG_MY_REALLOC
+			printf("realloc: Merging with the whole adjacent left piece. New piece at %p, size %zu\n", closest_left, new_size);
+			#endif
+			
+			retaddr = (uchar*)closest_left + sizeof(Heap_Seg);
+			stats_free_remove(closest_left->size);
+			stats_alloc_remove(old_size);
+			stats_alloc_add(new_size);
+			free_index_remove(closest_left);
+			
+			//Update Freelist chain
+			if(closest_left_prev)
+				set_seg_next(closest_left_prev, seg_next(closest_left));
+			else
+				freelist_head = seg_next(closest_left);
+			forget_free_piece(closest_left);
+			
+			//Shift existing data over
+			memmove(retaddr, p, old_size);
+			write_alloc_header(closest_left, new_size);
+			
+			return retaddr;
+		}
+	}
+	
+	
+	
+	/****************************************/
+	/*	Growing In-place, both neighbours	*/
+	/****************************************/
+	
+	/*Neither neighbour is large enough alone, but both of them together might be. 
+	The right piece is consumed whole, and only as much of the left piece as needed, so the data is shifted as little as possible.
+	Since the two pieces are adjacent to p, the left piece is always the one preceding the right piece in the freelist.*/
+	
+	if(closest_left && segment_end(closest_left) == (uchar*)p_entry && closest_right && segment_end(p_entry) == (uchar*)closest_right
+		&& closest_left->size + closest_right->size + 2*sizeof(Heap_Seg) >= size_diff)
+	{
+		//The amount still needed from the left piece after consuming the right piece. Always positive here.
+		size_diff -= closest_right->size + sizeof(Heap_Seg);
+		
+		stats_free_remove(closest_left->size);
+		stats_free_remove(closest_right->size);
+		stats_alloc_remove(old_size);
+		free_index_remove(closest_right);
+		
+		if(closest_left->size > size_diff)
+		{
+			//Shrink the left piece, and place the expanded piece right after it
+			closest_left->size -= size_diff;
+			stats_free_add(closest_left->size);
+			free_index_update(closest_left, closest_left, closest_left->size);
+			set_seg_next(closest_left, seg_next(closest_right));
+			
+			new_entry = (Heap_Seg*)segment_end(closest_left);
+			new_size = len;
+		}
+		else
+		{
+			//Consume the left piece entirely. Any excess too small for a header stays with the expanded piece.
+			free_index_remove(closest_left);
+			if(closest_left_prev)
+				set_seg_next(closest_left_prev, seg_next(closest_right));
+			else
+				freelist_head = seg_next(closest_right);
+			forget_free_piece(closest_left);
+			
+			new_entry = closest_left;
+			new_size = segment_end(closest_right) - (uchar*)closest_left - sizeof(Heap_Seg);
+		}
+		
+		//Wipe the right piece's header, as it's now part of the allocated memory. It lies above the shifted data.
+		forget_free_piece(closest_right);
+		write_seg_header(closest_right, 0, NULL);
+		
+		retaddr = (uchar*)new_entry + sizeof(Heap_Seg);
+		memmove(retaddr, p, old_size);
+		write_alloc_header(new_entry, new_size);
+		stats_alloc_add(new_size);
+		
+		#ifdef DEBUG_MY_REALLOC
+		printf("realloc: Merged with both adjacent pieces. New piece at %p, size %zu\n", new_entry, new_size);
+		#endif
+		
+		return retaddr;
+	}
+	#endif
+	
+	
+	
+	
+	/****************************************/
+	/*		New Allocation for growth		*/
+	/****************************************/
+	
+	#ifdef DEBUG_MY_REALLOC
+	printf("realloc: Cannot grow in-place. Allocating a new piece using malloc...\n");
+	#endif
+	
+	retaddr = do_malloc(len);
+	
+	if(!retaddr) 
+		return NULL;
+	
+	memcpy(retaddr, p, p_entry->size);
+	quarantine_free(p);
+
+	return retaddr;
+}
+
+
+
+//Hands the blocks held for reuse back to the heap, where they merge with their free neighbours. The heap must be locked.
+static void release_held_blocks(void)
+{
+	#ifdef MY_MALLOC_PERCPU
+	percpu_reclaim();
+	#endif
+	
+	#ifdef MY_MALLOC_QUARANTINE
+	quarantine_flush();
+	#endif
+	
+	#ifdef MY_MALLOC_FASTBINS
+	fastbin_consolidate();
+	#endif
+}
+
+
+/*
+*	Resizes p to somewhere between min_len and max_len without ever moving it, and returns the resulting usable size. 
+*	The piece is shrunk if it is larger than max_len, and otherwise grown as close to max_len as the break or the 
+*	adjacent right piece allows. If it cannot reach min_len in place, it is left untouched.
+*/
+static size_t do_expand(void *p, size_t min_len, size_t max_len)
+{
+	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
+	Heap_Seg *right = NULL, *right_prev = NULL, *next_entry;
+	size_t available = 0, target;
+	
+	#ifdef MY_MALLOC_FREE_INDEX
+	Heap_Seg *left_prev;
+	#endif
+	
+	if(!pointer_is_valid(p))
+		return 0;
+	
+	if(max_len < min_len)
+		max_len = min_len;
+	
+	if(p_entry->size > max_len)
+	{
+		shrink_in_place(p_entry, max_len);
+		return p_entry->size;
+	}
+	
+	//A neighbour held for reuse is not free space yet
+	next_entry = (Heap_Seg*)segment_end(p_entry);
+	if((uchar*)next_entry < malloc_break && !seg_is_allocated(next_entry) && seg_is_in_use(next_entry))
+		release_held_blocks();
+	
+	//Find how far the piece could grow at the break, or into the adjacent right piece
+	if(segment_end(p_entry) == malloc_break)
+		available = break_room();
+	else
+	{
+		if(!free_index_around(p_entry, &left_prev, &right_prev, &right))
+			for(right = freelist_head; right && right < p_entry; right_prev = right, right = seg_next(right));
+		
+		if(right && segment_end(p_entry) == (uchar*)right)
+		{
+			available = right->size + sizeof(Heap_Seg);
+			
+			//The wilderness can be extended by growing the break
+			if(segment_end(right) == malloc_break)
+				available += break_room();
+		}
+	}
+	
+	target = p_entry->size + available;
+	if(target > max_len)
+		target = max_len;
+	
+	#ifdef DEBUG_MY_REALLOC
+	printf("expand: Piece %p of size %zu can grow in place by %zu. Requested %zu to %zu\n", p_entry, p_entry->size, available, min_len, max_len);
+	#endif
+	
+	if(target >= min_len && target > p_entry->size)
+		grow_in_place(p_entry, target, right, right_prev);
+	
+	return p_entry->size;
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							ALIGNED ALLOCATION							*/
+/************************************************************************/
+
+/*
+*	Segments are packed back to back without any padding, so my_malloc() gives no alignment guarantees. do_memalign() 
+*	rounds the length up to the alignment, so that as long as blocks are allocated this way (and the headers are no larger
+*	than the alignment), each one ends where an aligned block can start. Otherwise, it allocates enough to find an aligned 
+*	address inside, with room for a header in front of it. The space before that header is freed as a piece of its own, 
+*	and the space after the block is given back by shrinking it.
+*/
+
+static void* do_memalign(size_t align, size_t len)
+{
+	uchar *p, *aligned;
+	Heap_Seg *p_entry;
+	size_t size, lead;
+	
+	if(!align || (align & (align - 1)))
+	{
+		fprintf(stderr,"memalign: Alignment %zu is not a power of two\n", align);
+		return NULL;
+	}
+	
+	len = (len + align - 1) & ~(align - 1);
+	p = do_malloc(len);
+	if(!p || !((uintptr_t)p & (align - 1)))
+		return p;
+	
+	poison(p, ((Heap_Seg*)(p - sizeof(Heap_Seg)))->size);
+	do_free(p);
+	
+	p = do_malloc(len + align + 2*sizeof(Heap_Seg));
+	if(!p)
+		return NULL;
+	
+	//The piece left in front must have room for a header of its own
+	aligned = (uchar*)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+	if(aligned != p && (size_t)(aligned - p) < 2*sizeof(Heap_Seg))
+		aligned = (uchar*)(((uintptr_t)p + 2*sizeof(Heap_Seg) + align - 1) & ~(uintptr_t)(align - 1));
+	
+	if(aligned != p)
+	{
+		p_entry = (Heap_Seg*)(p - sizeof(Heap_Seg));
+		size = p_entry->size;
+		lead = aligned - p;
+		
+		stats_alloc_remove(size);
+		write_alloc_header(aligned - sizeof(Heap_Seg), size - lead);
+		write_alloc_header(p_entry, lead - sizeof(Heap_Seg));
+		stats_alloc_add(size - lead);
+		stats_alloc_add(lead - sizeof(Heap_Seg));
+		
+		#ifdef DEBUG_MY_MALLOC
+		printf("memalign: Freeing %zu bytes in front of %p to align it to %zu\n", lead, aligned, align);
+		#endif
+		
+		poison(p, lead - sizeof(Heap_Seg));
+		do_free(p);
+	}
+	
+	return do_realloc(aligned, len);
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							PER-CPU CACHES	  							*/
+/************************************************************************/
+
+/*
+*	With MY_MALLOC_PERCPU, the heap may be used by several threads. The heap itself (the "central" heap) is protected by 
+*	one lock, and in front of it, every CPU has a cache of small blocks with one LIFO list per size class. Small requests
+*	are served from the cache of the CPU the thread runs on, without taking the lock. An empty list is refilled from the 
+*	central heap in a batch, and a full one hands half of its blocks back in a batch, so the memory held in caches grows 
+*	with the number of CPUs rather than the number of threads.
+*
+*	The CPU number is read from the thread's rseq area, which glibc registers with the kernel, and from sched_getcpu()
+*	where that is unavailable. A thread may be preempted or migrate while it works on a cache, so each cache is also 
+*	claimed with an atomic flag. It is only ever contended by a thread that got preempted on the same CPU; the other 
+*	thread then simply goes to the central heap.
+*
+*	Cached blocks keep their allocated headers (with a marker, see seg_cached) and count as allocated in heap walks and
+*	statistics. heap_check(), heap_walk() and the other calls outside the ENTRY POINTS still need the heap to be idle.
+*/
+
+#ifdef MY_MALLOC_PERCPU
+
+#define PERCPU_CLASSES				(MY_MALLOC_PERCPU_MAX / PERCPU_GRANULE)
+#define PERCPU_GRANULE				16
+#define PERCPU_BATCH				(MY_MALLOC_PERCPU_DEPTH / 2)
+
+#define percpu_class(len)			(((len) - 1) / PERCPU_GRANULE)			//Smallest class holding len bytes
+#define percpu_link(p_entry)		((Heap_Seg**)((uchar*)(p_entry) + sizeof(Heap_Seg)))		//Mangled in hardened builds
+#define percpu_next(p_entry)		mangle_ptr(percpu_link(p_entry), *percpu_link(p_entry))
+#define set_percpu_next(p_entry, next)	(*percpu_link(p_entry) = mangle_ptr(percpu_link(p_entry), next))
+
+typedef struct {
+	
+	atomic_int busy;
+	unsigned count[PERCPU_CLASSES];
+	Heap_Seg *blocks[PERCPU_CLASSES];
+	
+}__attribute__((aligned(64))) Percpu_Cache;
+
+static Percpu_Cache percpu_caches[MY_MALLOC_PERCPU_SLOTS];
+static pthread_mutex_t central_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define heap_lock()			pthread_mutex_lock(&central_lock)
+#define heap_unlock()		pthread_mutex_unlock(&central_lock)
+
+
+static inline Percpu_Cache* current_cache(void)
+{
+	int cpu = -1;
+	
+	#ifdef PERCPU_RSEQ
+	if(__rseq_size)
+		cpu = (int)((volatile struct rseq*)((uchar*)__builtin_thread_pointer() + __rseq_offset))->cpu_id;
+	#endif
+	
+	if(cpu < 0)
+		cpu = sched_getcpu();
+	
+	return &percpu_caches[(unsigned)cpu % MY_MALLOC_PERCPU_SLOTS];
+}
+
+
+//Frees the cached blocks of a class on the central heap, until count of them are left. The heap must be locked.
+static void percpu_drain(Percpu_Cache *cache, size_t cls, unsigned count)
+{
+	Heap_Seg *p_entry;
+	
+	while(cache->count[cls] > count)
+	{
+		p_entry = cache->blocks[cls];
+		cache->blocks[cls] = percpu_next(p_entry);
+		cache->count[cls]--;
+		
+		//Like fastbins, the link overwrote the first payload word
+		poison((uchar*)p_entry + sizeof(Heap_Seg), sizeof(Heap_Seg*));
+		p_entry->next = seg_canary(p_entry, p_entry->size);
+		quarantine_free((uchar*)p_entry + sizeof(Heap_Seg));
+	}
+}
+
+
+static void* percpu_alloc(size_t len)
+{
+	Percpu_Cache *cache = current_cache();
+	size_t cls = percpu_class(len);
+	Heap_Seg *p_entry;
+	void *block;
+	
+	if(atomic_exchange_explicit(&cache->busy, 1, memory_order_acquire))
+		return NULL;
+	
+	if(!cache->blocks[cls])
+	{
+		heap_lock();
+		while(cache->count[cls] < PERCPU_BATCH && (block = do_malloc((cls + 1) * PERCPU_GRANULE)) != NULL)
+		{
+			p_entry = block - sizeof(Heap_Seg);
+			set_percpu_next(p_entry, cache->blocks[cls]);
+			cache->blocks[cls] = p_entry;
+			cache->count[cls]++;
+		}
+		heap_generation++;
+		heap_unlock();
+	}
+	
+	p_entry = cache->blocks[cls];
+	if(p_entry)
+	{
+		cache->blocks[cls] = percpu_next(p_entry);
+		cache->count[cls]--;
+		p_entry->next = seg_canary(p_entry, p_entry->size);
+		latency_mark(LATENCY_EXACT);
+	}
+	
+	atomic_store_explicit(&cache->busy, 0, memory_order_release);
+	return p_entry ? (uchar*)p_entry + sizeof(Heap_Seg) : NULL;
+}
+
+
+//Returns 0 if the block must be freed on the central heap instead
+static int percpu_free(void *p)
+{
+	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
+	Percpu_Cache *cache;
+	size_t cls;
+	
+	//Invalid blocks, and blocks too small or too large for any class, are left to the checks of the central free.
+	//The range is checked first, as the header of a foreign pointer may not be readable.
+	if(!p || !pointer_in_heap(p) || !seg_is_allocated(p_entry) || p_entry->size < PERCPU_GRANULE || p_entry->size > MY_MALLOC_PERCPU_MAX)
+		return 0;
+	
+	//A block with some slack is cached in the largest class it can serve
+	cls = p_entry->size / PERCPU_GRANULE - 1;
+	cache = current_cache();
+	
+	if(atomic_exchange_explicit(&cache->busy, 1, memory_order_acquire))
+		return 0;
+	
+	p_entry->next = seg_cached(p_entry, p_entry->size);
+	set_percpu_next(p_entry, cache->blocks[cls]);
+	cache->blocks[cls] = p_entry;
+	
+	if(++cache->count[cls] > MY_MALLOC_PERCPU_DEPTH)
+	{
+		heap_lock();
+		percpu_drain(cache, cls, MY_MALLOC_PERCPU_DEPTH - PERCPU_BATCH);
+		heap_generation++;
+		heap_unlock();
+	}
+	
+	atomic_store_explicit(&cache->busy, 0, memory_order_release);
+	latency_mark(LATENCY_DEFERRED);
+	return 1;
+}
+
+
+//Hands back the blocks of every cache not in use right now, when the central heap ran out. The heap must be locked.
+static int percpu_reclaim(void)
+{
+	size_t slot, cls;
+	int reclaimed = 0;
+	
+	for(slot = 0; slot < MY_MALLOC_PERCPU_SLOTS; slot++)
+	{
+		if(atomic_exchange_explicit(&percpu_caches[slot].busy, 1, memory_order_acquire))
+			continue;
+		
+		for(cls = 0; cls < PERCPU_CLASSES; cls++)
+		{
+			reclaimed |= percpu_caches[slot].count[cls] != 0;
+			percpu_drain(&percpu_caches[slot], cls, 0);
+		}
+		atomic_store_explicit(&percpu_caches[slot].busy, 0, memory_order_release);
+	}
+	
+	return reclaimed;
+}
+
+
+//Hands every cached block back to the central heap. No other thread may use the heap meanwhile.
+static void percpu_flush(void)
+{
+	size_t slot, cls;
+	
+	for(slot = 0; slot < MY_MALLOC_PERCPU_SLOTS; slot++)
+		for(cls = 0; cls < PERCPU_CLASSES; cls++)
+			percpu_drain(&percpu_caches[slot], cls, 0);
+}
+
+
+//Forgets the cached blocks without touching them, used when the heap they belong to is replaced
+static void percpu_reset(void)
+{
+	size_t slot;
+	
+	for(slot = 0; slot < MY_MALLOC_PERCPU_SLOTS; slot++)
+	{
+		memset(percpu_caches[slot].count, 0, sizeof(percpu_caches[slot].count));
+		memset(percpu_caches[slot].blocks, 0, sizeof(percpu_caches[slot].blocks));
+	}
+}
+
+#else
+
+#define heap_lock()
+#define heap_unlock()
+
+#endif
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							HEAP PROFILING	  							*/
+/************************************************************************/
+
+/*
+*	With MY_MALLOC_PROFILE, allocations are sampled as a Poisson process over the bytes allocated: one sample is taken
+*	every profile_rate bytes on average, so the distance to the next sample is drawn from an exponential distribution,
+*	and an allocation that is not sampled only subtracts its length from a countdown. A sampled block of len bytes 
+*	stands for len / (1 - e^(-len / rate)) bytes, the inverse of its chance to be sampled, which keeps the estimate 
+*	unbiased for small and large blocks alike.
+*
+*	Sampled blocks are kept in a hash table by address until they are freed, each referring to its call stack in a 
+*	second table where identical stacks are recorded once. Free only looks a block up while samples are live.
+*/
+
+#ifdef MY_MALLOC_PROFILE
+
+#define PROFILE_SKIP_FRAMES		1						//profile_sample() itself, the entry point remains the leaf frame
+
+typedef struct {
+	
+	void *frames[MY_MALLOC_PROFILE_DEPTH];			//Return addresses, innermost first
+	int depth;										//0 for an empty slot
+	double live_bytes;								//Estimated bytes of the live blocks allocated from here
+	
+}Profile_Stack;
+
+typedef struct {
+	
+	void *p;										//NULL for an empty slot
+	unsigned int stack;
+	double weight;									//Bytes the sample stands for
+	
+}Profile_Object;
+
+static Profile_Stack profile_stacks[MY_MALLOC_PROFILE_STACKS];
+static Profile_Object profile_objects[MY_MALLOC_PROFILE_SLOTS];
+static size_t profile_stack_count;
+static size_t profile_dropped;									//Samples lost because a table was full
+static size_t profile_rate = MY_MALLOC_PROFILE_RATE;
+
+//With per-CPU caches, every thread counts down on its own and the tables are shared behind a lock
+#ifdef MY_MALLOC_PERCPU
+#define PROFILE_THREAD		__thread
+static _Atomic size_t profile_live;
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define profile_lock()		pthread_mutex_lock(&profile_mutex)
+#define profile_unlock()	pthread_mutex_unlock(&profile_mutex)
+#else
+#define PROFILE_THREAD
+static size_t profile_live;
+
+#define profile_lock()
+#define profile_unlock()
+#endif
+
+static PROFILE_THREAD int64_t profile_countdown;				//Bytes left until the next sample
+static PROFILE_THREAD int profile_drawn;						//The countdown was drawn at least once
+static PROFILE_THREAD uint64_t profile_rng;
+
+#define profile_slot(p)		((((uintptr_t)(p) >> 4) * 0x9E3779B97F4A7C15ULL >> 32) % MY_MALLOC_PROFILE_SLOTS)
+
+//Unsampled allocations cost a subtraction and a comparison
+#define profile_malloc(p, len)	do{ if((profile_countdown -= (int64_t)(len)) < 0) profile_sample(p, len); }while(0)
+#define profile_free(p)			do{ if(profile_live) profile_forget(p); }while(0)
+
+
+//Bytes until the next sample, exponentially distributed with a mean of profile_rate
+static int64_t profile_draw(void)
+{
+	double u;
+	
+	if(!profile_rate)
+		return INT64_MAX;
+	
+	if(!profile_rng)
+		profile_rng = ((uintptr_t)&profile_rng ^ (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ULL) | 1;
+	profile_rng ^= profile_rng << 13;
+	profile_rng ^= profile_rng >> 7;
+	profile_rng ^= profile_rng << 17;
+	
+	u = ((profile_rng >> 11) + 1) * (1.0 / 9007199254740992.0);		//(0, 1]
+	return (int64_t)(-log(u) * profile_rate) + 1;
+}
+
+
+//Returns the slot holding the stack, or -1 if the table is full
+static int profile_find_stack(void **frames, int depth)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+	int f;
+	
+	for(f = 0; f < depth; f++)
+		hash = (hash ^ (uintptr_t)frames[f]) * 1099511628211ULL;
+	
+	for(i = hash % MY_MALLOC_PROFILE_STACKS; profile_stacks[i].depth; i = (i + 1) % MY_MALLOC_PROFILE_STACKS)
+		if(profile_stacks[i].depth == depth && !memcmp(profile_stacks[i].frames, frames, depth * sizeof(void*)))
+			return i;
+	
+	//One slot is always left empty, so the search above ends
+	if(profile_stack_count == MY_MALLOC_PROFILE_STACKS - 1)
+		return -1;
+	
+	memcpy(profile_stacks[i].frames, frames, depth * sizeof(void*));
+	profile_stacks[i].depth = depth;
+	profile_stacks[i].live_bytes = 0;
+	profile_stack_count++;
+	return i;
+}
+
+
+static size_t profile_find_object(void *p)
+{
+	size_t i;
+	
+	for(i = profile_slot(p); profile_objects[i].p && profile_objects[i].p != p; i = (i + 1) % MY_MALLOC_PROFILE_SLOTS);
+	return i;
+}
+
+
+//Empties a slot, moving later blocks of the same probe sequence back so that no search stops early
+static void profile_remove(size_t i)
+{
+	size_t j, home;
+	
+	profile_stacks[profile_objects[i].stack].live_bytes -= profile_objects[i].weight;
+	
+	for(j = (i + 1) % MY_MALLOC_PROFILE_SLOTS; profile_objects[j].p; j = (j + 1) % MY_MALLOC_PROFILE_SLOTS)
+	{
+		home = profile_slot(profile_objects[j].p);
+		
+		//The block at j may move to i unless its home slot lies cyclically in (i, j]
+		if(i < j ? (home <= i || home > j) : (home <= i && home > j))
+		{
+			profile_objects[i] = profile_objects[j];
+			i = j;
+		}
+	}
+	
+	profile_objects[i].p = NULL;
+	profile_live--;
+}
+
+
+static void __attribute__((noinline)) profile_sample(void *p, size_t len)
+{
+	void *frames[MY_MALLOC_PROFILE_DEPTH + PROFILE_SKIP_FRAMES];
+	int depth, stack;
+	size_t i;
+	
+	//The first draw of a thread only starts its countdown
+	if(!profile_drawn)
+	{
+		profile_drawn = 1;
+		if((profile_countdown += profile_draw()) >= 0)
+			return;
+	}
+	
+	//The distance to the next sample does not depend on how far this one fell inside the block
+	profile_countdown = profile_draw();
+	if(!p || !len || !profile_rate)
+		return;
+	
+	depth = backtrace(frames, MY_MALLOC_PROFILE_DEPTH + PROFILE_SKIP_FRAMES) - PROFILE_SKIP_FRAMES;
+	if(depth <= 0)
+		return;
+	
+	profile_lock();
+	
+	stack = profile_find_stack(frames + PROFILE_SKIP_FRAMES, depth);
+	i = profile_find_object(p);
+	
+	//A block at the same address belonged to a heap that has since been replaced
+	if(profile_objects[i].p)
+		profile_remove(i);
+	
+	if(stack < 0 || profile_live == MY_MALLOC_PROFILE_SLOTS - 1)
+		profile_dropped++;
+	else
+	{
+		i = profile_find_object(p);
+		profile_objects[i].p = p;
+		profile_objects[i].stack = stack;
+		profile_objects[i].weight = len / (1 - exp(-(double)len / profile_rate));
+		profile_stacks[stack].live_bytes += profile_objects[i].weight;
+		profile_live++;
+	}
+	
+	profile_unlock();
+}
+
+
+static void profile_forget(void *p)
+{
+	size_t i;
+	
+	profile_lock();
+	i = profile_find_object(p);
+	if(profile_objects[i].p)
+		profile_remove(i);
+	profile_unlock();
+}
+
+
+static void profile_forget_range(void* start, void* end)
+{
+	size_t i = 0;
+	
+	if(!profile_live)
+		return;
+	
+	profile_lock();
+	
+	//A removal may move another block into slot i, so it is looked at again
+	while(i < MY_MALLOC_PROFILE_SLOTS)
+	{
+		if(profile_objects[i].p >= start && profile_objects[i].p < end)
+			profile_remove(i);
+		else
+			i++;
+	}
+	
+	profile_unlock();
+}
+
+
+static void print_frame(FILE* out, void* frame)
+{
+	Dl_info info;
+	const char *module;
+	
+	//Return addresses point after the call, which may already be the next function
+	if(!dladdr((char*)frame - 1, &info) || !info.dli_fname)
+		fprintf(out, "%p", frame);
+	else if(info.dli_sname)
+		fprintf(out, "%s", info.dli_sname);
+	else
+	{
+		module = strrchr(info.dli_fname, '/');
+		fprintf(out, "%s+0x%zx", module ? module + 1 : info.dli_fname, (size_t)((char*)frame - (char*)info.dli_fbase));
+	}
+}
+
+
+/*
+*	Writes one line per call stack with live sampled blocks, in the folded format read by flamegraph.pl and most 
+*	flame graph viewers: the frames from the outermost to the allocating call separated by semicolons, a space, and 
+*	the estimated live bytes. Returns the number of lines written.
+*/
+int my_malloc_profile_dump(FILE* out)
+{
+	int lines = 0, f;
+	size_t i;
+	
+	profile_lock();
+	
+	for(i = 0; i < MY_MALLOC_PROFILE_STACKS; i++)
+	{
+		if(!profile_stacks[i].depth || profile_stacks[i].live_bytes < 0.5)
+			continue;
+		
+		for(f = profile_stacks[i].depth - 1; f >= 0; f--)
+		{
+			print_frame(out, profile_stacks[i].frames[f]);
+			fputc(f ? ';' : ' ', out);
+		}
+		fprintf(out, "%.0f\n", profile_stacks[i].live_bytes);
+		lines++;
+	}
+	
+	if(profile_dropped)
+		fprintf(stderr,"profile: %zu samples were dropped, the tables are full\n", profile_dropped);
+	
+	profile_unlock();
+	return lines;
+}
+
+
+static void set_profile_rate(size_t rate)
+{
+	profile_rate = rate;
+	
+	//The calling thread starts over with the new rate, others when their countdown runs out
+	profile_drawn = 0;
+	profile_countdown = 0;
+}
+
+#else
+
+#define profile_malloc(p, len)
+#define profile_free(p)
+
+#endif
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							LATENCY HISTOGRAMS	  						*/
+/************************************************************************/
+
+/*
+*	With MY_MALLOC_LATENCY, every call to malloc, free, realloc, my_memalign and my_expand is timed, and the time is 
+*	added to the histogram of the path the call took (see the LATENCY_* paths in my_malloc.h), so the tail latency of
+*	e.g. freelist searches can be told apart from that of exact reuse. Times are read from the time stamp counter on 
+*	x86, and from the monotonic clock elsewhere.
+*
+*	Histograms are log-linear: each power of two is divided into LATENCY_SUB_BUCKETS buckets, which bounds the relative
+*	error of a percentile while covering any duration. Counters are updated with relaxed atomic adds, so they can be 
+*	read and reset at any time, from any thread.
+*/
+
+#ifdef MY_MALLOC_LATENCY
+
+#define LATENCY_SUB_BITS		2
+#define LATENCY_SUB_BUCKETS		(1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS			((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+static _Atomic uint64_t latency_hist[LATENCY_PATHS][LATENCY_BUCKETS];
+static _Atomic uint64_t latency_total[LATENCY_PATHS];
+static _Atomic uint64_t latency_max[LATENCY_PATHS];
+
+static const char* const latency_names[LATENCY_PATHS] = {
+	"exact", "split", "grow", "insert", "merge left", "merge right", "merge both", "deferred", "in place", "copy", "aligned"
+};
+
+#define latency_begin(start)	uint64_t start = latency_now(); latency_path = LATENCY_NONE
+#define latency_end(start)		latency_record(latency_now() - (start))
+
+
+static inline uint64_t latency_now(void)
+{
+	#ifdef LATENCY_TSC
+	return __rdtsc();
+	#else
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	#endif
+}
+
+
+//Values below LATENCY_SUB_BUCKETS have a bucket each, larger ones share LATENCY_SUB_BUCKETS buckets per power of two
+static inline unsigned int latency_bucket(uint64_t ticks)
+{
+	unsigned int log2;
+	
+	if(ticks < LATENCY_SUB_BUCKETS)
+		return ticks;
+	
+	log2 = 63 - __builtin_clzll(ticks);
+	return (log2 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + ((ticks >> (log2 - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+
+//Largest value counted in a bucket
+static uint64_t latency_bucket_limit(unsigned int bucket)
+{
+	unsigned int shift;
+	
+	if(bucket < LATENCY_SUB_BUCKETS)
+		return bucket;
+	
+	shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	return ((uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+
+static void latency_record(uint64_t ticks)
+{
+	int path = latency_path;
+	uint64_t max;
+	
+	if(path == LATENCY_NONE)
+		return;
+	
+	atomic_fetch_add_explicit(&latency_hist[path][latency_bucket(ticks)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&latency_total[path], ticks, memory_order_relaxed);
+	
+	max = atomic_load_explicit(&latency_max[path], memory_order_relaxed);
+	while(ticks > max && !atomic_compare_exchange_weak_explicit(&latency_max[path], &max, ticks, memory_order_relaxed, memory_order_relaxed));
+}
+
+
+//Nanoseconds per tick, measured against the monotonic clock once
+static double latency_tick_ns(void)
+{
+	#ifdef LATENCY_TSC
+	static double tick_ns;
+	struct timespec start, now;
+	uint64_t start_ticks;
+	double elapsed;
+	
+	if(tick_ns)
+		return tick_ns;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_ticks = __rdtsc();
+	do
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+	}
+	while(elapsed < 10e6);
+	
+	tick_ns = elapsed / (__rdtsc() - start_ticks);
+	return tick_ns;
+	#else
+	return 1;
+	#endif
+}
+
+
+//Summarizes the calls that took a path, returns 0 if there is no such path
+int malloc_latency(int path, Malloc_Latency *latency)
+{
+	double tick_ns = latency_tick_ns();
+	double *percentiles[] = {&latency->p50_ns, &latency->p90_ns, &latency->p99_ns, &latency->p999_ns};
+	const double ranks[] = {0.5, 0.9, 0.99, 0.999};
+	uint64_t counts[LATENCY_BUCKETS], seen = 0;
+	unsigned int bucket, p = 0;
+	
+	if(path < 0 || path >= LATENCY_PATHS)
+		return 0;
+	
+	memset(latency, 0, sizeof(Malloc_Latency));
+	for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		counts[bucket] = atomic_load_explicit(&latency_hist[path][bucket], memory_order_relaxed);
+		latency->count += counts[bucket];
+	}
+	
+	if(!latency->count)
+		return 1;
+	
+	//Percentiles are the limit of the bucket holding the call of that rank
+	for(bucket = 0; bucket < LATENCY_BUCKETS && p < 4; bucket++)
+	{
+		seen += counts[bucket];
+		while(p < 4 && seen > ranks[p] * (latency->count - 1))
+			*percentiles[p++] = latency_bucket_limit(bucket) * tick_ns;
+	}
+	
+	latency->mean_ns = (double)atomic_load_explicit(&latency_total[path], memory_order_relaxed) / latency->count * tick_ns;
+	latency->max_ns = atomic_load_explicit(&latency_max[path], memory_order_relaxed) * tick_ns;
+	
+	//A percentile is never more than what was measured
+	for(p = 0; p < 4; p++)
+		if(*percentiles[p] > latency->max_ns)
+			*percentiles[p] = latency->max_ns;
+	
+	return 1;
+}
+
+
+void malloc_latency_reset(void)
+{
+	unsigned int path, bucket;
+	
+	for(path = 0; path < LATENCY_PATHS; path++)
+	{
+		for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+			atomic_store_explicit(&latency_hist[path][bucket], 0, memory_order_relaxed);
+		atomic_store_explicit(&latency_total[path], 0, memory_order_relaxed);
+		atomic_store_explicit(&latency_max[path], 0, memory_order_relaxed);
+	}
+}
+
+
+//Path taken by the calling thread's last timed call, or -1 if that call failed. Lets callers attribute their own measurements.
+int malloc_latency_last_path(void)
+{
+	return latency_path;
+}
+
+
+void malloc_latency_print(FILE* out)
+{
+	Malloc_Latency latency;
+	int path;
+	
+	fprintf(out, "%-12s %10s %10s %10s %10s %10s %10s %10s\n", "path", "calls", "mean ns", "p50", "p90", "p99", "p99.9", "max");
+	
+	for(path = 0; path < LATENCY_PATHS; path++)
+	{
+		malloc_latency(path, &latency);
+		if(!latency.count)
+			continue;
+		
+		fprintf(out, "%-12s %10llu %10.1f %10.0f %10.0f %10.0f %10.0f %10.0f\n", latency_names[path], (unsigned long long)latency.count, 
+			latency.mean_ns, latency.p50_ns, latency.p90_ns, latency.p99_ns, latency.p999_ns, latency.max_ns);
+	}
+}
+
+#else
+
+#define latency_begin(start)
+#define latency_end(start)
+
+#endif
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							ENTRY POINTS	  							*/
+/************************************************************************/
+
+void* my_malloc(size_t len)
+{
+	void *retaddr;
+	latency_begin(start);
+	
+	#ifdef MY_MALLOC_PERCPU
+	if(len && len <= MY_MALLOC_PERCPU_MAX && (retaddr = percpu_alloc(len)) != NULL)
+	{
+		latency_end(start);
+		profile_malloc(retaddr, len);
+		return retaddr;
+	}
+	#endif
+	
+	heap_lock();
+	tx_begin();
+	retaddr = do_malloc(len);
+	
+	#ifdef MY_MALLOC_PERCPU
+	if(!retaddr && percpu_reclaim())
+		retaddr = do_malloc(len);
+	#endif
+	
+	tx_commit();
+	heap_generation++;
+	heap_unlock();
+	
+	latency_end(start);
+	profile_malloc(retaddr, len);
+	return retaddr;
+}
+
+
+void my_free(void *p)
+{
+	latency_begin(start);
+	
+	//Forgotten before the block can be handed out again
+	profile_free(p);
+	
+	#ifdef MY_MALLOC_PERCPU
+	if(percpu_free(p))
+	{
+		latency_end(start);
+		return;
+	}
+	#endif
+	
+	heap_lock();
+	tx_begin();
+	quarantine_free(p);
+	decay_tick();
+	tx_commit();
+	heap_generation++;
+	heap_unlock();
+	
+	latency_end(start);
+}
+
+
+void* my_realloc(void *p, size_t len)
+{
+	void *retaddr;
+	latency_begin(start);
+	
+	//A resized block is sampled again as a new allocation; if realloc fails, the old sample is lost
+	profile_free(p);
+	
+	heap_lock();
+	tx_begin();
+	retaddr = do_realloc(p, len);
+	
+	#ifdef MY_MALLOC_PERCPU
+	if(!retaddr && len && percpu_reclaim())
+		retaddr = do_realloc(p, len);
+	#endif
+	
+	//Reallocating NULL or to 0 bytes keeps the path of the malloc or free it turned into
+	if(p && len)
+		latency_mark(!retaddr ? LATENCY_NONE : retaddr == p ? LATENCY_IN_PLACE : LATENCY_COPY);
+	
+	#ifdef MY_MALLOC_USDT
+	if(p && len && retaddr == p)
+		usdt_probe(realloc_in_place, p, len);
+	else if(p && len && retaddr)
+		usdt_probe(realloc_move, p, retaddr, len);
+	#endif
+	
+	tx_commit();
+	heap_generation++;
+	heap_unlock();
+	
+	latency_end(start);
+	profile_malloc(retaddr, len);
+	return retaddr;
+}
+
+
+
+void* my_memalign(size_t align, size_t len)
+{
+	void *retaddr;
+	latency_begin(start);
+	
+	heap_lock();
+	tx_begin();
+	retaddr = do_memalign(align, len);
+	
+	#ifdef MY_MALLOC_PERCPU
+	if(!retaddr && percpu_reclaim())
+		retaddr = do_memalign(align, len);
+	#endif
+	
+	latency_mark(retaddr ? LATENCY_ALIGNED : LATENCY_NONE);
+	tx_commit();
+	heap_generation++;
+	heap_unlock();
+	
+	latency_end(start);
+	profile_malloc(retaddr, len);
+	return retaddr;
+}
+
+
+//Frees a block that was allocated with size bytes. Freeing it with more bytes than it holds is refused.
+void my_free_sized(void *p, size_t size)
+{
+	if(p && size > ((Heap_Seg*)((uchar*)p - sizeof(Heap_Seg)))->size)
+	{
+		fprintf(stderr,"free_sized: %p holds %zu bytes, but was freed as %zu bytes!\n", p, ((Heap_Seg*)((uchar*)p - sizeof(Heap_Seg)))->size, size);
+		return;
+	}
+	
+	my_free(p);
+}
+
+
+
+size_t my_expand(void *p, size_t min_len, size_t max_len)
+{
+	size_t size;
+	latency_begin(start);
+	
+	heap_lock();
+	tx_begin();
+	size = do_expand(p, min_len, max_len);
+	latency_mark(size ? LATENCY_IN_PLACE : LATENCY_NONE);
+	tx_commit();
+	heap_generation++;
+	heap_unlock();
 	
-	if(!pointer_is_valid(p))
-		return;
+	latency_end(start);
+	return size;
+}
+
+
+
+int my_mallopt(int param, size_t value)
+{
+	switch(param)
+	{
+		case M_PLACEMENT:
+			return set_placement_policy(value);
+		
+		case M_BEST_FIT_TOLERANCE:
+			best_fit_tolerance = value;
+			return 1;
+		
+		case M_TRIM_THRESHOLD:
+			trim_threshold = value;
+			return 1;
+		
+		case M_TOP_PAD:
+			top_pad = value;
+			return 1;
+		
+		#ifdef MY_MALLOC_DECAY
+		case M_DECAY_MS:
+			decay_ms = value;
+			return 1;
+		#endif
+		
+		case M_GROW_CHUNK:
+			if(!value)
+			{
+				fprintf(stderr,"mallopt: The break cannot grow in chunks of 0 bytes\n");
+				return 0;
+			}
+			grow_chunk = value;
+			return 1;
+		
+		#ifdef MY_MALLOC_FASTBINS
+		case M_FASTBIN_MAX:
+			return set_fastbin_max(value);
+		
+		case M_FASTBIN_BYTES:
+			fastbin_threshold = value;
+			if(fastbin_bytes > fastbin_threshold)
+				fastbin_consolidate();
+			return 1;
+		#endif
+		
+		#ifdef MY_MALLOC_PROFILE
+		case M_PROFILE_RATE:
+			set_profile_rate(value);
+			return 1;
+		#endif
+		
+		#ifdef MY_MALLOC_QUARANTINE
+		case M_QUARANTINE_BYTES:
+			set_quarantine_budget(value);
+			return 1;
+		#endif
+		
+		default:
+			fprintf(stderr,"mallopt: Unsupported parameter %d\n", param);
+			return 0;
+	}
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							RESERVATION		  							*/
+/************************************************************************/
+
+/*
+*	my_reserve() grows the wilderness ahead of time, so that the first allocations after startup neither move the break 
+*	nor (with populate) take a page fault on memory touched for the first time. Pages are faulted in by writing back a 
+*	byte of each, which keeps the poison of free memory intact. Free will not lower the break below the reservation; 
+*	my_malloc_trim() drops it.
+*
+*	With MY_MALLOC_FASTBINS, my_reserve_bins() also splits free space into blocks of the sizes given, e.g. the sizes
+*	of the live blocks seen in a previous run with heap_walk(), and holds them in the fastbins for malloc to pop.
+*/
+
+//Returns the number of free bytes at the tail of the heap afterwards, 0 if they cannot be reserved
+size_t my_reserve(size_t bytes, int populate)
+{
+	Heap_Seg *piece, *piece_prev;
+	uchar *old_break, *page;
+	size_t page_size = sysconf(_SC_PAGESIZE), have;
 	
-	#ifdef DEBUG_MY_FREE
-	printf("free: Freeing %p of size %zu\n", p_entry, p_entry->size);
-	#endif
+	heap_lock();
+	tx_begin();
 	
-	/************************************************/
-	/*		Step 1: Freeing the requested piece 	*/
-	/************************************************/
+	//Blocks held at the tail count towards the reservation once they are handed back
+	release_held_blocks();
+	
+	if(!free_index_last(&piece_prev, &piece))
+		for(piece = freelist_head, piece_prev = NULL; piece && seg_next(piece); piece_prev = piece, piece = seg_next(piece));
+	if(piece && segment_end(piece) != malloc_break)
+	{
+		piece_prev = piece;
+		piece = NULL;
+	}
 	
-	//Iterate through the current freelist and locate the closest neighbouring free segments to p
-	for(current_piece = freelist_head; current_piece; current_piece = current_piece->next)
+	have = piece ? piece->size : 0;
+	old_break = malloc_break;
+	
+	if(have < bytes && grow_malloc_break(bytes - have + (piece ? 0 : sizeof(Heap_Seg))))
 	{
-		if(current_piece < p_entry)
+		if(piece)
 		{
-			closest_left_prev = closest_left;
-			closest_left = current_piece;
+			stats_free_remove(piece->size);
+			heap_set(piece->size, malloc_break - (uchar*)piece - sizeof(Heap_Seg));
+			free_index_update(piece, piece, piece->size);
 		}
-		else if(current_piece > p_entry)
+		else
 		{
-			closest_right_prev = closest_left;
-			closest_right = current_piece;
-			break;
+			//The new wilderness follows the last free piece
+			piece = (Heap_Seg*)old_break;
+			write_seg_header(piece, malloc_break - old_break - sizeof(Heap_Seg), NULL);
+			free_index_add(piece, piece->size);
+			if(piece_prev)
+				set_seg_next(piece_prev, piece);
+			else
+				freelist_head = piece;
 		}
-		else
+		
+		page = old_break == (uchar*)piece ? old_break + sizeof(Heap_Seg) : old_break;
+		poison(page, malloc_break - page);
+		stats_free_add(piece->size);
+		decay_stamp(piece);
+		have = piece->size;
+	}
+	
+	if(have >= bytes)
+	{
+		reserve_end = malloc_break;
+		
+		//Without a wilderness there is nothing to fault in, as when 0 bytes are asked for and the break ends in a block
+		if(populate && piece)
+			for(page = (uchar*)piece + sizeof(Heap_Seg); page < malloc_break; page += page_size)
+				*(volatile uchar*)page = *(volatile uchar*)page;
+		
+		#ifdef DEBUG_MY_MALLOC
+		printf("reserve: %zu free bytes at the tail, malloc break at %p\n", have, malloc_break);
+		#endif
+	}
+	else
+		have = 0;
+	
+	tx_commit();
+	heap_generation++;
+	heap_unlock();
+	
+	return have;
+}
+
+
+#ifdef MY_MALLOC_FASTBINS
+
+//Fills the fastbins with counts[len] blocks of each size len up to max_len. Returns the number of blocks binned.
+size_t my_reserve_bins(const size_t *counts, size_t max_len)
+{
+	size_t len, i, slack, total = 0, binned = 0;
+	uchar *block;
+	Heap_Seg *p_entry;
+	
+	if(max_len > fastbin_max)
+		max_len = fastbin_max;
+	
+	//All the blocks are carved from one allocation, as far as the fastbins have room
+	for(len = FASTBIN_MIN; len <= max_len; len++)
+		for(i = 0; i < counts[len] && fastbin_bytes + total + len <= fastbin_threshold; i++)
+			total += len + sizeof(Heap_Seg);
+	
+	heap_lock();
+	tx_begin();
+	
+	block = total ? do_malloc(total - sizeof(Heap_Seg)) : NULL;
+	if(block)
+	{
+		//The allocation may come with a few bytes of slack, which are left to the last block
+		slack = ((Heap_Seg*)(block - sizeof(Heap_Seg)))->size - (total - sizeof(Heap_Seg));
+		stats_alloc_remove(total - sizeof(Heap_Seg) + slack);
+		block -= sizeof(Heap_Seg);
+		
+		for(len = FASTBIN_MIN; len <= max_len; len++)
 		{
-			//There should never be an occurance where p_entry is in the freelist. This might be a double free attempt
-			fprintf(stderr, "Double free detected! Free Piece %p, size %zu, next %p\n", current_piece, current_piece->size, current_piece->next);
-			return;
+			for(i = 0; i < counts[len] && total >= len + sizeof(Heap_Seg); i++)
+			{
+				p_entry = (Heap_Seg*)block;
+				write_alloc_header(p_entry, len);
+				stats_alloc_add(len);
+				
+				block += len + sizeof(Heap_Seg);
+				total -= len + sizeof(Heap_Seg);
+				
+				//A block with slack does not fit its fastbin, and is freed instead
+				if(!total && slack)
+				{
+					stats_alloc_remove(len);
+					write_alloc_header(p_entry, len + slack);
+					stats_alloc_add(len + slack);
+					poison((uchar*)p_entry + sizeof(Heap_Seg), len + slack);
+					do_free((uchar*)p_entry + sizeof(Heap_Seg));
+					break;
+				}
+				
+				p_entry->next = seg_binned(p_entry, len);
+				set_fastbin_next(p_entry, fastbins[len]);
+				fastbins[len] = p_entry;
+				fastbin_bytes += len;
+				binned++;
+			}
 		}
 	}
 	
-	//Write a new freelist entry at the beginning of the freed block
-	if(!closest_left)
+	tx_commit();
+	heap_generation++;
+	heap_unlock();
+	
+	return binned;
+}
+
+#endif
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							DECAY PURGING	  							*/
+/************************************************************************/
+
+/*
+*	Only the free piece at the tail of the heap is ever given back by lowering the break. With MY_MALLOC_DECAY, every free
+*	piece is stamped with the time it got dirty in its first payload word, wherever its header is written (free, the splits
+*	of malloc and realloc, the growth of the wilderness). Every decay_ms / DECAY_STEPS, a pass over the freelist starts, 
+*	and purges the pieces that have stayed free for longer than decay_ms: the whole pages inside them are handed back to 
+*	the OS with madvise(), and the piece is marked clean. Each call to free advances the pass by at most DECAY_BATCH 
+*	pieces from decay_cursor, so free stays O(1) however long the freelist is. If the piece under the cursor stops 
+*	existing, the pass ends there and the next one starts over. A piece merged with a freed neighbour, or moved by a 
+*	split, becomes dirty again. my_malloc_trim() purges every piece right away.
+*/
+
+#ifdef MY_MALLOC_DECAY
+
+#define DECAY_STEPS				8
+#define DECAY_BATCH				16
+#define decay_since(p_entry)	(*(uint64_t*)((uchar*)(p_entry) + sizeof(Heap_Seg)))		//0 once purged
+
+static uint64_t decay_last_tick;						//In ms, like the stamps
+static size_t decay_page_size;
+
+
+static inline uint64_t decay_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void decay_stamp(Heap_Seg *p_entry)
+{
+	if(p_entry->size >= sizeof(uint64_t))
+		decay_since(p_entry) = decay_now();
+}
+
+
+//Purges the whole pages inside a free piece, past its header and stamp. Returns the number of bytes purged.
+static size_t decay_purge(Heap_Seg *p_entry)
+{
+	uchar *from, *to;
+	
+	if(!decay_page_size)
+		decay_page_size = sysconf(_SC_PAGESIZE);
+	
+	from = (uchar*)(((uintptr_t)p_entry + sizeof(Heap_Seg) + sizeof(uint64_t) + decay_page_size - 1) & ~(uintptr_t)(decay_page_size - 1));
+	to = (uchar*)((uintptr_t)segment_end(p_entry) & ~(uintptr_t)(decay_page_size - 1));
+	decay_since(p_entry) = 0;
+	
+	if(from >= to || madvise(from, to - from, MY_MALLOC_DECAY_ADVICE))
+		return 0;
+	
+	#ifdef DEBUG_MY_FREE
+	printf("free: Purged %zu bytes inside the free piece %p\n", (size_t)(to - from), p_entry);
+	#endif
+	
+	return to - from;
+}
+
+
+static void decay_tick(void)
+{
+	uint64_t now;
+	size_t steps;
+	
+	if(decay_ms == (size_t)-1)
+		return;
+	
+	//Ages are measured against the current time, so pieces left alone during a quiet period are purged by the next free
+	now = decay_now();
+	if(!decay_cursor)
 	{
-		p_entry->next = freelist_head;
-		freelist_head = p_entry;
+		if(now - decay_last_tick < decay_ms / DECAY_STEPS)
+			return;
+		decay_last_tick = now;
+		decay_cursor = freelist_head;
+	}
+	
+	for(steps = 0; decay_cursor && steps < DECAY_BATCH; steps++, decay_cursor = seg_next(decay_cursor))
+		if(decay_cursor->size >= sizeof(uint64_t) && decay_since(decay_cursor) && now - decay_since(decay_cursor) >= decay_ms)
+			decay_purge(decay_cursor);
+}
+
+
+static size_t purge_all(void)
+{
+	Heap_Seg *current_piece;
+	size_t purged = 0;
+	
+	for(current_piece = freelist_head; current_piece; current_piece = seg_next(current_piece))
+		if(current_piece->size >= sizeof(uint64_t))
+			purged += decay_purge(current_piece);
+	
+	return purged;
+}
+
+#endif
+
+
+//Lowers the break down to pad bytes of free space at the tail. Returns the number of bytes given back.
+static size_t trim_tail(size_t pad)
+{
+	Heap_Seg *piece, *piece_prev;
+	uchar *old_break = malloc_break;
+	
+	if(!free_index_last(&piece_prev, &piece))
+		for(piece = freelist_head, piece_prev = NULL; piece && seg_next(piece); piece_prev = piece, piece = seg_next(piece));
+	
+	if(!piece || segment_end(piece) != malloc_break || piece->size <= pad)
+		return 0;
+	
+	stats_free_remove(piece->size);
+	if(!pad)
+	{
+		free_index_remove(piece);
+		malloc_break = (uchar*)piece;
+		forget_free_piece(piece);
+		write_seg_header(piece, 0, NULL);
+		
+		if(piece_prev)
+			set_seg_next(piece_prev, NULL);
+		else
+			freelist_head = NULL;
 	}
 	else
 	{
-		p_entry->next = closest_left->next;
-		closest_left->next = p_entry;
-		p_entry_prev = closest_left;
+		heap_set(piece->size, pad);
+		stats_free_add(piece->size);
+		free_index_update(piece, piece, piece->size);
+		malloc_break = segment_end(piece);
 	}
+	
+	usdt_probe(break_shrink, malloc_break);
+	os_release_tail();
+	return old_break - malloc_break;
+}
 
+
+//Gives as much free memory back as possible, keeping pad bytes free at the tail. Returns 1 if anything was given back.
+int my_malloc_trim(size_t pad)
+{
+	size_t released;
 	
+	heap_lock();
+	tx_begin();
 	
-	/************************************************/
-	/*	Step 2: Merge with adjacent right piece	 	*/
-	/************************************************/
+	#ifdef MY_MALLOC_PERCPU
+	percpu_reclaim();
+	#endif
 	
-	if(closest_right && segment_end(p_entry) == (uchar*)closest_right)
+	//Blocks in quarantine at the tail would keep it from being trimmed
+	#ifdef MY_MALLOC_QUARANTINE
+	quarantine_flush();
+	#endif
+	
+	#ifdef MY_MALLOC_FASTBINS
+	fastbin_consolidate();
+	#endif
+	
+	reserve_end = NULL;
+	released = trim_tail(pad);
+	
+	#ifdef MY_MALLOC_DECAY
+	released += purge_all();
+	#endif
+	
+	tx_commit();
+	heap_generation++;
+	heap_unlock();
+	
+	return released != 0;
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							OBJECT CACHES	  							*/
+/************************************************************************/
+
+/*
+*	An object cache hands out objects of one size from slabs, which are blocks allocated with my_memalign() and aligned to 
+*	their own size, so the slab of an object is found by masking its address. Objects are constructed when they are first 
+*	handed out, and stay constructed while they are free in the cache: cache_free() only pushes the object's index onto its
+*	slab's stack of free objects, which lives in the slab header, so the object's own memory is never written to. The 
+*	header also holds a bitmap of the free objects, so that an object freed twice is caught in O(1). The destructor only 
+*	runs when the slab is given back to the heap, by cache_shrink() or cache_destroy().
+*
+*	Like the rest of the heap, the caches must not be used from several threads at once. A cache belongs to the heap that
+*	was current when it was created.
+*/
+
+#define SLAB_MIN_OBJECTS		8
+#define SLAB_MIN_SIZE			256
+
+typedef struct slab{
+	
+	struct slab *next_free;						//Next slab with free objects
+	struct slab *next;							//Next slab of the cache
+	unsigned short in_use;
+	unsigned short constructed;					//Objects below this index have been constructed
+	unsigned short free_count;					//Entries on the free stack, all of them constructed
+	unsigned short free_stack[];				//Followed by the bitmap of free objects
+	
+}Slab;
+
+struct obj_cache{
+	
+	Slab *slabs;
+	Slab *free_slabs;							//Slabs with free or not yet constructed objects
+	Obj_Ctor ctor;
+	Obj_Ctor dtor;
+	size_t stride;
+	size_t slab_size;
+	size_t free_map_offset;						//Start of the bitmap of free objects within a slab
+	size_t objects_offset;						//Start of the objects within a slab
+	unsigned short capacity;					//Objects per slab
+	Obj_Cache_Stats stats;
+};
+
+#define slab_of(cache, obj)			((Slab*)((uintptr_t)(obj) & ~(uintptr_t)((cache)->slab_size - 1)))
+#define slab_object(cache, slab, i)	((uchar*)(slab) + (cache)->objects_offset + (size_t)(i) * (cache)->stride)
+#define slab_index(cache, slab, obj)	(((uchar*)(obj) - (uchar*)(slab) - (cache)->objects_offset) / (cache)->stride)
+#define slab_free_map(cache, slab)		((uchar*)(slab) + (cache)->free_map_offset)
+#define free_map_bytes(capacity)		(((capacity) + 7) / 8)
+
+
+Obj_Cache* cache_create(const char* name, size_t size, size_t align, Obj_Ctor ctor, Obj_Ctor dtor)
+{
+	Obj_Cache *cache;
+	size_t slab_size, capacity, offset;
+	
+	if(!size || !align || (align & (align - 1)))
 	{
-		//Update new header, and erase the old one
-		p_entry->size += closest_right->size + sizeof(Heap_Seg);
-		p_entry->next = closest_right->next;
-		write_seg_header(closest_right, 0, NULL);
+		fprintf(stderr,"cache_create: Invalid size %zu or alignment %zu for cache \"%s\"\n", size, align, name);
+		return NULL;
+	}
+	
+	//The smallest power of two holding enough objects, along with the slab header, the free stack and the bitmap
+	size = (size + align - 1) & ~(align - 1);
+	for(slab_size = SLAB_MIN_SIZE; ; slab_size *= 2)
+	{
+		capacity = (slab_size - sizeof(Slab)) / (size + sizeof(unsigned short));
+		if(capacity > USHRT_MAX)
+			capacity = USHRT_MAX;
 		
-		#ifdef DEBUG_MY_FREE
-		printf("free: Merged with adjacent right piece. New size %zu at %p\n", p_entry->size, p_entry);
+		for(; capacity; capacity--)
+		{
+			offset = (sizeof(Slab) + capacity * sizeof(unsigned short) + free_map_bytes(capacity) + align - 1) & ~(align - 1);
+			if(offset + capacity * size <= slab_size)
+				break;
+		}
+		
+		if(capacity >= SLAB_MIN_OBJECTS && slab_size >= align)
+			break;
+	}
+	
+	cache = my_malloc(sizeof(Obj_Cache));
+	if(!cache)
+		return NULL;
+	
+	memset(cache, 0, sizeof(Obj_Cache));
+	cache->ctor 				= ctor;
+	cache->dtor 				= dtor;
+	cache->stride 				= size;
+	cache->slab_size 			= slab_size;
+	cache->free_map_offset 		= sizeof(Slab) + capacity * sizeof(unsigned short);
+	cache->objects_offset 		= offset;
+	cache->capacity 			= capacity;
+	cache->stats.name 			= name;
+	cache->stats.object_size 	= size;
+	cache->stats.slab_size 		= slab_size;
+	
+	#ifdef DEBUG_MY_MALLOC
+	printf("cache_create: Cache \"%s\" holds %zu objects of %zu bytes in slabs of %zu bytes\n", name, capacity, size, slab_size);
+	#endif
+	
+	return cache;
+}
+
+
+void* cache_alloc(Obj_Cache* cache)
+{
+	Slab *slab = cache->free_slabs;
+	uchar *obj;
+	size_t i;
+	
+	if(!slab)
+	{
+		slab = my_memalign(cache->slab_size, cache->slab_size);
+		if(!slab)
+			return NULL;
+		
+		memset(slab, 0, sizeof(Slab));
+		memset(slab_free_map(cache, slab), 0, free_map_bytes(cache->capacity));
+		slab->next 				= cache->slabs;
+		cache->slabs 			= slab;
+		cache->free_slabs 		= slab;
+		cache->stats.slabs++;
+		cache->stats.capacity += cache->capacity;
+		
+		#ifdef DEBUG_MY_MALLOC
+		printf("cache_alloc: New slab at %p for cache \"%s\"\n", slab, cache->stats.name);
 		#endif
 	}
 	
+	//Constructed objects are reused first, so objects are only constructed once the slab has none left
+	if(slab->free_count)
+	{
+		i = slab->free_stack[--slab->free_count];
+		slab_free_map(cache, slab)[i / 8] &= ~(1 << (i % 8));
+		obj = slab_object(cache, slab, i);
+		cache->stats.reused++;
+	}
+	else
+	{
+		obj = slab_object(cache, slab, slab->constructed++);
+		if(cache->ctor)
+			cache->ctor(obj);
+		cache->stats.constructed++;
+	}
+	
+	if(++slab->in_use == cache->capacity)
+		cache->free_slabs = slab->next_free;
+	
+	cache->stats.in_use++;
+	cache->stats.allocs++;
+	return obj;
+}
+
+
+void cache_free(Obj_Cache* cache, void* obj)
+{
+	Slab *slab;
+	uchar *free_map;
+	size_t i;
+	
+	if(!obj)
+		return;
+	
+	slab = slab_of(cache, obj);
+	i = slab_index(cache, slab, obj);
+	
+	if((uchar*)obj < slab_object(cache, slab, 0) || i >= slab->constructed || slab_object(cache, slab, i) != obj || !slab->in_use)
+	{
+		fprintf(stderr,"cache_free: %p is not an object of cache \"%s\"!\n", obj, cache->stats.name);
+		return;
+	}
+	
+	free_map = slab_free_map(cache, slab);
+	if(free_map[i / 8] & (1 << (i % 8)))
+	{
+		fprintf(stderr,"cache_free: Double free detected! %p is already free in cache \"%s\"\n", obj, cache->stats.name);
+		return;
+	}
+	free_map[i / 8] |= 1 << (i % 8);
+	
+	//A slab that was full has free objects again
+	if(slab->in_use-- == cache->capacity)
+	{
+		slab->next_free = cache->free_slabs;
+		cache->free_slabs = slab;
+	}
 	
-	/************************************************/
-	/*	Step 3: Merge with adjacent left piece	 	*/
-	/************************************************/
+	slab->free_stack[slab->free_count++] = i;
+	cache->stats.in_use--;
+	cache->stats.frees++;
+}
+
+
+//Destroys the objects of an unused slab and frees it
+static void release_slab(Obj_Cache* cache, Slab *slab)
+{
+	size_t i;
 	
-	if(closest_left && segment_end(closest_left) == (uchar*)p_entry)
-	{	
-		//Update the header new header, and erase the old one
-		closest_left->size += p_entry->size + sizeof(Heap_Seg);
-		closest_left->next = p_entry->next;
-		write_seg_header(p_entry, 0, NULL);
-		p_entry = closest_left;
-		
-		#ifdef DEBUG_MY_FREE
-		printf("free: Merged with adjacent left piece. New size %zu at %p\n", p_entry->size, p_entry);
-		#endif
-	}
+	if(cache->dtor)
+		for(i = 0; i < slab->constructed; i++)
+			cache->dtor(slab_object(cache, slab, i));
 	
+	cache->stats.slabs--;
+	cache->stats.capacity -= cache->capacity;
+	my_free(slab);
+}
 
-	/************************************************/
-	/*			Step 4: Reduce Malloc Break		 	*/
-	/************************************************/
+
+//Gives the slabs without objects in use back to the heap. Returns the number of slabs released.
+size_t cache_shrink(Obj_Cache* cache)
+{
+	Slab **link, **free_link, *slab;
+	size_t released = 0;
 	
-	if(segment_end(p_entry) == malloc_break && !p_entry->next)
+	for(link = &cache->slabs; (slab = *link) != NULL;)
 	{
-		//Reduce the break to where the tail piece ends, and erase the old header
-		malloc_break = (uchar*)p_entry;
-		write_seg_header(p_entry, 0, NULL);
+		if(slab->in_use)
+		{
+			link = &slab->next;
+			continue;
+		}
 		
-		//Update freelist
-		if(p_entry_prev)
-			p_entry_prev->next = NULL;
-		else
-			freelist_head = NULL;
+		//A slab without objects in use is always on the list of slabs with free objects
+		for(free_link = &cache->free_slabs; *free_link != slab; free_link = &(*free_link)->next_free);
+		*free_link = slab->next_free;
+		*link = slab->next;
 		
-		#ifdef DEBUG_MY_FREE
-		printf("free: Eliminated new free piece by reducing malloc break to %p\n", malloc_break);
-		#endif
+		release_slab(cache, slab);
+		released++;
 	}
+	
+	return released;
+}
+
+
+void cache_destroy(Obj_Cache* cache)
+{
+	if(!cache)
+		return;
+	
+	if(cache->stats.in_use)
+		fprintf(stderr,"cache_destroy: Cache \"%s\" still has %zu objects in use, their slabs are kept\n", cache->stats.name, cache->stats.in_use);
+	
+	cache_shrink(cache);
+	if(!cache->slabs)
+		my_free(cache);
+}
+
+
+Obj_Cache_Stats cache_stats(Obj_Cache* cache)
+{
+	return cache->stats;
 }
 
 
@@ -433,259 +4518,265 @@ void my_free(void *p)
 
 
 /************************************************************************/
-/*								REALLOC		  							*/
+/*							HEAP CHECKING	  							*/
 /************************************************************************/
 
-void* my_realloc(void *p, size_t len)
+/*
+*	Finds the place of an incremental walk again after the heap was modified between two steps. Free pieces are segment 
+*	boundaries that can still be found through the freelist, so the segments are followed from the last free piece below 
+*	the cursor. The walk resumes at the last boundary at or below the cursor, which is the cursor itself unless the segment 
+*	there has been merged into the one before it. Returns 0 if the walk must start over.
+*/
+static int check_resync(Heap_Check_State *state)
 {
-	Heap_Seg *p_entry = p - sizeof(Heap_Seg);
-	Heap_Seg *new_entry = NULL;
-	
-	int size_diff;
-	uchar* new_break;
-	uchar* retaddr = NULL;
-	
-	Heap_Seg *current_piece = NULL;
-	Heap_Seg *closest_left = NULL, *closest_left_prev = NULL;
-	Heap_Seg *closest_right = NULL, *closest_right_prev = NULL;
-	
-	
-	if(!pointer_is_valid(p))
-		return NULL;
-	
-	
-	
-	/****************************************/
-	/*				Shrinking				*/
-	/****************************************/
+	Heap_Seg *left = NULL, *right, *current_piece;
+	uchar *boundary;
 	
-	size_diff = len - p_entry->size;
-	
-	#ifdef DEBUG_MY_REALLOC
-	printf("realloc: Resizing %p, current size %zu. Size difference: %d\n", p_entry, p_entry->size, size_diff);
+	#ifdef MY_MALLOC_FREE_INDEX
+	Heap_Seg *left_prev;
 	#endif
 	
-	if(size_diff == 0)
-		return p;
+	if(state->cursor < malloc_heap_start || state->cursor > malloc_break)
+		return 0;
 	
-	else if(size_diff < 0)
+	if(!free_index_around((Heap_Seg*)state->cursor, &left_prev, &left, &right))
 	{
-		size_diff = p_entry->size - len;		//Make size_diff positive
-		
-		//Don't shrink if the size difference isn't big enough to insert a new segment header
-		if(size_diff <= sizeof(Heap_Seg))
+		for(right = freelist_head; right && (uchar*)right < state->cursor; right = seg_next(right))
 		{
-			#ifdef DEBUG_MY_REALLOC
-			printf("realloc: size difference too insignificant. The piece will not be shrunk.\n");
-			#endif
-			return p;
+			//Out of order entries are left for a full walk to report
+			if((uchar*)right < malloc_heap_start || (left && right <= left))
+				return 0;
+			left = right;
 		}
-		
-		p_entry->size = len;
-		
-		//Write a new header for the free piece above the shrunk piece and mark it free
-		new_entry = (Heap_Seg*)segment_end(p_entry);
-		write_seg_header(new_entry, size_diff - sizeof(Heap_Seg), NULL);
-		
-		#ifdef DEBUG_MY_REALLOC
-		printf("realloc: New shrunk piece of size %zu at %p\n", len, p - sizeof(Heap_Seg));
-		printf("realloc: Freeing the space above the shrunk piece (size %zu at %p)\n", new_entry->size, new_entry);
-		#endif
-		
-		my_free((uchar*)new_entry + sizeof(Heap_Seg));	
-		
-		return p;
 	}
 	
-	
-	
-	/****************************************/
-	/*	Growing In-place, At the break		*/
-	/****************************************/
-
-	//If the expanding piece is at the malloc break, simply grow the break to accomodate the new length
-	if(segment_end(p_entry) == malloc_break)
+	boundary = left ? (uchar*)left : malloc_heap_start;
+	while(boundary < state->cursor)
 	{
-		if(!grow_malloc_break(size_diff))
-			return NULL;
-		
-		p_entry->size = len;
-		
-		#ifdef DEBUG_MY_REALLOC
-		printf("realloc: Expanding malloc break to %p for growth\n", malloc_break);
-		#endif
+		current_piece = (Heap_Seg*)boundary;
 		
-		return p;
+		//Stop at the segment the cursor now lies in, or at a broken header for the walk to report
+		if(boundary + sizeof(Heap_Seg) > malloc_break || current_piece->size >= MAX_HEAP_SIZE || segment_end(current_piece) > state->cursor)
+			break;
+		boundary = segment_end(current_piece);
 	}
 	
+	state->cursor 		= boundary;
+	state->next_free 	= (uchar*)left == boundary ? left : right;
+	state->generation 	= heap_generation;
+	return 1;
+}
+
+
+/*
+*	Walks the segments from malloc_heap_start towards malloc_break, following the freelist alongside. Since the freelist 
+*	is address ordered, a segment is free exactly when it is the next freelist entry expected. At most max_segments 
+*	segments are visited per call. If the heap was modified in between, the walk picks up where it left off with 
+*	check_resync(), so a pass completes under allocation traffic; the segments already visited are checked again on 
+*	the next pass.
+*/
+static int check_segments(Heap_Check_State *state, size_t max_segments, Heap_Walk_Callback callback, void* arg)
+{
+	Heap_Seg *current_piece;
+	int is_free;
 	
+	if(state->cursor && state->generation != heap_generation && !check_resync(state))
+		state->cursor = NULL;
 	
-	//Iterate the freelist and find the closest adjacent free pieces to p, if the expanding piece is not at the break
-	for(current_piece = freelist_head; current_piece; current_piece = current_piece->next)
+	if(!state->cursor)
 	{
-		if(current_piece < p_entry)
-		{
-			closest_left_prev = closest_left;
-			closest_left = current_piece;
-		}
-		else if(current_piece > p_entry)
-		{
-			closest_right_prev = closest_left;
-			closest_right = current_piece;
-			break;
-		}
-		else
+		state->cursor 		= malloc_heap_start;
+		state->next_free 	= freelist_head;
+		state->generation 	= heap_generation;
+		state->segments 	= 0;
+		
+		if(freelist_head && (uchar*)freelist_head < malloc_heap_start)
 		{
-			//There should never be an occurance where p_entry is in the freelist. This might be a double free attempt
-			fprintf(stderr, "Double free detected! Free Piece %p, size %zu, next %p\n", current_piece, current_piece->size, current_piece->next);
-			return NULL;
+			fprintf(stderr,"heap check: Freelist head %p lies below the heap start %p!\n", freelist_head, malloc_heap_start);
+			return HEAP_CHECK_CORRUPT;
 		}
 	}
 	
-	
-	
-	/****************************************/
-	/*	Growing In-place, adjacent right	*/
-	/****************************************/
-	
-	if(closest_right && segment_end(p_entry) == (uchar*)closest_right)
-	{			
-		//Merging with adjacent right piece if it fits exactly (with the header consumed)
-		if(closest_right->size + sizeof(Heap_Seg) == size_diff)
+	for(; max_segments && state->cursor < malloc_break; max_segments--)
+	{
+		current_piece = (Heap_Seg*)state->cursor;
+		
+		//The header and its segment must fit below the break
+		if(state->cursor + sizeof(Heap_Seg) > malloc_break || current_piece->size >= MAX_HEAP_SIZE || segment_end(current_piece) > malloc_break)
 		{
-			p_entry->size = len;
-			
-			//Update Freelist chain
-			if(closest_right_prev)
-				closest_right_prev->next = closest_right->next;
-			else
-				freelist_head = closest_right->next;
-
-			//Wipe the old seg entry, as it's now part of the allocated memory
-			closest_right->size = 0;
-			closest_right->next = NULL;
-			
-			#ifdef DEBUG_MY_REALLOC
-			printf("realloc: Merging with adjacent right piece yields exact size. New size %zu at %p\n", p_entry->size, p_entry);
-			#endif
-			
-			return p;
+			fprintf(stderr,"heap check: Segment %p (size %zu) runs past the malloc break %p!\n", current_piece, current_piece->size, malloc_break);
+			return HEAP_CHECK_CORRUPT;
 		}
 		
-		//Merging with adjacent right piece yields excess free spaces (with a new header added)
-		else if(closest_right->size > size_diff)
+		is_free = (current_piece == state->next_free);
+		
+		if(is_free)
 		{
-			#ifdef DEBUG_MY_REALLOC
-			printf("realloc: Planning to split adjacent right piece of size %zu at %p for merging\n", closest_right->size, closest_right);
-			#endif
-			
-			p_entry->size = len;
-			
-			//Write a free segment entry for the left over free space
-			new_entry = (Heap_Seg*)segment_end(p_entry);
-			write_seg_header(new_entry, closest_right->size - size_diff, closest_right->next);
-			
-			//Update Freelist chain
-			if(closest_right_prev)
-				closest_right_prev->next = new_entry;
-			else
-				freelist_head = new_entry;
-			
-			#ifdef DEBUG_MY_REALLOC
-			printf("realloc: Expanded Piece: size %zu at %p\n", len, p_entry);
-			printf("realloc: Free Piece: size %zu at %p\n", new_entry->size, new_entry);
-			#endif
-			
-			//Wipe the old seg entry, as it's now part of the allocated memory
-			if(size_diff > sizeof(Heap_Seg))
+			//Free pieces must be in address order, and adjacent ones should have been merged
+			if(seg_next(current_piece) && (uchar*)seg_next(current_piece) <= segment_end(current_piece))
 			{
-				closest_right->size = 0;
-				closest_right->next = NULL;
+				fprintf(stderr,"heap check: Free piece %p (size %zu) is followed by %p, which is %s!\n", current_piece, current_piece->size, 
+					seg_next(current_piece), (uchar*)seg_next(current_piece) == segment_end(current_piece) ? "adjacent and not coalesced" : "out of order");
+				return HEAP_CHECK_CORRUPT;
 			}
-				
-			return p;
+			
+			state->next_free = seg_next(current_piece);
 		}
-	}
-	
-	
-	
-	/****************************************/
-	/*	Growing In-place, adjacent left		*/
-	/****************************************/
-	
-	if(closest_left && segment_end(closest_left) == (uchar*)p_entry)
-	{	
-		//Merging with adjacent left piece if it fits exactly (with the header consumed)
-		if(closest_left->size + sizeof(Heap_Seg) == size_diff)
+		else
 		{
-			#ifdef DEBUG_MY_REALLOC
-			printf("realloc: Merging with adjacent left piece yields exact size. New piece at %p, size %zu\n", closest_left, len);
-			#endif
-			
-			retaddr = (uchar*)closest_left + sizeof(Heap_Seg);
-			closest_left->size = len;
-			
-			//Update Freelist chain
-			if(closest_left_prev)
-				closest_left_prev->next = closest_left->next;
-			else
-				freelist_head = closest_left->next;
-			
-			//Shift existing data over
-			memcpy(retaddr, p, p_entry->size);
+			if(!seg_is_in_use(current_piece))
+			{
+				fprintf(stderr,"heap check: Allocated piece %p (size %zu) has a corrupted header (next %p)!\n", current_piece, current_piece->size, current_piece->next);
+				return HEAP_CHECK_CORRUPT;
+			}
 			
-			return retaddr;
+			if(state->next_free && (uchar*)state->next_free < segment_end(current_piece))
+			{
+				fprintf(stderr,"heap check: Free piece %p lies inside the allocated piece %p (size %zu)!\n", state->next_free, current_piece, current_piece->size);
+				return HEAP_CHECK_CORRUPT;
+			}
 		}
 		
-		//Merging with adjacent left piece yields excess free spaces
-		else if(closest_left->size > size_diff)
+		if(callback && callback((uchar*)current_piece + sizeof(Heap_Seg), current_piece->size, is_free, arg))
 		{
-			#ifdef DEBUG_MY_REALLOC
-			printf("realloc: Planning to split adjacent left piece of size %zu at %p for merging\n", closest_left->size, closest_left);
-			#endif
-			
-			closest_left->size -= size_diff;
-			
-			//Write a new segment header at the expanded location
-			new_entry = (Heap_Seg*)segment_end(closest_left);
-			write_seg_header(new_entry, len, NULL);
-			retaddr = (uchar*)new_entry + sizeof(Heap_Seg);
-			
-			//Shift existing data over
-			memcpy(retaddr, p, p_entry->size);
-			
-			
-			#ifdef DEBUG_MY_REALLOC
-			printf("realloc: Expanded Piece: size %zu at %p\n", new_entry->size, new_entry);
-			printf("realloc: Free Piece: size %zu at %p\n", closest_left->size, closest_left);
-			#endif
-			
-			return retaddr;
+			state->cursor = NULL;
+			return HEAP_CHECK_DONE;
 		}
+		
+		state->cursor = segment_end(current_piece);
+		state->segments++;
+	}
+	
+	if(state->cursor < malloc_break)
+		return HEAP_CHECK_IN_PROGRESS;
+	
+	//The walk must end exactly at the break with every freelist entry visited
+	if(state->cursor != malloc_break || state->next_free)
+	{
+		fprintf(stderr,"heap check: Walk ended at %p with free piece %p unvisited, but the malloc break is %p!\n", state->cursor, state->next_free, malloc_break);
+		return HEAP_CHECK_CORRUPT;
 	}
 	
+	#ifdef DEBUG_MY_MALLOC
+	printf("heap check: %zu segments are consistent\n", state->segments);
+	#endif
+	
+	state->cursor = NULL;
+	return HEAP_CHECK_DONE;
+}
+
+
+int heap_walk(Heap_Walk_Callback callback, void* arg)
+{
+	Heap_Check_State state = {0};
 	
+	return check_segments(&state, (size_t)-1, callback, arg) == HEAP_CHECK_DONE;
+}
+
+
+int heap_check(void)
+{
+	return heap_walk(NULL, NULL) && free_index_check();
+}
+
+
+int heap_check_step(Heap_Check_State *state, size_t max_segments)
+{
+	return check_segments(state, max_segments, NULL, NULL);
+}
+
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							STATISTICS EXPORT  							*/
+/************************************************************************/
+
+#ifdef MY_MALLOC_STATS
+
+Malloc_Stats malloc_stats(void)
+{
+	Malloc_Stats snapshot = stats;
+	Heap_Seg *current_piece;
 	
+	snapshot.largest_free = 0;
+	for(current_piece = freelist_head; current_piece; current_piece = seg_next(current_piece))
+		if(current_piece->size > snapshot.largest_free)
+			snapshot.largest_free = current_piece->size;
 	
-	/****************************************/
-	/*		New Allocation for growth		*/
-	/****************************************/
+	snapshot.heap_span = malloc_break - malloc_heap_start;
+	snapshot.external_fragmentation = snapshot.free_bytes ? 1.0 - (double)snapshot.largest_free / snapshot.free_bytes : 0.0;
+	snapshot.span_utilization = snapshot.heap_span ? (double)snapshot.alloc_bytes / snapshot.heap_span : 0.0;
 	
-	#ifdef DEBUG_MY_REALLOC
-	printf("realloc: Cannot grow in-place. Allocating a new piece using malloc...\n");
-	#endif
+	return snapshot;
+}
+
+
+static void print_histogram(FILE* out, const char* name, const size_t* hist, int json)
+{
+	unsigned int i, last = 0, first = 1;
 	
-	retaddr = my_malloc(len);
+	for(i = 0; i < MALLOC_STATS_BUCKETS; i++)
+		if(hist[i])
+			last = i;
 	
-	if(!retaddr) 
-		return NULL;
+	if(json)
+	{
+		fprintf(out, "  \"%s\": [", name);
+		for(i = 0; i <= last; i++)
+			fprintf(out, "%s%zu", i ? ", " : "", hist[i]);
+		fprintf(out, "]");
+		return;
+	}
 	
-	memcpy(retaddr, p, p_entry->size);
-	my_free(p);
+	fprintf(out, "%s size histogram:\n", name);
+	for(i = 0; i <= last; i++)
+	{
+		if(!hist[i] && first)
+			continue;
+		first = 0;
+		fprintf(out, "  [%zu, %zu): %zu\n", i ? (size_t)1 << i : 0, (size_t)1 << (i + 1), hist[i]);
+	}
+}
 
-	return retaddr;
+
+void malloc_stats_print(FILE* out, int json)
+{
+	Malloc_Stats s = malloc_stats();
+	
+	if(json)
+	{
+		fprintf(out, "{\n");
+		fprintf(out, "  \"heap_span\": %zu,\n", s.heap_span);
+		fprintf(out, "  \"alloc_bytes\": %zu,\n  \"alloc_pieces\": %zu,\n", s.alloc_bytes, s.alloc_pieces);
+		fprintf(out, "  \"free_bytes\": %zu,\n  \"free_pieces\": %zu,\n", s.free_bytes, s.free_pieces);
+		fprintf(out, "  \"largest_free\": %zu,\n", s.largest_free);
+		fprintf(out, "  \"external_fragmentation\": %.4f,\n", s.external_fragmentation);
+		fprintf(out, "  \"span_utilization\": %.4f,\n", s.span_utilization);
+		print_histogram(out, "free_hist", s.free_hist, 1);
+		fprintf(out, ",\n");
+		print_histogram(out, "alloc_hist", s.alloc_hist, 1);
+		fprintf(out, "\n}\n");
+		return;
+	}
+	
+	fprintf(out, "Heap span: %zu bytes, utilization %.1f%%\n", s.heap_span, s.span_utilization * 100);
+	fprintf(out, "Allocated: %zu bytes in %zu pieces\n", s.alloc_bytes, s.alloc_pieces);
+	fprintf(out, "Free: %zu bytes in %zu pieces, largest %zu\n", s.free_bytes, s.free_pieces, s.largest_free);
+	fprintf(out, "External fragmentation: %.1f%%\n", s.external_fragmentation * 100);
+	print_histogram(out, "Free", s.free_hist, 0);
+	print_histogram(out, "Allocated", s.alloc_hist, 0);
 }
 
+#endif
+
 
 #undef MAX_HEAP_SIZE
 #undef segment_end
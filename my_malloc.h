@@ -10,11 +10,143 @@
 #define NULL 0
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 
-//Enable debug prints
+//Enable debug prints (define MY_MALLOC_QUIET when building to compile them out, e.g. for benchmarks)
+#ifndef MY_MALLOC_QUIET
 #define DEBUG_MY_MALLOC
 #define DEBUG_MY_FREE
 #define DEBUG_MY_REALLOC
+#endif
+
+
+//Optional features. Uncomment here, or pass -D<FEATURE> when building
+//#define MY_MALLOC_HARDENED				//Header canaries, freelist pointer mangling and O(1) double free detection
+//#define MY_MALLOC_QUARANTINE				//Poison freed blocks and hold them in a FIFO to catch use after free
+//#define MY_MALLOC_STATS					//Free/allocated size histograms and fragmentation metrics
+//#define MY_MALLOC_FASTBINS				//Per-size LIFO bins for small freed blocks, coalesced in batches
+//#define MY_MALLOC_STACK_GUARD				//Linux only: keep the break below the thread's stack, with a guard region in between
+//#define MY_MALLOC_OS_HEAP					//Linux only: init_malloc_os() maps the heap itself, optionally with huge pages
+//#define MY_MALLOC_DECAY					//Linux only: hand the pages inside long unused free pieces back to the OS
+//#define MY_MALLOC_PERCPU					//Linux only: thread safe heap with lock-free per-CPU caches of small blocks
+//#define MY_MALLOC_PROFILE					//Sample allocations with their call stacks, dump the live bytes per stack (link with -lm)
+//#define MY_MALLOC_LATENCY					//Latency histograms of malloc, free and realloc, per path taken
+//#define MY_MALLOC_USDT					//Static tracepoints for perf, bpftrace and SystemTap (needs <sys/sdt.h>)
+//#define MY_MALLOC_PERSISTENT				//Crash-consistent heap metadata stored inside the heap region (e.g. file-backed heaps)
+//#define MY_MALLOC_FREE_INDEX				//Search a dense table of the free pieces instead of walking their headers
+
+
+#ifdef MY_MALLOC_QUARANTINE
+#ifndef MY_MALLOC_QUARANTINE_BYTES
+#define MY_MALLOC_QUARANTINE_BYTES		(64 * 1024)			//Default budget, change at runtime with M_QUARANTINE_BYTES (0 disables)
+#endif
+#ifndef MY_MALLOC_QUARANTINE_SLOTS
+#define MY_MALLOC_QUARANTINE_SLOTS		1024				//Most blocks held at once, regardless of the budget
+#endif
+#endif
+
+
+#ifdef MY_MALLOC_FASTBINS
+#ifndef MY_MALLOC_FASTBIN_MAX
+#define MY_MALLOC_FASTBIN_MAX			128					//Largest block size kept in a fastbin (one bin per size), lower it with M_FASTBIN_MAX
+#endif
+#ifndef MY_MALLOC_FASTBIN_BYTES
+#define MY_MALLOC_FASTBIN_BYTES			(64 * 1024)			//Fastbins are consolidated once they hold more, change with M_FASTBIN_BYTES
+#endif
+#endif
+
+
+#ifdef MY_MALLOC_STACK_GUARD
+#ifndef MY_MALLOC_STACK_GUARD_SIZE
+#define MY_MALLOC_STACK_GUARD_SIZE		(64 * 1024)			//Size of the PROT_NONE region between the heap and the stack
+#endif
+#endif
+
+
+#ifdef MY_MALLOC_DECAY
+#ifndef MY_MALLOC_DECAY_MS
+#define MY_MALLOC_DECAY_MS				10000				//Free pieces are purged after this many ms, change with M_DECAY_MS
+#endif
+#ifndef MY_MALLOC_DECAY_ADVICE
+#define MY_MALLOC_DECAY_ADVICE			MADV_DONTNEED		//Or MADV_FREE, which lets the OS take the pages only when it needs them
+#endif
+#endif
+
+
+#ifdef MY_MALLOC_PERCPU
+#ifndef MY_MALLOC_PERCPU_MAX
+#define MY_MALLOC_PERCPU_MAX			256					//Largest request served from the per-CPU caches, a multiple of 16
+#endif
+#ifndef MY_MALLOC_PERCPU_DEPTH
+#define MY_MALLOC_PERCPU_DEPTH			32					//Most blocks cached per size class and CPU, half of them move in a batch
+#endif
+#ifndef MY_MALLOC_PERCPU_SLOTS
+#define MY_MALLOC_PERCPU_SLOTS			64					//Number of caches, CPUs beyond this share them
+#endif
+#endif
+
+
+#ifdef MY_MALLOC_PROFILE
+#ifndef MY_MALLOC_PROFILE_RATE
+#define MY_MALLOC_PROFILE_RATE			(512 * 1024)		//Mean bytes allocated between two samples, change with M_PROFILE_RATE (0 disables)
+#endif
+#ifndef MY_MALLOC_PROFILE_SLOTS
+#define MY_MALLOC_PROFILE_SLOTS			4096				//Most sampled blocks tracked at once
+#endif
+#ifndef MY_MALLOC_PROFILE_STACKS
+#define MY_MALLOC_PROFILE_STACKS		1024				//Most distinct call stacks recorded
+#endif
+#ifndef MY_MALLOC_PROFILE_DEPTH
+#define MY_MALLOC_PROFILE_DEPTH			32					//Frames recorded per call stack
+#endif
+#endif
+
+
+#ifdef MY_MALLOC_FREE_INDEX
+#ifndef MY_MALLOC_FREE_INDEX_SLOTS
+#define MY_MALLOC_FREE_INDEX_SLOTS		16384				//Most free pieces indexed, searches walk the freelist while there are more
+#endif
+#endif
+
+
+//Parameters for my_mallopt()
+#define M_QUARANTINE_BYTES		1
+#define M_PLACEMENT				2				//One of the PLACEMENT_* policies below, per heap
+#define M_BEST_FIT_TOLERANCE	3				//Bytes of waste at which a best fit search stops early, per heap (default 0)
+#define M_FASTBIN_MAX			4
+#define M_FASTBIN_BYTES			5
+#define M_TRIM_THRESHOLD		6				//Free lowers the break once the free tail reaches this many bytes (default 0)
+#define M_TOP_PAD				7				//Free space kept at the tail when the break grows or is lowered (default 0)
+#define M_GROW_CHUNK			8				//The break grows in multiples of this many bytes (default 1)
+#define M_DECAY_MS				9				//Free pieces are purged after being unused this long, (size_t)-1 never purges
+#define M_PROFILE_RATE			10				//Mean bytes allocated between two profiler samples, 0 stops sampling
+
+//Pages backing a heap mapped by init_malloc_os()
+#define HEAP_PAGES_SMALL			0			//The normal page size
+#define HEAP_PAGES_TRANSPARENT		1			//Transparent huge pages, requested with madvise(MADV_HUGEPAGE)
+#define HEAP_PAGES_HUGETLB			2			//Huge pages reserved for hugetlbfs (MAP_HUGETLB), transparent huge pages if there are none
+
+//Paths timed by MY_MALLOC_LATENCY, see malloc_latency()
+#define LATENCY_EXACT				0			//Malloc reused a free piece of the exact size, or a binned or cached block
+#define LATENCY_SPLIT				1			//Malloc split a larger free piece
+#define LATENCY_GROW				2			//Malloc grew the break
+#define LATENCY_INSERT				3			//Free inserted the block into the freelist without merging it
+#define LATENCY_MERGE_LEFT			4			//Free merged the block with the free piece before it
+#define LATENCY_MERGE_RIGHT			5			//Free merged the block with the free piece after it
+#define LATENCY_MERGE_BOTH			6			//Free merged the block with the free pieces on both sides
+#define LATENCY_DEFERRED			7			//Free held the block in a fastbin, the quarantine or a per-CPU cache
+#define LATENCY_IN_PLACE			8			//Realloc or my_expand resized the block where it is
+#define LATENCY_COPY				9			//Realloc moved the block and copied its contents
+#define LATENCY_ALIGNED				10			//my_memalign
+#define LATENCY_PATHS				11
+
+//Placement policies, i.e. which free piece malloc splits or reuses
+#define PLACEMENT_BEST_FIT		0				//Smallest piece that fits (default)
+#define PLACEMENT_FIRST_FIT		1				//Lowest addressed piece that fits
+#define PLACEMENT_NEXT_FIT		2				//First fit, resuming after the piece used by the previous search
 
 
 /*
@@ -30,6 +162,56 @@ typedef struct heap_seg{
 }Heap_Seg;
 
 
+#ifdef MY_MALLOC_STATS
+
+#define MALLOC_STATS_BUCKETS	(sizeof(size_t) * 8)
+
+/*
+*	Heap statistics, see malloc_stats(). Sizes count segment payloads and exclude the segment headers. 
+*	Histogram bucket i counts the pieces with a size in [2^i, 2^(i+1)); bucket 0 also counts the empty ones.
+*/
+typedef struct {
+	
+	//Maintained incrementally by malloc, free and realloc
+	size_t free_bytes;
+	size_t free_pieces;
+	size_t alloc_bytes;
+	size_t alloc_pieces;
+	size_t free_hist[MALLOC_STATS_BUCKETS];
+	size_t alloc_hist[MALLOC_STATS_BUCKETS];
+	
+	//Computed when the snapshot is taken
+	size_t largest_free;
+	size_t heap_span;						//Bytes between the heap start and the malloc break
+	double external_fragmentation;			//1 - largest_free / free_bytes
+	double span_utilization;				//alloc_bytes / heap_span
+	
+}Malloc_Stats;
+
+#endif
+
+
+#ifdef MY_MALLOC_LATENCY
+
+/*
+*	Latency of one path, see malloc_latency(). Percentiles are the upper bounds of the histogram buckets they fall in,
+*	at most 25% above the true value.
+*/
+typedef struct {
+	
+	uint64_t count;
+	double mean_ns;
+	double p50_ns;
+	double p90_ns;
+	double p99_ns;
+	double p999_ns;
+	double max_ns;
+	
+}Malloc_Latency;
+
+#endif
+
+
 typedef struct {
 	
 	unsigned char* malloc_heap_start;
@@ -37,18 +219,138 @@ typedef struct {
 	unsigned char* malloc_break;
 	Heap_Seg *freelist_head;
 	
+	int placement_policy;
+	size_t best_fit_tolerance;
+	Heap_Seg *next_fit_rover;
+	unsigned char* reserve_end;
+	
+	#ifdef MY_MALLOC_STACK_GUARD
+	unsigned char* break_limit;
+	#endif
+	
+	#ifdef MY_MALLOC_OS_HEAP
+	size_t os_page_size;
+	unsigned char* os_dirty_end;
+	#endif
+	
+	#ifdef MY_MALLOC_PERSISTENT
+	void *heap_root;
+	#endif
+	
+	#ifdef MY_MALLOC_HARDENED
+	uintptr_t pointer_secret;
+	uintptr_t canary_secret;
+	#endif
+	
+	#ifdef MY_MALLOC_STATS
+	Malloc_Stats stats;
+	#endif
+	
 }Malloc_Param;
 
 
+/*
+*	Progress of an incremental heap check. Zero it before the first call to heap_check_step().
+*/
+typedef struct {
+	
+	unsigned char* cursor;					//Next segment to visit, NULL when no walk is in progress
+	Heap_Seg *next_free;					//Next freelist entry expected, in address order
+	unsigned long generation;				//The walk finds its place again if the heap changed since the last step
+	size_t segments;
+	
+}Heap_Check_State;
+
+#define HEAP_CHECK_CORRUPT			0
+#define HEAP_CHECK_DONE				1
+#define HEAP_CHECK_IN_PROGRESS		2
+
+/*
+*	Object caches, see cache_create(). The constructor runs when an object is first handed out, and the destructor when 
+*	its slab is given back to the heap; objects freed in between keep their state.
+*/
+typedef struct obj_cache Obj_Cache;
+typedef void (*Obj_Ctor)(void* obj);
+
+typedef struct {
+	
+	const char* name;
+	size_t object_size;						//Size of an object, rounded up to its alignment
+	size_t slab_size;
+	size_t slabs;
+	size_t capacity;						//Objects the slabs have room for
+	size_t in_use;
+	size_t allocs;
+	size_t frees;
+	size_t constructed;						//Constructor calls
+	size_t reused;							//Allocations handed an object that was already constructed
+	
+}Obj_Cache_Stats;
+
+
+//Called for every segment by heap_walk(); return non-zero to stop the walk
+typedef int (*Heap_Walk_Callback)(void* p, size_t size, int is_free, void* arg);
+
+
 
 int init_malloc(unsigned char* start, unsigned char* end);
 Malloc_Param save_malloc_param(void);
 void load_malloc_param(Malloc_Param p);
+void* get_malloc_break();
+
+#ifdef MY_MALLOC_OS_HEAP
+void* init_malloc_os(size_t size, int pages);
+#endif
+
+#ifdef MY_MALLOC_PERSISTENT
+int attach_malloc(unsigned char* start, unsigned char* end);
+#endif
 
 void* my_malloc(size_t len);
 void* my_calloc(size_t nitems, size_t size);
 void my_free(void *p);
 void* my_realloc(void *ptr, size_t len);
+size_t my_expand(void *p, size_t min_len, size_t max_len);
+void* my_memalign(size_t align, size_t len);
+void my_free_sized(void *p, size_t size);
+int my_mallopt(int param, size_t value);
+int my_malloc_trim(size_t pad);
+size_t my_reserve(size_t bytes, int populate);
 
+#ifdef MY_MALLOC_FASTBINS
+size_t my_reserve_bins(const size_t *counts, size_t max_len);
+#endif
+
+Obj_Cache* cache_create(const char* name, size_t size, size_t align, Obj_Ctor ctor, Obj_Ctor dtor);
+void* cache_alloc(Obj_Cache* cache);
+void cache_free(Obj_Cache* cache, void* obj);
+size_t cache_shrink(Obj_Cache* cache);
+void cache_destroy(Obj_Cache* cache);
+Obj_Cache_Stats cache_stats(Obj_Cache* cache);
+
+int heap_walk(Heap_Walk_Callback callback, void* arg);
+int heap_check(void);
+int heap_check_step(Heap_Check_State *state, size_t max_segments);
+
+#ifdef MY_MALLOC_PROFILE
+int my_malloc_profile_dump(FILE* out);
+#endif
+
+#ifdef MY_MALLOC_LATENCY
+int malloc_latency(int path, Malloc_Latency *latency);
+void malloc_latency_reset(void);
+int malloc_latency_last_path(void);
+void malloc_latency_print(FILE* out);
+#endif
 
-#endif
\ No newline at end of file
+#ifdef MY_MALLOC_STATS
+Malloc_Stats malloc_stats(void);
+void malloc_stats_print(FILE* out, int json);
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
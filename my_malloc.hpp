@@ -0,0 +1,167 @@
+#ifndef MY_MALLOC_HPP
+#define MY_MALLOC_HPP
+
+/*
+*	C++ bindings for the dynamic heap. Build my_malloc.c as C and link it in, e.g.
+*
+*		gcc -O2 -c my_malloc.c
+*		g++ -std=c++17 -O2 program.cpp my_malloc.o
+*
+*	MyHeap owns one heap region and is a std::pmr::memory_resource, so pmr containers can be placed on it. MyAllocator<T>
+*	is a classic allocator bound to a MyHeap, or to whichever heap the C functions currently work on when it is default
+*	constructed.
+*
+*	The C functions work on one heap at a time. A heap object makes itself the current heap when it is used, saving the
+*	state of the heap it replaces with save_malloc_param() and loading its own with load_malloc_param(), so switching
+*	costs as much as those calls (the quarantine and fastbins are flushed). Heaps created here should only be used
+*	through these classes, and, like the C functions, not from several threads at once.
+*/
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include "my_malloc.h"
+
+
+class MyHeap : public std::pmr::memory_resource {
+
+public:
+
+	MyHeap(void* start, void* end)
+	{
+		deactivate_current();
+		if(!init_malloc(static_cast<unsigned char*>(start), static_cast<unsigned char*>(end)))
+			throw std::bad_alloc();
+		param_ = save_malloc_param();
+		current_ = this;
+	}
+
+	~MyHeap()
+	{
+		if(current_ == this)
+			current_ = nullptr;
+	}
+
+	MyHeap(const MyHeap&) = delete;
+	MyHeap& operator=(const MyHeap&) = delete;
+
+
+	//Makes this the heap the C functions work on
+	void activate()
+	{
+		if(current_ == this)
+			return;
+		deactivate_current();
+		load_malloc_param(param_);
+		current_ = this;
+	}
+
+	void* allocate_bytes(std::size_t bytes, std::size_t align)
+	{
+		activate();
+		return my_memalign(align, bytes);
+	}
+
+	void deallocate_bytes(void* p, std::size_t bytes)
+	{
+		activate();
+		my_free_sized(p, bytes);
+	}
+
+
+private:
+
+	void* do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		void* p = allocate_bytes(bytes, align);
+
+		if(!p)
+			throw std::bad_alloc();
+		return p;
+	}
+
+	void do_deallocate(void* p, std::size_t bytes, std::size_t) override
+	{
+		deallocate_bytes(p, bytes);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return this == &other;
+	}
+
+	//Saves the state of the heap that is replaced, so it can be loaded again later
+	static void deactivate_current()
+	{
+		if(current_)
+			current_->param_ = save_malloc_param();
+		current_ = nullptr;
+	}
+
+	Malloc_Param param_;
+	static inline MyHeap* current_ = nullptr;
+};
+
+
+
+template <class T>
+class MyAllocator {
+
+public:
+
+	typedef T value_type;
+
+	MyAllocator() noexcept = default;
+	explicit MyAllocator(MyHeap& h) noexcept : heap_(&h) {}
+
+	template <class U>
+	MyAllocator(const MyAllocator<U>& other) noexcept : heap_(other.bound_heap()) {}
+
+	T* allocate(std::size_t n)
+	{
+		void* p;
+
+		if(n > static_cast<std::size_t>(-1) / sizeof(T))
+			throw std::bad_array_new_length();
+
+		p = heap_ ? heap_->allocate_bytes(n * sizeof(T), alignof(T)) : my_memalign(alignof(T), n * sizeof(T));
+		if(!p)
+			throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, std::size_t n) noexcept
+	{
+		if(heap_)
+			heap_->deallocate_bytes(p, n * sizeof(T));
+		else
+			my_free_sized(p, n * sizeof(T));
+	}
+
+	MyHeap* bound_heap() const noexcept
+	{
+		return heap_;
+	}
+
+
+private:
+
+	MyHeap* heap_ = nullptr;					//nullptr for the current heap
+};
+
+
+template <class T, class U>
+bool operator==(const MyAllocator<T>& a, const MyAllocator<U>& b) noexcept
+{
+	return a.bound_heap() == b.bound_heap();
+}
+
+template <class T, class U>
+bool operator!=(const MyAllocator<T>& a, const MyAllocator<U>& b) noexcept
+{
+	return !(a == b);
+}
+
+
+
+#endif
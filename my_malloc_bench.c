@@ -0,0 +1,463 @@
+/*
+Single threaded throughput benchmark for the allocator. Build it with the debug prints compiled out, e.g.
+
+	gcc -O2 -DMY_MALLOC_QUIET my_malloc.c my_malloc_bench.c -o my_malloc_bench
+	gcc -O2 -DMY_MALLOC_QUIET -DMY_MALLOC_PERSISTENT my_malloc.c my_malloc_bench.c -o my_malloc_bench_persistent
+	gcc -O2 -DMY_MALLOC_QUIET -DMY_MALLOC_OS_HEAP my_malloc.c my_malloc_bench.c -o my_malloc_bench_pages
+	gcc -O2 -DMY_MALLOC_QUIET -DMY_MALLOC_LATENCY my_malloc.c my_malloc_bench.c -o my_malloc_bench_latency
+
+Each workload starts from a fresh heap and runs a random mix of malloc, realloc and free over a fixed number of slots,
+once for every placement policy. Besides the throughput, the free space left behind shows how much each policy fragments the heap.
+
+On Linux, one workload is also run with the CPU's counters (cycles, instructions, L1d, LLC and dTLB misses, branch misses)
+read around every call, and their cost per call is reported for each path the calls took. The paths are those of
+MY_MALLOC_LATENCY when it is enabled, and malloc, realloc and free otherwise. Most VMs have no counters to read.
+*/
+
+#include <stdlib.h>
+#include <time.h>
+#include "my_malloc.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#ifdef MY_MALLOC_OS_HEAP
+#include <sys/mman.h>
+#endif
+
+
+#define HEAP_SIZE		(64 << 20)
+#define SLOTS			1024
+#define OPERATIONS		2000000
+
+static unsigned char heap[HEAP_SIZE];
+static void *slots[SLOTS];
+static uint64_t rng_state = 88172645463325252ULL;
+
+
+
+static const struct {
+	
+	const char* name;
+	int policy;
+	size_t tolerance;
+	
+}policies[] = {
+	{"best fit", 		PLACEMENT_BEST_FIT, 	0},
+	{"best fit +64", 	PLACEMENT_BEST_FIT, 	64},
+	{"first fit", 		PLACEMENT_FIRST_FIT, 	0},
+	{"next fit", 		PLACEMENT_NEXT_FIT, 	0},
+};
+
+
+
+static inline uint64_t rng(void)					//xorshift64, cheap enough to not skew the timings
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static size_t free_bytes, free_pieces, largest_free;
+
+static int count_free(void* p, size_t size, int is_free, void* arg)
+{
+	if(is_free)
+	{
+		free_bytes += size;
+		free_pieces++;
+		if(size > largest_free)
+			largest_free = size;
+	}
+	return 0;
+}
+
+
+/*Runs the workload with requests of 1 to max_size bytes. With fixed_sizes, each slot always requests the same size,
+so most allocations follow a free of the same size*/
+static void bench_churn(const char* name, size_t max_size, int fixed_sizes, size_t policy)
+{
+	Malloc_Param param;
+	double start, elapsed;
+	size_t i, slot, failed = 0;
+
+	init_malloc(heap, heap + HEAP_SIZE);
+	my_mallopt(M_PLACEMENT, policies[policy].policy);
+	my_mallopt(M_BEST_FIT_TOLERANCE, policies[policy].tolerance);
+	memset(slots, 0, sizeof(slots));
+	rng_state = 88172645463325252ULL;
+
+	start = now_ns();
+	for(i = 0; i < OPERATIONS; i++)
+	{
+		slot = rng() % SLOTS;
+
+		if(!slots[slot])
+		{
+			slots[slot] = my_malloc(fixed_sizes ? slot * 2654435761u % max_size + 1 : rng() % max_size + 1);
+			failed += !slots[slot];
+		}
+		else if(!fixed_sizes && rng() % 4 == 0)
+		{
+			void *p = my_realloc(slots[slot], rng() % max_size + 1);
+
+			if(p)
+				slots[slot] = p;
+			else
+				failed++;
+		}
+		else
+		{
+			my_free(slots[slot]);
+			slots[slot] = NULL;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	free_bytes = free_pieces = largest_free = 0;
+	heap_walk(count_free, NULL);
+	
+	param = save_malloc_param();
+	printf("%-14s %-14s %8.1f ns/op   heap span %8zu bytes   free %8zu bytes in %5zu pieces (largest %7zu)   failed %zu\n", 
+		name, policies[policy].name, elapsed / OPERATIONS, (size_t)(param.malloc_break - param.malloc_heap_start), 
+		free_bytes, free_pieces, largest_free, failed);
+}
+
+
+/*A stack-like workload that keeps allocating and freeing at the tail of the heap, counting how often the break moved.
+With an OS-backed heap, each of those moves would be a system call.*/
+static void bench_tail(const char* name, size_t trim_threshold, size_t grow_chunk)
+{
+	double start, elapsed;
+	size_t i, depth = 0, moves = 0;
+	void *brk;
+
+	init_malloc(heap, heap + HEAP_SIZE);
+	my_mallopt(M_PLACEMENT, PLACEMENT_BEST_FIT);
+	my_mallopt(M_TRIM_THRESHOLD, trim_threshold);
+	my_mallopt(M_GROW_CHUNK, grow_chunk);
+	rng_state = 88172645463325252ULL;
+	
+	start = now_ns();
+	for(i = 0; i < OPERATIONS; i++)
+	{
+		brk = get_malloc_break();
+		
+		if(depth < 8 && (depth == 0 || rng() % 2))
+			slots[depth++] = my_malloc(rng() % 4096 + 1);
+		else
+			my_free(slots[--depth]);
+		
+		moves += (brk != get_malloc_break());
+	}
+	elapsed = now_ns() - start;
+	
+	while(depth)
+		my_free(slots[--depth]);
+	
+	my_mallopt(M_TRIM_THRESHOLD, 0);
+	my_mallopt(M_GROW_CHUNK, 1);
+	printf("%-29s %8.1f ns/op   break moved %zu times\n", name, elapsed / OPERATIONS, moves);
+}
+
+
+#ifdef __linux__
+
+#define HW_CACHE_MISS(cache)	(PERF_COUNT_HW_CACHE_##cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+#define COUNTERS				6
+#define COUNTER_DTLB			4
+#define COUNTED_OPERATIONS		200000
+#define COUNTER_CALIBRATIONS	10000
+
+static const struct {
+	
+	const char* name;
+	uint32_t type;
+	uint64_t config;
+	
+}counter_events[COUNTERS] = {
+	{"cycles", 		PERF_TYPE_HARDWARE, 	PERF_COUNT_HW_CPU_CYCLES},
+	{"instr", 		PERF_TYPE_HARDWARE, 	PERF_COUNT_HW_INSTRUCTIONS},
+	{"L1d miss", 	PERF_TYPE_HW_CACHE, 	HW_CACHE_MISS(L1D)},
+	{"LLC miss", 	PERF_TYPE_HW_CACHE, 	HW_CACHE_MISS(LL)},
+	{"dTLB miss", 	PERF_TYPE_HW_CACHE, 	HW_CACHE_MISS(DTLB)},
+	{"br miss", 	PERF_TYPE_HARDWARE, 	PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int counter_fds[COUNTERS];						//-1 for the events that could not be opened
+static int counter_leader = -1;
+
+
+/*Opens the counters of this thread as one group, so they are all read with a single system call. Events the CPU does 
+not have are left out. Returns 0 if there are no counters at all, as in most VMs.*/
+static int counters_open(void)
+{
+	struct perf_event_attr attr;
+	int i;
+	
+	for(i = 0; i < COUNTERS; i++)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = counter_events[i].type;
+		attr.config = counter_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		
+		counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, counter_leader, 0);
+		if(counter_leader < 0)
+			counter_leader = counter_fds[i];
+	}
+	return counter_leader >= 0;
+}
+
+
+//Reads every counter, leaving 0 for the missing ones
+static int counters_read(uint64_t *values)
+{
+	uint64_t group[1 + COUNTERS];
+	int i, member = 1;
+	
+	if(read(counter_leader, group, sizeof(group)) < (ssize_t)sizeof(uint64_t))
+		return 0;
+	
+	for(i = 0; i < COUNTERS; i++)
+		values[i] = counter_fds[i] >= 0 ? group[member++] : 0;
+	return 1;
+}
+
+
+static void counters_close(void)
+{
+	int i;
+	
+	for(i = 0; i < COUNTERS; i++)
+		if(counter_fds[i] >= 0)
+			close(counter_fds[i]);
+	counter_leader = -1;
+}
+
+
+#ifdef MY_MALLOC_LATENCY
+#define COUNTED_PATHS		LATENCY_PATHS
+static const char* const counted_names[COUNTED_PATHS] = {
+	"exact", "split", "grow", "insert", "merge left", "merge right", "merge both", "deferred", "in place", "copy", "aligned"
+};
+#else
+#define COUNTED_PATHS		3
+static const char* const counted_names[COUNTED_PATHS] = {"malloc", "realloc", "free"};
+#endif
+
+static uint64_t counted_calls[COUNTED_PATHS], counted[COUNTED_PATHS][COUNTERS];
+
+
+/*Runs the churn 1-4096 workload with the counters read around every call, adding the difference to the path the call
+took. What two reads in a row cost is measured first, and subtracted from every call.*/
+static void bench_counters(int policy)
+{
+	uint64_t before[COUNTERS], after[COUNTERS];
+	double overhead[COUNTERS] = {0};
+	size_t i, slot, size;
+	int call, path, event;
+	void *p;
+	
+	if(!counters_open())
+	{
+		printf("hardware counters n/a\n");
+		return;
+	}
+	
+	for(i = 0; i < COUNTER_CALIBRATIONS; i++)
+	{
+		counters_read(before);
+		counters_read(after);
+		for(event = 0; event < COUNTERS; event++)
+			overhead[event] += (double)(after[event] - before[event]) / COUNTER_CALIBRATIONS;
+	}
+	
+	init_malloc(heap, heap + HEAP_SIZE);
+	my_mallopt(M_PLACEMENT, policies[policy].policy);
+	my_mallopt(M_BEST_FIT_TOLERANCE, policies[policy].tolerance);
+	memset(slots, 0, sizeof(slots));
+	memset(counted_calls, 0, sizeof(counted_calls));
+	memset(counted, 0, sizeof(counted));
+	rng_state = 88172645463325252ULL;
+	
+	for(i = 0; i < COUNTED_OPERATIONS; i++)
+	{
+		//Everything but the call itself is done outside of the reads
+		slot = rng() % SLOTS;
+		call = !slots[slot] ? 0 : rng() % 4 == 0 ? 1 : 2;
+		size = rng() % 4096 + 1;
+		
+		counters_read(before);
+		if(call == 0)
+			slots[slot] = my_malloc(size);
+		else if(call == 1)
+		{
+			if((p = my_realloc(slots[slot], size)) != NULL)
+				slots[slot] = p;
+		}
+		else
+		{
+			my_free(slots[slot]);
+			slots[slot] = NULL;
+		}
+		counters_read(after);
+		
+		#ifdef MY_MALLOC_LATENCY
+		if((path = malloc_latency_last_path()) < 0)
+			continue;
+		#else
+		path = call;
+		#endif
+		
+		counted_calls[path]++;
+		for(event = 0; event < COUNTERS; event++)
+			counted[path][event] += after[event] - before[event];
+	}
+	counters_close();
+	
+	printf("%-12s %10s", policies[policy].name, "calls");
+	for(event = 0; event < COUNTERS; event++)
+		printf(" %10s", counter_events[event].name);
+	printf("\n");
+	
+	for(path = 0; path < COUNTED_PATHS; path++)
+	{
+		if(!counted_calls[path])
+			continue;
+		
+		printf("%-12s %10llu", counted_names[path], (unsigned long long)counted_calls[path]);
+		for(event = 0; event < COUNTERS; event++)
+		{
+			double per_call = (double)counted[path][event] / counted_calls[path] - overhead[event];
+			
+			if(counter_fds[event] < 0)
+				printf(" %10s", "n/a");
+			else
+				printf(" %10.1f", per_call > 0 ? per_call : 0);
+		}
+		printf("\n");
+	}
+}
+
+#endif
+
+
+#ifdef MY_MALLOC_OS_HEAP
+
+#define PAGES_HEAP_SIZE		(1UL << 30)
+#define PAGES_BLOCKS		(256 << 10)
+#define PAGES_OPERATIONS	500
+
+static void *blocks[PAGES_BLOCKS];
+
+
+/*Spreads a long freelist over a large heap, then runs best fit searches through it, touching every block handed out.
+This is mostly pointer chasing from one header to the next, so it is bound by TLB misses with small pages.*/
+static void bench_pages(const char* name, int pages)
+{
+	unsigned char *region = init_malloc_os(PAGES_HEAP_SIZE, pages);
+	double start, elapsed;
+	uint64_t before[COUNTERS], after[COUNTERS];
+	int counted = counters_open() && counter_fds[COUNTER_DTLB] >= 0;
+	size_t i, slot;
+	
+	if(!region)
+		return;
+	rng_state = 88172645463325252ULL;
+	
+	for(i = 0; i < PAGES_BLOCKS; i++)
+		memset(blocks[i] = my_malloc(rng() % 2048 + 16), 0, 16);
+	//Freed from the top down, so each piece goes to the head of the address ordered freelist
+	for(i = PAGES_BLOCKS; i > 0; i -= 2)
+	{
+		my_free(blocks[i - 2]);
+		blocks[i - 2] = NULL;
+	}
+	
+	counted = counted && counters_read(before);
+	
+	start = now_ns();
+	for(i = 0; i < PAGES_OPERATIONS; i++)
+	{
+		slot = rng() % PAGES_BLOCKS;
+		
+		if(blocks[slot])
+		{
+			my_free(blocks[slot]);
+			blocks[slot] = NULL;
+		}
+		else if((blocks[slot] = my_malloc(rng() % 4096 + 1)) != NULL)
+			memset(blocks[slot], 0, 64);
+	}
+	elapsed = now_ns() - start;
+	
+	counted = counted && counters_read(after);
+	counters_close();
+	
+	printf("%-14s %10.1f ns/op   ", name, elapsed / PAGES_OPERATIONS);
+	if(counted)
+		printf("dTLB misses %8.1f /op\n", (double)(after[COUNTER_DTLB] - before[COUNTER_DTLB]) / PAGES_OPERATIONS);
+	else
+		printf("dTLB misses n/a\n");
+	
+	munmap(region, PAGES_HEAP_SIZE);
+}
+
+#endif
+
+
+int main()
+{
+	size_t policy;
+	
+	for(policy = 0; policy < sizeof(policies) / sizeof(policies[0]); policy++)
+		bench_churn("churn 1-64", 64, 0, policy);
+	for(policy = 0; policy < sizeof(policies) / sizeof(policies[0]); policy++)
+		bench_churn("churn 1-512", 512, 0, policy);
+	for(policy = 0; policy < sizeof(policies) / sizeof(policies[0]); policy++)
+		bench_churn("churn 1-4096", 4096, 0, policy);
+	for(policy = 0; policy < sizeof(policies) / sizeof(policies[0]); policy++)
+		bench_churn("reuse 1-128", 128, 1, policy);
+	
+	#ifdef MY_MALLOC_LATENCY
+	//The latency of each path in the last run, with the timing itself included in every call
+	malloc_latency_reset();
+	bench_churn("churn 1-4096", 4096, 0, 0);
+	malloc_latency_print(stdout);
+	#endif
+	
+	#ifdef __linux__
+	bench_counters(0);
+	#endif
+	
+	bench_tail("tail, trimmed at once", 0, 1);
+	bench_tail("tail, trim 64K, grow 16K", 64 << 10, 16 << 10);
+	
+	#ifdef MY_MALLOC_OS_HEAP
+	bench_pages("small pages", HEAP_PAGES_SMALL);
+	bench_pages("transparent", HEAP_PAGES_TRANSPARENT);
+	bench_pages("hugetlbfs", HEAP_PAGES_HUGETLB);
+	#endif
+
+	return 0;
+}
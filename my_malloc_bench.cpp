@@ -0,0 +1,106 @@
+/*
+Standard containers on the heap through my_malloc.hpp, against the default allocator. Build it with
+
+	gcc -O2 -DMY_MALLOC_QUIET -c my_malloc.c
+	g++ -std=c++17 -O2 -DMY_MALLOC_QUIET my_malloc_bench.cpp my_malloc.o -o my_malloc_bench_cpp
+
+Each workload runs once with std::allocator (or the default memory resource for the pmr containers), and once on a heap.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include "my_malloc.hpp"
+
+
+#define HEAP_SIZE		(256 << 20)
+#define ROUNDS			200
+#define ELEMENTS		20000
+
+static unsigned char memory[HEAP_SIZE];
+
+
+
+static double now_ns()
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+//Grows a vector one element at a time, so it keeps reallocating
+template <class Vector>
+static double bench_vector(Vector make())
+{
+	double start = now_ns();
+
+	for(int round = 0; round < ROUNDS; round++)
+	{
+		Vector v = make();
+
+		for(int i = 0; i < ELEMENTS; i++)
+			v.push_back(i);
+	}
+
+	return (now_ns() - start) / ((double)ROUNDS * ELEMENTS);
+}
+
+
+//Inserts keys and erases half of them again, one node allocation per insert
+template <class Map>
+static double bench_map(Map make())
+{
+	double start = now_ns();
+
+	for(int round = 0; round < ROUNDS / 10; round++)
+	{
+		Map m = make();
+
+		for(int i = 0; i < ELEMENTS; i++)
+		{
+			m[i * 7919] = i;
+			if(i % 2)
+				m.erase((i - 1) * 7919);
+		}
+	}
+
+	return (now_ns() - start) / ((double)ROUNDS / 10 * ELEMENTS);
+}
+
+
+static void report(const char* name, double def, double mine)
+{
+	printf("%-22s default %7.1f ns/op   my_malloc %7.1f ns/op\n", name, def, mine);
+}
+
+
+typedef std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, MyAllocator<std::pair<const int, int>>> My_Map;
+
+static MyHeap *bench_heap;
+
+
+int main()
+{
+	MyHeap heap(memory, memory + HEAP_SIZE);
+
+	bench_heap = &heap;
+
+	report("vector<int>",
+		bench_vector<std::vector<int>>([] { return std::vector<int>(); }),
+		bench_vector<std::vector<int, MyAllocator<int>>>([] { return std::vector<int, MyAllocator<int>>(MyAllocator<int>(*bench_heap)); }));
+
+	report("unordered_map<int,int>",
+		bench_map<std::unordered_map<int, int>>([] { return std::unordered_map<int, int>(); }),
+		bench_map<My_Map>([] { return My_Map(0, std::hash<int>(), std::equal_to<int>(), My_Map::allocator_type(*bench_heap)); }));
+
+	report("pmr::vector<int>",
+		bench_vector<std::pmr::vector<int>>([] { return std::pmr::vector<int>(std::pmr::new_delete_resource()); }),
+		bench_vector<std::pmr::vector<int>>([] { return std::pmr::vector<int>(bench_heap); }));
+
+	report("pmr::unordered_map",
+		bench_map<std::pmr::unordered_map<int, int>>([] { return std::pmr::unordered_map<int, int>(std::pmr::new_delete_resource()); }),
+		bench_map<std::pmr::unordered_map<int, int>>([] { return std::pmr::unordered_map<int, int>(bench_heap); }));
+
+	return 0;
+}
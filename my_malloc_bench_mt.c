@@ -0,0 +1,492 @@
+/*
+Multithreaded scalability benchmarks, after the usual allocator stress tests. Linux only. Build it with the debug prints
+compiled out, once with the heap behind a global lock and once with the per-CPU caches:
+
+	gcc -O2 -DMY_MALLOC_QUIET my_malloc.c my_malloc_bench_mt.c -o my_malloc_bench_mt -pthread
+	gcc -O2 -DMY_MALLOC_QUIET -DMY_MALLOC_PERCPU my_malloc.c my_malloc_bench_mt.c -o my_malloc_bench_mt_percpu -pthread
+
+and run it as "my_malloc_bench_mt [max threads]" (twice the number of CPUs by default). Every workload runs with 1, 2, 4, ...
+threads on glibc's malloc and on the heap, each run in a child process of its own so that its peak RSS can be reported.
+
+	larson			Server-like churn: threads replace random blocks, then hand their blocks on to the next thread
+	threadtest		Each thread allocates a batch of blocks and frees them again
+	xmalloc			Each thread allocates blocks for its neighbour, and frees the blocks its other neighbour made
+	cache-scratch	Passive false sharing: each thread starts by freeing a block allocated next to the others' by main
+	cache-thrash	Active false sharing: each thread allocates, writes and frees small blocks of its own
+	mstress			Mixed sizes with realloc, some blocks passed between threads through a shared array
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "my_malloc.h"
+
+
+#define HEAP_SIZE				(1UL << 30)
+#define MAX_THREADS				64
+
+#define LARSON_SLOTS			1000
+#define LARSON_ROUNDS			20
+#define LARSON_OPERATIONS		10000
+
+#define THREADTEST_BLOCKS		1000
+#define THREADTEST_ROUNDS		200
+
+#define XMALLOC_BLOCKS			200000
+#define XMALLOC_RING			1024
+
+#define SCRATCH_ROUNDS			200000
+#define SCRATCH_WRITES			50
+
+#define MSTRESS_SLOTS			1000
+#define MSTRESS_OPERATIONS		200000
+#define MSTRESS_TRANSFER		256
+
+
+
+/************************************************************************/
+/*							ALLOCATORS		  							*/
+/************************************************************************/
+
+typedef struct {
+
+	const char* name;
+	void* (*malloc)(size_t len);
+	void* (*realloc)(void* p, size_t len);
+	void (*free)(void* p);
+	int heap;								//Needs a heap from init_malloc()
+
+}Allocator;
+
+
+#ifdef MY_MALLOC_PERCPU
+
+//The heap is thread safe, with per-CPU caches in front of its own lock
+
+static const Allocator heap_allocator = {"my_malloc percpu", my_malloc, my_realloc, my_free, 1};
+
+#else
+
+//Without per-CPU caches, the baseline is the heap behind one global lock
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* locked_malloc(size_t len)
+{
+	void *p;
+
+	pthread_mutex_lock(&global_lock);
+	p = my_malloc(len);
+	pthread_mutex_unlock(&global_lock);
+	return p;
+}
+
+static void* locked_realloc(void* p, size_t len)
+{
+	pthread_mutex_lock(&global_lock);
+	p = my_realloc(p, len);
+	pthread_mutex_unlock(&global_lock);
+	return p;
+}
+
+static void locked_free(void* p)
+{
+	pthread_mutex_lock(&global_lock);
+	my_free(p);
+	pthread_mutex_unlock(&global_lock);
+}
+
+static const Allocator heap_allocator = {"my_malloc+lock", locked_malloc, locked_realloc, locked_free, 1};
+
+#endif
+
+static const Allocator glibc_allocator = {"glibc", malloc, realloc, free, 0};
+
+static const Allocator *allocators[] = {&glibc_allocator, &heap_allocator};
+static const Allocator *alloc;
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							WORKLOADS		  							*/
+/************************************************************************/
+
+typedef struct {
+
+	int id;
+	uint64_t rng;
+	size_t operations;
+
+}Worker;
+
+static int threads;
+static pthread_barrier_t barrier;
+
+
+static inline uint64_t rng(Worker *w)					//xorshift64
+{
+	w->rng ^= w->rng << 13;
+	w->rng ^= w->rng >> 7;
+	w->rng ^= w->rng << 17;
+	return w->rng;
+}
+
+
+static inline void* alloc_touch(size_t len)
+{
+	char *p = alloc->malloc(len);
+
+	if(!p)
+	{
+		fprintf(stderr, "%s ran out of memory\n", alloc->name);
+		exit(1);
+	}
+	p[0] = p[len - 1] = 1;
+	return p;
+}
+
+
+
+static void **larson_slots[MAX_THREADS];
+
+static void* larson(void* arg)
+{
+	Worker *w = arg;
+	void **slots = calloc(LARSON_SLOTS, sizeof(void*));
+	size_t i, round, slot;
+
+	for(i = 0; i < LARSON_SLOTS; i++)
+		slots[i] = alloc_touch(rng(w) % 500 + 10);
+
+	for(round = 0; round < LARSON_ROUNDS; round++)
+	{
+		for(i = 0; i < LARSON_OPERATIONS; i++)
+		{
+			slot = rng(w) % LARSON_SLOTS;
+			alloc->free(slots[slot]);
+			slots[slot] = alloc_touch(rng(w) % 500 + 10);
+		}
+		w->operations += 2 * LARSON_OPERATIONS;
+
+		//Like the threads of a server exiting and being replaced, the next thread frees what this one allocated
+		larson_slots[w->id] = slots;
+		pthread_barrier_wait(&barrier);
+		slots = larson_slots[(w->id + 1) % threads];
+		pthread_barrier_wait(&barrier);
+	}
+
+	for(i = 0; i < LARSON_SLOTS; i++)
+		alloc->free(slots[i]);
+	free(slots);
+	return NULL;
+}
+
+
+
+static void* threadtest(void* arg)
+{
+	Worker *w = arg;
+	void *blocks[THREADTEST_BLOCKS];
+	size_t i, round;
+
+	for(round = 0; round < THREADTEST_ROUNDS; round++)
+	{
+		for(i = 0; i < THREADTEST_BLOCKS; i++)
+			blocks[i] = alloc_touch(64);
+		for(i = 0; i < THREADTEST_BLOCKS; i++)
+			alloc->free(blocks[i]);
+	}
+
+	w->operations = 2 * THREADTEST_ROUNDS * THREADTEST_BLOCKS;
+	return NULL;
+}
+
+
+
+//Single producer, single consumer ring of blocks, one per thread
+typedef struct {
+
+	_Atomic size_t head;
+	char pad1[64];
+	_Atomic size_t tail;
+	char pad2[64];
+	void *blocks[XMALLOC_RING];
+
+}Ring;
+
+static Ring rings[MAX_THREADS];
+
+static void* xmalloc(void* arg)
+{
+	Worker *w = arg;
+	Ring *out = &rings[w->id], *in = &rings[(w->id + threads - 1) % threads];
+	size_t produced = 0, consumed = 0, head, tail;
+	int progress;
+
+	while(produced < XMALLOC_BLOCKS || consumed < XMALLOC_BLOCKS)
+	{
+		progress = 0;
+
+		tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+		if(produced < XMALLOC_BLOCKS && tail - atomic_load_explicit(&out->head, memory_order_acquire) < XMALLOC_RING)
+		{
+			out->blocks[tail % XMALLOC_RING] = alloc_touch(rng(w) % 240 + 16);
+			atomic_store_explicit(&out->tail, tail + 1, memory_order_release);
+			produced++;
+			progress = 1;
+		}
+
+		head = atomic_load_explicit(&in->head, memory_order_relaxed);
+		if(consumed < XMALLOC_BLOCKS && head != atomic_load_explicit(&in->tail, memory_order_acquire))
+		{
+			alloc->free(in->blocks[head % XMALLOC_RING]);
+			atomic_store_explicit(&in->head, head + 1, memory_order_release);
+			consumed++;
+			progress = 1;
+		}
+
+		if(!progress)
+			sched_yield();
+	}
+
+	w->operations = produced + consumed;
+	return NULL;
+}
+
+
+
+static char *scratch_blocks[MAX_THREADS];
+static int scratch_passive;
+
+static void* cache_scratch(void* arg)
+{
+	Worker *w = arg;
+	volatile char *p;
+	size_t round, i;
+
+	//The block handed over shares a cache line with the other threads' blocks
+	if(scratch_passive)
+		alloc->free(scratch_blocks[w->id]);
+
+	for(round = 0; round < SCRATCH_ROUNDS; round++)
+	{
+		p = alloc_touch(8);
+		for(i = 0; i < SCRATCH_WRITES; i++)
+			p[i % 8]++;
+		alloc->free((void*)p);
+	}
+
+	w->operations = 2 * SCRATCH_ROUNDS;
+	return NULL;
+}
+
+
+
+static _Atomic(void*) mstress_transfer[MSTRESS_TRANSFER];
+
+//Mostly small blocks, some of a few KB, and rarely up to 256KB
+static size_t mstress_size(Worker *w)
+{
+	uint64_t r = rng(w);
+
+	if(r % 256 == 0)
+		return (r >> 8) % (256 << 10) + (16 << 10);
+	if(r % 16 == 0)
+		return (r >> 8) % 4096 + 256;
+	return (r >> 8) % 120 + 8;
+}
+
+static void* mstress(void* arg)
+{
+	Worker *w = arg;
+	void *slots[MSTRESS_SLOTS] = {NULL}, *p;
+	size_t i, slot, len;
+	uint64_t r;
+
+	for(i = 0; i < MSTRESS_OPERATIONS; i++)
+	{
+		slot = rng(w) % MSTRESS_SLOTS;
+		r = rng(w);
+
+		if(!slots[slot])
+			slots[slot] = alloc_touch(mstress_size(w));
+		else if(r % 8 == 0)
+		{
+			//Pass the block to whichever thread picks this transfer slot next, and free what was there
+			p = atomic_exchange(&mstress_transfer[(r >> 3) % MSTRESS_TRANSFER], slots[slot]);
+			slots[slot] = NULL;
+			if(p)
+				alloc->free(p);
+		}
+		else if(r % 4 == 1)
+		{
+			len = mstress_size(w);
+			if((p = alloc->realloc(slots[slot], len)) != NULL)
+			{
+				((char*)p)[len - 1] = 1;
+				slots[slot] = p;
+			}
+		}
+		else
+		{
+			alloc->free(slots[slot]);
+			slots[slot] = NULL;
+		}
+	}
+
+	for(slot = 0; slot < MSTRESS_SLOTS; slot++)
+		if(slots[slot])
+			alloc->free(slots[slot]);
+
+	w->operations = MSTRESS_OPERATIONS;
+	return NULL;
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*							RUNNING			  							*/
+/************************************************************************/
+
+static const struct {
+
+	const char* name;
+	void* (*run)(void*);
+
+}workloads[] = {
+	{"larson", 			larson},
+	{"threadtest", 		threadtest},
+	{"xmalloc", 		xmalloc},
+	{"cache-scratch", 	cache_scratch},
+	{"cache-thrash", 	cache_scratch},
+	{"mstress", 		mstress},
+};
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+//Runs one workload in this process and returns its throughput in millions of operations per second
+static double run_workload(int workload)
+{
+	pthread_t tids[MAX_THREADS];
+	Worker workers[MAX_THREADS];
+	size_t operations = 0;
+	double start;
+	int t;
+
+	pthread_barrier_init(&barrier, NULL, threads);
+	scratch_passive = !strcmp(workloads[workload].name, "cache-scratch");
+	for(t = 0; t < threads; t++)
+	{
+		workers[t].id = t;
+		workers[t].rng = 88172645463325252ULL + t * 0x9E3779B97F4A7C15ULL;
+		workers[t].operations = 0;
+		if(scratch_passive)
+			scratch_blocks[t] = alloc_touch(8);
+	}
+
+	start = now_ns();
+	for(t = 0; t < threads; t++)
+		pthread_create(&tids[t], NULL, workloads[workload].run, &workers[t]);
+	for(t = 0; t < threads; t++)
+	{
+		pthread_join(tids[t], NULL);
+		operations += workers[t].operations;
+	}
+
+	return operations / (now_ns() - start) * 1e3;
+}
+
+
+//Forks a child for the run, so that its peak RSS is its own
+static void run(int workload, const Allocator *allocator)
+{
+	struct rusage usage;
+	double mops = 0;
+	int fds[2], status;
+	pid_t pid;
+	unsigned char *region;
+
+	if(pipe(fds))
+		return;
+
+	fflush(stdout);
+	if((pid = fork()) == 0)
+	{
+		alloc = allocator;
+		if(alloc->heap)
+		{
+			region = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if(region == MAP_FAILED || !init_malloc(region, region + HEAP_SIZE))
+				_exit(1);
+		}
+
+		mops = run_workload(workload);
+		if(write(fds[1], &mops, sizeof(mops)) != sizeof(mops))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if(pid < 0 || read(fds[0], &mops, sizeof(mops)) != sizeof(mops))
+		mops = 0;
+	close(fds[0]);
+
+	if(pid < 0 || wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+	{
+		printf("%-14s %-17s %3d threads   failed\n", workloads[workload].name, allocator->name, threads);
+		return;
+	}
+
+	printf("%-14s %-17s %3d threads   %8.2f Mops/s   peak RSS %8ld KB\n", workloads[workload].name, allocator->name, threads, mops, usage.ru_maxrss);
+}
+
+
+int main(int argc, char** argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	size_t workload, a;
+
+	if(max_threads < 1)
+		max_threads = 1;
+	if(max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+
+	for(workload = 0; workload < sizeof(workloads) / sizeof(workloads[0]); workload++)
+	{
+		for(threads = 1; threads <= max_threads; threads = threads < max_threads && threads * 2 > max_threads ? max_threads : threads * 2)
+			for(a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+				run(workload, allocators[a]);
+		printf("\n");
+	}
+
+	return 0;
+}
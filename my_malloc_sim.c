@@ -0,0 +1,446 @@
+/*
+Long running fragmentation simulator. It drives a heap of a fixed size through a long allocation churn as fast as it can,
+and records how the heap holds up over time, to predict when a long running program would run out of room. Build it
+against the dynamic heap, or against the dynamic stack in dyn_stack:
+
+	gcc -O2 -DMY_MALLOC_QUIET my_malloc.c my_malloc_sim.c -o my_malloc_sim
+	gcc -O2 -DMY_MALLOC_QUIET -DSIM_DYN_STACK dyn_stack/my_malloc.c my_malloc_sim.c -o my_malloc_sim_stack
+
+and run it as
+
+	my_malloc_sim [-n operations] [-s samples] [-H heap bytes] [-l live slots] [-f max failures] [-w churn|mixed] [-t trace]
+
+Counts take exponents, e.g. -n 1e9. The dynamic heap build runs the workload once per placement policy; the dynamic stack
+has only one. Every run starts from the same seed, so both builds see the same requests. Each sample is printed as a CSV
+line of
+
+	run, operations, heap span, free bytes, free pieces, largest free piece, failed allocations
+
+and each run ends with a summary line starting with '#'. The heap reports every failed allocation on stderr, so a run
+stops once max failures (100 by default) is reached.
+
+	churn		Random malloc/realloc/free of 1 to 4096 bytes over the live slots, as in my_malloc_bench.c
+	mixed		Sizes spread log-uniformly from 16 bytes to 64KB. An eighth of the slots hold long lived blocks, which are
+				replaced 256 times less often and pin down the free space around them
+	trace		Replays a text file of requests, looping over it until the operation count is reached:
+					a <id> <size>		allocate
+					r <id> <size>		realloc
+					f <id>				free
+				Ids index the live slots. Allocating an id that is still live frees its old block first.
+*/
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef SIM_DYN_STACK
+#include "dyn_stack/my_malloc.h"
+#else
+#include "my_malloc.h"
+#endif
+
+
+#define DEFAULT_HEAP_SIZE		(16 << 20)
+#define DEFAULT_SLOTS			4096
+#define DEFAULT_OPERATIONS		1000000ULL
+#define DEFAULT_SAMPLES			20
+#define DEFAULT_MAX_FAILURES	100
+
+#define WORKLOAD_CHURN			0
+#define WORKLOAD_MIXED			1
+#define WORKLOAD_TRACE			2
+
+static unsigned char *heap;
+static size_t heap_size = DEFAULT_HEAP_SIZE;
+static void **slots;
+static size_t live_slots = DEFAULT_SLOTS;
+static uint64_t rng_state = 88172645463325252ULL;
+
+
+
+static const struct {
+
+	const char* name;
+	int policy;
+	size_t tolerance;
+
+}runs[] = {
+	#ifdef SIM_DYN_STACK
+	{"dyn stack", 		0, 						0},
+	#else
+	{"best fit", 		PLACEMENT_BEST_FIT, 	0},
+	{"best fit +64", 	PLACEMENT_BEST_FIT, 	64},
+	{"first fit", 		PLACEMENT_FIRST_FIT, 	0},
+	{"next fit", 		PLACEMENT_NEXT_FIT, 	0},
+	#endif
+};
+
+
+typedef struct {
+
+	char op;
+	size_t id;
+	size_t size;
+
+}Trace_Op;
+
+static Trace_Op *trace;
+static size_t trace_len, trace_pos, trace_ids;
+
+
+
+static inline uint64_t rng(void)					//xorshift64, cheap enough to not skew the timings
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+
+/************************************************************************/
+/*							HEAP SAMPLES		 						*/
+/************************************************************************/
+
+static size_t free_bytes, free_pieces, largest_free;
+
+#ifdef SIM_DYN_STACK
+
+//The dynamic stack has no heap_walk(), but its freelist can be followed from the saved parameters
+static void count_free(void)
+{
+	Malloc_Param param = save_malloc_param();
+	Heap_Seg *piece;
+
+	free_bytes = free_pieces = largest_free = 0;
+	for(piece = param.freelist_head; piece; piece = piece->next)
+	{
+		free_bytes += piece->size;
+		free_pieces++;
+		if(piece->size > largest_free)
+			largest_free = piece->size;
+	}
+}
+
+
+static size_t heap_span(void)						//The stack grows down from the heap start
+{
+	Malloc_Param param = save_malloc_param();
+
+	return param.malloc_heap_start - param.malloc_break;
+}
+
+#else
+
+static int count_free_piece(void* p, size_t size, int is_free, void* arg)
+{
+	if(is_free)
+	{
+		free_bytes += size;
+		free_pieces++;
+		if(size > largest_free)
+			largest_free = size;
+	}
+	return 0;
+}
+
+
+static void count_free(void)
+{
+	free_bytes = free_pieces = largest_free = 0;
+	heap_walk(count_free_piece, NULL);
+}
+
+
+static size_t heap_span(void)
+{
+	Malloc_Param param = save_malloc_param();
+
+	return param.malloc_break - param.malloc_heap_start;
+}
+
+#endif
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*								WORKLOADS		 						*/
+/************************************************************************/
+
+//Each of these returns 0 if an allocation failed
+static int slot_free(size_t slot)
+{
+	my_free(slots[slot]);
+	slots[slot] = NULL;
+	return 1;
+}
+
+static int slot_malloc(size_t slot, size_t size)
+{
+	if(slots[slot])
+		my_free(slots[slot]);
+	slots[slot] = my_malloc(size);
+	return slots[slot] != NULL;
+}
+
+static int slot_realloc(size_t slot, size_t size)
+{
+	void *p = my_realloc(slots[slot], size);
+
+	if(!p)
+		return 0;
+	slots[slot] = p;
+	return 1;
+}
+
+
+static int step_churn(void)
+{
+	size_t slot = rng() % live_slots;
+
+	if(!slots[slot])
+		return slot_malloc(slot, rng() % 4096 + 1);
+	if(rng() % 4 == 0)
+		return slot_realloc(slot, rng() % 4096 + 1);
+	return slot_free(slot);
+}
+
+
+static inline size_t mixed_size(void)
+{
+	size_t base = (size_t)16 << (rng() % 12);
+
+	return base + rng() % base;
+}
+
+static int step_mixed(void)
+{
+	size_t long_lived = live_slots / 8;
+	size_t slot;
+
+	if(rng() % 256 == 0)
+		slot = rng() % long_lived;
+	else
+		slot = long_lived + rng() % (live_slots - long_lived);
+
+	if(!slots[slot])
+		return slot_malloc(slot, mixed_size());
+	if(slot >= long_lived && rng() % 8 == 0)
+		return slot_realloc(slot, mixed_size());
+	return slot_free(slot);
+}
+
+
+static int step_trace(void)
+{
+	Trace_Op *t = &trace[trace_pos];
+
+	if(++trace_pos == trace_len)
+		trace_pos = 0;
+
+	switch(t->op)
+	{
+		case 'a':
+			return slot_malloc(t->id, t->size);
+		case 'r':
+			return slots[t->id] ? slot_realloc(t->id, t->size) : slot_malloc(t->id, t->size);
+		default:
+			return slots[t->id] ? slot_free(t->id) : 1;
+	}
+}
+
+
+//Loads a whole trace into memory, so replaying it costs no I/O
+static int load_trace(const char* path)
+{
+	FILE *f = fopen(path, "r");
+	size_t capacity = 0, line = 0;
+	char buf[128];
+	Trace_Op t;
+
+	if(!f)
+	{
+		fprintf(stderr,"Cannot open the trace %s\n", path);
+		return 0;
+	}
+
+	while(fgets(buf, sizeof(buf), f))
+	{
+		line++;
+		t.size = 0;
+		if(buf[0] == '#' || buf[0] == '\n')
+			continue;
+		if(sscanf(buf, "%c %zu %zu", &t.op, &t.id, &t.size) < 2 || !strchr("arf", t.op) || (t.op != 'f' && !t.size))
+		{
+			fprintf(stderr,"%s:%zu: Cannot parse \"%.*s\"\n", path, line, (int)strcspn(buf, "\n"), buf);
+			fclose(f);
+			return 0;
+		}
+
+		if(trace_len == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 4096;
+			if(!(trace = realloc(trace, capacity * sizeof(Trace_Op))))
+			{
+				fclose(f);
+				return 0;
+			}
+		}
+		trace[trace_len++] = t;
+		if(t.id >= trace_ids)
+			trace_ids = t.id + 1;
+	}
+	fclose(f);
+
+	if(!trace_len)
+		fprintf(stderr,"The trace %s has no requests\n", path);
+	return trace_len != 0;
+}
+
+
+
+
+
+
+
+
+
+
+/************************************************************************/
+/*								SIMULATION		 						*/
+/************************************************************************/
+
+static void simulate(size_t run, int workload, unsigned long long operations, unsigned long long samples, unsigned long long max_failures)
+{
+	unsigned long long i, interval = operations / samples, next_sample, failed = 0, first_failure = 0;
+	size_t span, peak_span = 0;
+	double start, elapsed;
+	int ok;
+
+	if(!interval)
+		interval = 1;
+
+	#ifdef SIM_DYN_STACK
+	init_malloc(heap + heap_size, heap);
+	#else
+	init_malloc(heap, heap + heap_size);
+	my_mallopt(M_PLACEMENT, runs[run].policy);
+	my_mallopt(M_BEST_FIT_TOLERANCE, runs[run].tolerance);
+	#endif
+	memset(slots, 0, live_slots * sizeof(void*));
+	rng_state = 88172645463325252ULL;
+	trace_pos = 0;
+
+	start = now_ns();
+	for(i = 0, next_sample = interval; i < operations && failed < max_failures; )
+	{
+		if(workload == WORKLOAD_CHURN)
+			ok = step_churn();
+		else if(workload == WORKLOAD_MIXED)
+			ok = step_mixed();
+		else
+			ok = step_trace();
+		i++;
+
+		if(!ok && !failed++)
+			first_failure = i;
+
+		if(i == next_sample || i == operations || failed == max_failures)
+		{
+			count_free();
+			span = heap_span();
+			if(span > peak_span)
+				peak_span = span;
+			printf("%s,%llu,%zu,%zu,%zu,%zu,%llu\n", runs[run].name, i, span, free_bytes, free_pieces, largest_free, failed);
+			next_sample += interval;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	printf("# %-14s %llu operations in %.1f s, peak span %zu of %zu bytes, ", runs[run].name, i, elapsed / 1e9, peak_span, heap_size);
+	if(failed)
+		printf("first failure after %llu operations, %llu failed\n", first_failure, failed);
+	else
+		printf("no failures\n");
+	fflush(stdout);
+}
+
+
+static void usage(const char* name)
+{
+	fprintf(stderr,"Usage: %s [-n operations] [-s samples] [-H heap bytes] [-l live slots] [-f max failures] [-w churn|mixed] [-t trace]\n", name);
+	exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned long long operations = DEFAULT_OPERATIONS, samples = DEFAULT_SAMPLES, max_failures = DEFAULT_MAX_FAILURES;
+	int workload = WORKLOAD_CHURN, opt;
+	size_t run;
+
+	while((opt = getopt(argc, argv, "n:s:H:l:f:w:t:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'n':	operations = strtod(optarg, NULL);		break;
+			case 's':	samples = strtod(optarg, NULL);			break;
+			case 'H':	heap_size = strtod(optarg, NULL);		break;
+			case 'l':	live_slots = strtod(optarg, NULL);		break;
+			case 'f':	max_failures = strtod(optarg, NULL);	break;
+			case 'w':
+				if(!strcmp(optarg, "churn"))
+					workload = WORKLOAD_CHURN;
+				else if(!strcmp(optarg, "mixed"))
+					workload = WORKLOAD_MIXED;
+				else
+					usage(argv[0]);
+				break;
+			case 't':
+				if(!load_trace(optarg))
+					return 1;
+				workload = WORKLOAD_TRACE;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if(live_slots < trace_ids)
+		live_slots = trace_ids;
+	if(!operations || !samples || !max_failures || heap_size < 4096 || live_slots < 8)
+		usage(argv[0]);
+
+	heap = malloc(heap_size);
+	slots = malloc(live_slots * sizeof(void*));
+	if(!heap || !slots)
+	{
+		fprintf(stderr,"Cannot allocate a heap of %zu bytes\n", heap_size);
+		return 1;
+	}
+
+	printf("# run,operations,heap_span,free_bytes,free_pieces,largest_free,failed\n");
+	for(run = 0; run < sizeof(runs) / sizeof(runs[0]); run++)
+		simulate(run, workload, operations, samples, max_failures);
+
+	free(slots);
+	free(heap);
+	free(trace);
+	return 0;
+}
@@ -444,6 +444,29 @@ void test_realloc()
 
 	
 
+	//Testing growth into both adjacent pieces at once
+	printf("\n****************************************\n");
+	printf("\t\tGROWTH INTO BOTH NEIGHBOURS\n");
+	printf("****************************************\n\n");
+	
+	str[5] = malloc_dbg(30);
+	str[6] = malloc_dbg(30);
+	str[7] = malloc_dbg(30);
+	str[8] = malloc_dbg(30);
+	str[9] = malloc_dbg(30);
+	sprintf(str[7], "Both neighbours!");
+	free_dbg(str[6]);
+	free_dbg(str[8]);
+	
+	printf("Expanding piece from (30) to (%zu)\n", 80+sizeof(Heap_Seg));
+	str[7] = realloc_dbg(str[7], 80+sizeof(Heap_Seg));
+	printf("%s\n\n", str[7]);
+	free_dbg(str[5]);
+	free_dbg(str[7]);
+	free_dbg(str[9]);
+	
+	
+
 	//Testing growth, but new allocation piece is needed
 	printf("\n****************************************\n");
 	printf("\t\tGROWTH WITH NEW PIECE\n");
@@ -468,6 +491,1132 @@ void test_realloc()
 }
 
 
+
+int print_segment(void* p, size_t size, int is_free, void* arg)
+{
+	printf("%s segment at %p, size %zu\n", is_free ? "Free" : "Allocated", p, size);
+	return 0;
+}
+
+
+//Steps through the heap with a malloc and a free between every two steps, as a check running alongside a program would
+static void test_heap_check_traffic()
+{
+	static char memory[1 << 16];
+	char *blocks[256];
+	Heap_Check_State state = {0};
+	unsigned int seed = 1, slot;
+	int i, result, passes = 0, corrupt = 0;
+	
+	init_malloc(&memory[0], &memory[sizeof(memory) - 1]);
+	
+	for(i = 0; i < 256; i++)
+		blocks[i] = malloc_dbg(16 + i % 64);
+	for(i = 0; i < 256; i += 3)
+	{
+		free_dbg(blocks[i]);
+		blocks[i] = NULL;
+	}
+	
+	printf("\n***Checking the heap 8 segments at a time, with a malloc and a free between the steps***\n");
+	for(i = 0; i < 2000; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		slot = (seed >> 16) % 256;
+		free_dbg(blocks[slot]);
+		blocks[slot] = malloc_dbg(8 + (seed >> 8) % 120);
+		
+		result = heap_check_step(&state, 8);
+		passes += result == HEAP_CHECK_DONE;
+		corrupt += result == HEAP_CHECK_CORRUPT;
+	}
+	printf("%d passes completed in 2000 steps, %s\n", passes, passes && !corrupt ? "none found corruption" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+}
+
+void test_heap_check()
+{
+	char memory[4096];
+	char *str[10];
+	Heap_Check_State state = {0};
+	int i, result, steps = 0;
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	
+	for(i = 0; i < 8; i++)
+		str[i] = malloc_dbg(16 + i * 8);
+	
+	free_dbg(str[1]);
+	free_dbg(str[4]);
+	free_dbg(str[5]);
+	
+	printf("\n***Walking the heap***\n");
+	printf("Heap check: %s\n\n", heap_walk(print_segment, NULL) ? "passed" : "FAILED");
+	
+	printf("***Checking the heap 2 segments at a time***\n");
+	do
+	{
+		result = heap_check_step(&state, 2);
+		steps++;
+	}while(result == HEAP_CHECK_IN_PROGRESS);
+	printf("Incremental heap check: %s after %d steps\n\n", result == HEAP_CHECK_DONE ? "passed" : "FAILED", steps);
+	
+	printf("***Overrunning allocation 2 into the header of allocation 3***\n");
+	memset(str[2], 'x', 16 + 2 * 8 + 4);
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED (expected)");
+	
+	test_heap_check_traffic();
+}
+
+
+
+#include <sys/mman.h>
+
+//Growing by more than 2GB at once. Only the headers are ever written, so the pages of the region are never touched.
+static void test_expand_large()
+{
+	#if SIZE_MAX > 0xFFFFFFFFu
+	size_t heap_size = (size_t)5 << 30, size;
+	unsigned char *region = mmap(NULL, heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	char *str;
+	
+	if(region == MAP_FAILED)
+		return;
+	
+	init_malloc(region, region + heap_size);
+	str = malloc_dbg(17);
+	
+	printf("\n***Expanding at the break of a 5GB heap, as far as it goes***\n");
+	size = my_expand(str, 17, SIZE_MAX);
+	printf("Usable size %zu, %s\n", size, (unsigned char*)str + size == (unsigned char*)get_malloc_break() && size > ((size_t)4 << 30) ? "the break moved with it" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	
+	munmap(region, heap_size);
+	#endif
+}
+
+void test_expand()
+{
+	char memory[4096];
+	char *str[4];
+	size_t size;
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	
+	str[0] = malloc_dbg(32);
+	str[1] = malloc_dbg(32);
+	str[2] = malloc_dbg(32);
+	
+	//Per-CPU caches hand out a batch from the top down, so str[2] would be the lowest block
+	if(str[0] > str[2])
+	{
+		str[3] = str[0];
+		str[0] = str[2];
+		str[2] = str[3];
+	}
+	free_dbg(str[1]);
+	
+	printf("\n***Expanding into the adjacent free piece, between 40 and 200***\n");
+	size = my_expand(str[0], 40, 200);
+	printf("Usable size %zu, %s\n", size, size >= 40 ? "grown in place" : "FAILED");
+	
+	printf("\n***Expanding beyond what is available in place, at least 500***\n");
+	size = my_expand(str[0], 500, 500);
+	printf("Usable size %zu, %s\n", size, size < 500 ? "left untouched" : "FAILED");
+	
+	printf("\n***Expanding at the break, between 100 and 300***\n");
+	size = my_expand(str[2], 100, 300);
+	printf("Usable size %zu\n", size);
+	
+	printf("\n***Shrinking to at most 16***\n");
+	size = my_expand(str[2], 0, 16);
+	printf("Usable size %zu\n", size);
+	
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	
+	test_expand_large();
+}
+
+
+void test_memalign()
+{
+	char memory[4096];
+	char *str[3];
+	
+	//Starting the heap at an odd address, so that nothing is aligned by chance
+	init_malloc(&memory[1025], &memory[4095]);
+	
+	printf("\n***Allocating 100 bytes aligned to 64***\n");
+	str[0] = my_memalign(64, 100);
+	printf("%p, %s\n", str[0], str[0] && !((uintptr_t)str[0] % 64) ? "aligned" : "FAILED");
+	
+	printf("\n***Allocating 40 bytes aligned to 16, twice***\n");
+	str[1] = my_memalign(16, 40);
+	str[2] = my_memalign(16, 40);
+	printf("%p %p, %s\n", str[1], str[2], str[1] && str[2] && !((uintptr_t)str[1] % 16) && !((uintptr_t)str[2] % 16) ? "aligned" : "FAILED");
+	
+	printf("\n***Freeing with a larger size than allocated***\n");
+	my_free_sized(str[1], 200);
+	
+	printf("\n***Freeing with the allocated sizes***\n");
+	my_free_sized(str[0], 100);
+	my_free_sized(str[1], 40);
+	my_free_sized(str[2], 40);
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+}
+
+
+typedef struct {
+	
+	int initialized;
+	int table[4];
+	
+}Test_Object;
+
+static int objects_constructed, objects_destroyed;
+
+static void construct_object(void* obj)
+{
+	Test_Object *o = obj;
+	
+	o->initialized = 1;
+	o->table[0] = o->table[1] = o->table[2] = o->table[3] = 42;
+	objects_constructed++;
+}
+
+static void destroy_object(void* obj)
+{
+	objects_destroyed++;
+}
+
+void test_object_cache()
+{
+	char memory[4096];
+	Obj_Cache *cache;
+	Obj_Cache_Stats stats;
+	Malloc_Param param;
+	Test_Object *obj[3], *again;
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	cache = cache_create("test objects", sizeof(Test_Object), 8, construct_object, destroy_object);
+	
+	printf("\n***Allocating 3 objects***\n");
+	obj[0] = cache_alloc(cache);
+	obj[1] = cache_alloc(cache);
+	obj[2] = cache_alloc(cache);
+	printf("%d objects constructed, %s\n", objects_constructed, !((uintptr_t)obj[1] % 8) ? "aligned" : "FAILED");
+	
+	printf("\n***Freeing an object and allocating again***\n");
+	obj[1]->table[2] = 7;
+	cache_free(cache, obj[1]);
+	again = cache_alloc(cache);
+	printf("%s\n", again == obj[1] && again->table[2] == 7 && objects_constructed == 3 ? "The object was reused without constructing it again" : "FAILED");
+	
+	printf("\n***Freeing an object that is not from the cache***\n");
+	cache_free(cache, (char*)obj[0] + 1);
+	
+	printf("\n***Freeing an object twice***\n");
+	cache_free(cache, obj[2]);
+	cache_free(cache, obj[2]);
+	printf("%s\n", cache_stats(cache).in_use == 2 ? "The second free was refused" : "FAILED");
+	
+	stats = cache_stats(cache);
+	printf("Cache \"%s\": %zu slabs of %zu bytes, %zu of %zu objects in use, %zu allocs, %zu frees, %zu constructed, %zu reused\n", 
+		stats.name, stats.slabs, stats.slab_size, stats.in_use, stats.capacity, stats.allocs, stats.frees, stats.constructed, stats.reused);
+	
+	printf("\n***Destroying the cache***\n");
+	cache_free(cache, obj[0]);
+	cache_free(cache, obj[1]);
+	cache_destroy(cache);
+	param = save_malloc_param();
+	printf("%s\n", objects_destroyed == 3 && param.malloc_break == param.malloc_heap_start ? "Every object was destroyed and the heap is empty" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+}
+
+
+//With MY_MALLOC_PERCPU, small blocks are taken from the heap a batch at a time, and the tests on where the heap places 
+//blocks ask for sizes past the per-CPU classes instead
+#ifdef MY_MALLOC_PERCPU
+#define UNCACHED		(MY_MALLOC_PERCPU_MAX + 1)
+#else
+#define UNCACHED		0
+#endif
+
+void test_reserve()
+{
+	char memory[4096];
+	char *str[2];
+	void *reserved;
+	
+	#ifdef MY_MALLOC_FASTBINS
+	size_t counts[33] = {0};
+	#endif
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	
+	printf("\n***Reserving 1024 bytes and prefaulting them***\n");
+	printf("%zu bytes reserved\n", my_reserve(1024, 1));
+	reserved = get_malloc_break();
+	
+	printf("\n***Allocating and freeing within the reservation***\n");
+	str[0] = malloc_dbg(UNCACHED + 100);
+	str[1] = malloc_dbg(UNCACHED + 200);
+	free_dbg(str[1]);
+	free_dbg(str[0]);
+	printf("%s\n", get_malloc_break() == reserved ? "The break was kept" : "FAILED");
+	
+	#ifdef MY_MALLOC_FASTBINS
+	printf("\n***Splitting the reservation into blocks of 16 and 32 bytes***\n");
+	counts[16] = 4;
+	counts[32] = 2;
+	printf("%zu blocks binned\n", my_reserve_bins(counts, 32));
+	str[0] = malloc_dbg(32);
+	printf("%s\n", get_malloc_break() == reserved ? "The block came from its fastbin" : "FAILED");
+	free_dbg(str[0]);
+	#endif
+	
+	printf("\n***Trimming the heap***\n");
+	my_malloc_trim(0);
+	printf("%s\n", save_malloc_param().malloc_break == save_malloc_param().malloc_heap_start ? "The reservation was given back" : "FAILED");
+	
+	printf("\n***Prefaulting an empty reservation, with a block at the break***\n");
+	str[0] = malloc_dbg(UNCACHED + 100);
+	printf("%zu bytes reserved\n", my_reserve(0, 1));
+	free_dbg(str[0]);
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+}
+
+
+void test_placement()
+{
+	char memory[8192];
+	char *str[8];
+	int i;
+	
+	//Scales the pieces when they have to be larger than the per-CPU classes. B stays too small for two allocations.
+	const int scale = UNCACHED/16 + 1;
+	const int b_size = 16*scale + 48;
+	
+	const char* names[] = {"best fit", "first fit", "next fit"};
+	const int policies[] = {PLACEMENT_BEST_FIT, PLACEMENT_FIRST_FIT, PLACEMENT_NEXT_FIT};
+	
+	for(i = 0; i < 3; i++)
+	{
+		init_malloc(&memory[1024], &memory[8191]);
+		my_mallopt(M_PLACEMENT, policies[i]);
+		
+		//Leave free pieces A, B and C, separated by allocated ones
+		str[0] = malloc_dbg(96*scale);
+		str[1] = malloc_dbg(UNCACHED + 8);
+		str[2] = malloc_dbg(b_size);
+		str[3] = malloc_dbg(UNCACHED + 8);
+		str[4] = malloc_dbg(96*scale);
+		str[5] = malloc_dbg(UNCACHED + 8);
+		free_dbg(str[0]);
+		free_dbg(str[2]);
+		free_dbg(str[4]);
+		
+		printf("\n***Placement with %s, free pieces A (%d), B (%d) and C (%d)***\n", names[i], 96*scale, b_size, 96*scale);
+		str[6] = malloc_dbg(16*scale);
+		str[7] = malloc_dbg(16*scale);
+		printf("Two allocations of %d bytes were taken from pieces %c and %c\n", 16*scale, 
+			(char*)str[6] < str[1] ? 'A' : (char*)str[6] < str[3] ? 'B' : 'C',
+			(char*)str[7] < str[1] ? 'A' : (char*)str[7] < str[3] ? 'B' : 'C');
+	}
+	
+	my_mallopt(M_PLACEMENT, PLACEMENT_BEST_FIT);
+}
+
+
+void test_wilderness()
+{
+	char memory[4096];
+	char *str[4];
+	void *brk;
+	int i, moves = 0;
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	my_mallopt(M_TRIM_THRESHOLD, 512);
+	my_mallopt(M_GROW_CHUNK, 128 + 2*UNCACHED);
+	
+	//The tail is only trimmed once a freed block reaches the freelist, so the blocks must not be held in quarantine
+	#ifdef MY_MALLOC_QUARANTINE
+	my_mallopt(M_QUARANTINE_BYTES, 0);
+	#endif
+	
+	printf("\n***Growing the break in chunks of %d bytes***\n", 128 + 2*UNCACHED);
+	str[0] = malloc_dbg(UNCACHED + 20);
+	brk = get_malloc_break();
+	str[1] = malloc_dbg(UNCACHED + 20);
+	printf("%s\n", brk == get_malloc_break() ? "The second allocation came from the wilderness" : "FAILED");
+	
+	printf("\n***Freeing the tail below the trim threshold***\n");
+	free_dbg(str[1]);
+	printf("%s\n", brk == get_malloc_break() ? "The break was kept" : "FAILED");
+	
+	printf("\n***Freeing the tail beyond the trim threshold***\n");
+	str[2] = malloc_dbg(600);
+	free_dbg(str[2]);
+	printf("%s\n", (char*)get_malloc_break() == str[0] + UNCACHED + 20 ? "The break was lowered" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	
+	printf("\n***Growing the block at the break 8 bytes at a time, 32 times***\n");
+	brk = get_malloc_break();
+	for(i = 1; i <= 32; i++)
+	{
+		str[0] = realloc_dbg(str[0], UNCACHED + 20 + 8*i);
+		if(brk != get_malloc_break())
+		{
+			brk = get_malloc_break();
+			moves++;
+		}
+	}
+	printf("The break moved %d times, %s\n", moves, moves <= 3 ? "in chunks" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	
+	my_mallopt(M_TRIM_THRESHOLD, 0);
+	my_mallopt(M_GROW_CHUNK, 1);
+	
+	#ifdef MY_MALLOC_QUARANTINE
+	my_mallopt(M_QUARANTINE_BYTES, MY_MALLOC_QUARANTINE_BYTES);
+	#endif
+}
+
+
+#ifdef MY_MALLOC_HARDENED
+void test_hardened()
+{
+	char memory[4096];
+	char *str[10];
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	
+	str[0] = malloc_dbg(32);
+	str[1] = malloc_dbg(32);
+	str[2] = malloc_dbg(32);
+	str[3] = malloc_dbg(32);
+	
+	printf("\n***Freeing 1 twice***\n");
+	free_dbg(str[1]);
+	free_dbg(str[1]);
+	
+	printf("\n***Overrunning 2 by 4 bytes, then freeing it***\n");
+	memset(str[2], 'x', 32 + 4);
+	free_dbg(str[2]);
+	
+	printf("\n***Freeing 3, whose header was overrun***\n");
+	free_dbg(str[3]);
+	
+	//Large enough to bypass the fastbins and per-CPU caches, so the freed block goes on the freelist
+	init_malloc(&memory[1024], &memory[4095]);
+	#ifdef MY_MALLOC_QUARANTINE
+	my_mallopt(M_QUARANTINE_BYTES, 0);
+	#endif
+	str[0] = malloc_dbg(512);
+	str[1] = malloc_dbg(512);
+	str[2] = malloc_dbg(512);
+	free_dbg(str[1]);
+	
+	printf("\n***Pointing the link of a free piece outside the heap, then reusing it***\n");
+	((Heap_Seg*)(str[1] - sizeof(Heap_Seg)))->next = (Heap_Seg*)memory;
+	printf("%s\n", !malloc_dbg(512) ? "Refused" : "FAILED");
+	
+	#if defined(MY_MALLOC_FASTBINS) || defined(MY_MALLOC_PERCPU)
+	//Both hold freed blocks in a list linked through the first payload word
+	init_malloc(&memory[1024], &memory[4095]);
+	str[0] = malloc_dbg(32);
+	str[1] = malloc_dbg(32);
+	free_dbg(str[0]);
+	free_dbg(str[1]);
+	
+	printf("\n***Reading the link of a block held for reuse***\n");
+	printf("%s\n", *(char**)str[1] != str[0] - sizeof(Heap_Seg) ? "The link is mangled" : "FAILED");
+	
+	printf("\n***Reallocating both blocks***\n");
+	printf("%s\n", malloc_dbg(32) == str[1] && malloc_dbg(32) == str[0] ? "Reused in LIFO order" : "FAILED");
+	#endif
+}
+#endif
+
+
+
+#ifdef MY_MALLOC_QUARANTINE
+void test_quarantine()
+{
+	char memory[4096];
+	char *str[10];
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	my_mallopt(M_QUARANTINE_BYTES, 1024);
+	
+	str[0] = malloc_dbg(32);
+	str[1] = malloc_dbg(32);
+	str[2] = malloc_dbg(32);
+	
+	printf("\n***Freeing 1, then writing to it***\n");
+	free_dbg(str[1]);
+	str[1][5] = 'x';
+	
+	printf("\n***Freeing 1 again***\n");
+	free_dbg(str[1]);
+	
+	printf("\n***Freeing 2 at the tail, then trimming the heap***\n");
+	free_dbg(str[2]);
+	my_malloc_trim(0);
+	printf("%s\n", (char*)get_malloc_break() == str[0] + 32 ? "The quarantined blocks were given back" : "FAILED");
+	
+	printf("\n***Disabling the quarantine***\n");
+	my_mallopt(M_QUARANTINE_BYTES, 0);
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+}
+#endif
+
+
+
+#ifdef MY_MALLOC_STATS
+void test_stats()
+{
+	char memory[4096];
+	char *str[10];
+	int i;
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	
+	for(i = 0; i < 10; i++)
+		str[i] = malloc_dbg(8 << (i % 5));
+	
+	for(i = 0; i < 10; i += 2)
+		free_dbg(str[i]);
+	
+	printf("\n***Heap statistics***\n");
+	malloc_stats_print(stdout, 0);
+	malloc_stats_print(stdout, 1);
+}
+#endif
+
+
+
+#ifdef MY_MALLOC_FASTBINS
+void test_fastbins()
+{
+	char memory[4096];
+	char *str[4];
+	char *again;
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	
+	str[0] = malloc_dbg(100);
+	str[1] = malloc_dbg(100);
+	str[2] = malloc_dbg(100);
+	str[3] = malloc_dbg(100);
+	
+	printf("\n***Freeing and allocating the same size again***\n");
+	free_dbg(str[1]);
+	again = malloc_dbg(100);
+	printf("%s\n", again == str[1] ? "The block was reused from its fastbin" : "FAILED");
+	
+	printf("\n***Freeing a block twice while it is binned***\n");
+	free_dbg(str[2]);
+	free_dbg(str[2]);
+	
+	printf("\n***A larger request consolidates the fastbins***\n");
+	free_dbg(str[1]);
+	again = malloc_dbg(100 + sizeof(Heap_Seg) + 100);
+	printf("%s\n", again == str[1] ? "Both binned blocks were coalesced and reused" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+}
+#endif
+
+
+#ifdef MY_MALLOC_STACK_GUARD
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define GUARD_TEST_SIZE		(1 << 20)
+#define GUARD_TEST_STACK	(256 << 10)
+
+//Whether p can be written to, found without faulting: the kernel refuses to copy into a protected page
+static int page_writable(unsigned char* p)
+{
+	int fds[2], writable;
+	
+	if(pipe(fds))
+		return 0;
+	writable = write(fds[1], "x", 1) == 1 && read(fds[0], p, 1) == 1;
+	close(fds[0]);
+	close(fds[1]);
+	return writable;
+}
+
+static void* stack_guard_thread(void* region)
+{
+	unsigned char *stack = (unsigned char*)region + GUARD_TEST_SIZE - GUARD_TEST_STACK;
+	unsigned char *p, *first[3], *last = NULL, *before_last = NULL, *end;
+	int blocks = 0, writable;
+	size_t size;
+	Malloc_Param guarded, away;
+	
+	//The heap spans the whole region, including this thread's stack at the top of it
+	init_malloc(region, (unsigned char*)region + GUARD_TEST_SIZE);
+	my_mallopt(M_TRIM_THRESHOLD, GUARD_TEST_SIZE);
+	
+	while((p = my_malloc(4096)) != NULL)
+	{
+		if(blocks < 3)
+			first[blocks] = p;
+		before_last = last;
+		last = p;
+		blocks++;
+	}
+	
+	printf("Allocated %d blocks, the last one ends at %p, the stack starts at %p\n", blocks, last + 4096, stack);
+	printf("%s\n", last + 4096 <= stack - MY_MALLOC_STACK_GUARD_SIZE ? "The heap stopped below the guard" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	
+	//The wilderness after the block and what is left below the guard are too small, but the start of the heap is not
+	printf("\n***Expanding a block past what the break can still grow***\n");
+	my_free(first[0]);
+	my_free(first[1]);
+	my_free(first[2]);
+	my_free(last);
+	memset(before_last, 'x', 4096);
+	
+	size = my_expand(before_last, 3*4096, 3*4096);
+	printf("Usable size %zu, %s\n", size, size < 3*4096 && before_last[4095] == 'x' && my_malloc(3*4096) ? "left in place" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	guarded = save_malloc_param();
+	
+	printf("\n***Initializing a heap that ends halfway into the guard***\n");
+	end = stack - MY_MALLOC_STACK_GUARD_SIZE / 2;
+	init_malloc(region, end);
+	printf("%s\n", !page_writable(stack - MY_MALLOC_STACK_GUARD_SIZE) && page_writable(end) ? "The guard stops at the end of the heap" : "FAILED");
+	
+	printf("\n***Initializing a heap that cannot reach the stack***\n");
+	init_malloc(region, (unsigned char*)region + GUARD_TEST_SIZE / 2);
+	away = save_malloc_param();
+	printf("%s\n", page_writable(stack - MY_MALLOC_STACK_GUARD_SIZE) && page_writable(end) ? "The guard was removed" : "FAILED");
+	
+	printf("\n***Switching to the first heap and back***\n");
+	load_malloc_param(guarded);
+	writable = page_writable(stack - MY_MALLOC_STACK_GUARD_SIZE);
+	load_malloc_param(away);
+	printf("%s\n", !writable && page_writable(stack - MY_MALLOC_STACK_GUARD_SIZE) ? "The guard follows the current heap" : "FAILED");
+	return NULL;
+}
+
+void test_stack_guard()
+{
+	unsigned char *region = mmap(NULL, GUARD_TEST_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	pthread_attr_t attr;
+	pthread_t thread;
+	
+	printf("\n***Growing a heap towards the stack of its thread***\n");
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, region + GUARD_TEST_SIZE - GUARD_TEST_STACK, GUARD_TEST_STACK);
+	pthread_create(&thread, &attr, stack_guard_thread, region);
+	pthread_join(thread, NULL);
+	pthread_attr_destroy(&attr);
+	
+	munmap(region, GUARD_TEST_SIZE);
+}
+
+#endif
+
+
+#ifdef MY_MALLOC_OS_HEAP
+
+#include <sys/mman.h>
+
+void test_os_heap()
+{
+	size_t heap_size = 64 << 20;
+	unsigned char *region = init_malloc_os(heap_size, HEAP_PAGES_TRANSPARENT);
+	unsigned char *big, *small, resident;
+	size_t page;
+	
+	printf("\n***Mapping a heap backed by transparent huge pages***\n");
+	if(!region)
+	{
+		printf("FAILED\n");
+		return;
+	}
+	
+	small = malloc_dbg(100);
+	printf("%s\n", (uintptr_t)get_malloc_break() - (uintptr_t)region == (page = save_malloc_param().os_page_size) 
+		? "The break grew by a whole page" : "FAILED");
+	
+	printf("\n***Freeing a block of several pages at the end of the heap***\n");
+	big = malloc_dbg(3 * page);
+	memset(big, 1, 3 * page);
+	free_dbg(big);
+	mincore(region + 2 * page, 4096, &resident);
+	printf("%s\n", !(resident & 1) ? "The pages above the break were released" : "FAILED");
+	
+	free_dbg(small);
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	munmap(region, heap_size);
+}
+
+#endif
+
+
+#ifdef MY_MALLOC_DECAY
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+static int page_resident(void* p)
+{
+	unsigned char resident;
+	
+	mincore((void*)((uintptr_t)p & ~(uintptr_t)4095), 4096, &resident);
+	return resident & 1;
+}
+
+//The piece left over when realloc grows into a free neighbour starts on old data, which must not be taken for its age
+static void test_decay_stamps()
+{
+	size_t heap_size = 1 << 20;
+	unsigned char *region = mmap(NULL, heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *str[5];
+	int i;
+	
+	init_malloc(region, region + heap_size);
+	my_mallopt(M_DECAY_MS, 400);
+	
+	for(i = 0; i < 5; i++)
+		str[i] = malloc_dbg(i == 1 ? 64 * 1024 : 100);
+	memset(str[1], 1, 64 * 1024);
+	free_dbg(str[1]);
+	
+	printf("\n***Growing the block in front of a free piece into it, then freeing another block 60ms later***\n");
+	str[0] = realloc_dbg(str[0], 1000);
+	usleep(60 * 1000);
+	free_dbg(str[3]);
+	printf("%s\n", page_resident(str[1] + 32 * 1024) ? "The rest of the free piece was kept" : "FAILED");
+	
+	printf("\n***Freeing another block after the decay time went by without any call***\n");
+	usleep(450 * 1000);
+	free_dbg(str[4]);
+	printf("%s\n", !page_resident(str[1] + 32 * 1024) ? "The rest of the free piece was purged" : "FAILED");
+	
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	munmap(region, heap_size);
+}
+
+//A call to free only looks at a few free pieces, and the next calls carry on from there
+static void test_decay_batches()
+{
+	size_t heap_size = 1 << 20;
+	unsigned char *region = mmap(NULL, heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *big[40], *small[6];
+	int i;
+	
+	init_malloc(region, region + heap_size);
+	my_mallopt(M_DECAY_MS, (size_t)-1);
+	
+	//Separated by blocks that stay allocated, so the free pieces never merge
+	for(i = 0; i < 40; i++)
+	{
+		big[i] = my_malloc(12 * 1024);
+		memset(big[i], 1, 12 * 1024);
+		my_malloc(16);
+	}
+	for(i = 0; i < 6; i++)
+		small[i] = my_malloc(16);
+	for(i = 0; i < 40; i++)
+		my_free(big[i]);
+	
+	printf("\n***Freeing a block with 40 free pieces of 12K in the heap, without decay time***\n");
+	my_mallopt(M_DECAY_MS, 0);
+	my_free(small[0]);
+	printf("%s\n", !page_resident(big[0] + 6 * 1024) && page_resident(big[39] + 6 * 1024) ? "Only the first pieces were purged" : "FAILED");
+	
+	printf("\n***Freeing two more blocks***\n");
+	my_free(small[2]);
+	my_free(small[4]);
+	printf("%s\n", !page_resident(big[39] + 6 * 1024) ? "The last piece was purged" : "FAILED");
+	
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	munmap(region, heap_size);
+}
+
+void test_decay()
+{
+	size_t heap_size = 1 << 20;
+	unsigned char *region = mmap(NULL, heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *str[3];
+	
+	init_malloc(region, region + heap_size);
+	my_mallopt(M_DECAY_MS, 0);
+	
+	str[0] = malloc_dbg(100);
+	str[1] = malloc_dbg(64 * 1024);
+	str[2] = malloc_dbg(100);
+	memset(str[1], 1, 64 * 1024);
+	
+	printf("\n***Freeing a large block in the middle of the heap, without decay time***\n");
+	free_dbg(str[1]);
+	printf("%s\n", !page_resident(str[1] + 32 * 1024) ? "The pages inside the free piece were purged" : "FAILED");
+	
+	printf("\n***Freeing it again with a decay time of a minute***\n");
+	my_mallopt(M_DECAY_MS, 60 * 1000);
+	str[1] = malloc_dbg(64 * 1024);
+	memset(str[1], 1, 64 * 1024);
+	free_dbg(str[1]);
+	printf("%s\n", page_resident(str[1] + 32 * 1024) ? "The pages were kept" : "FAILED");
+	
+	printf("\n***Trimming the heap***\n");
+	printf("%s\n", my_malloc_trim(0) && !page_resident(str[1] + 32 * 1024) ? "The pages were purged" : "FAILED");
+	
+	free_dbg(str[0]);
+	free_dbg(str[2]);
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+	munmap(region, heap_size);
+	
+	test_decay_stamps();
+	test_decay_batches();
+	my_mallopt(M_DECAY_MS, MY_MALLOC_DECAY_MS);
+}
+
+#endif
+
+
+#ifdef MY_MALLOC_PERCPU
+
+#include <pthread.h>
+
+#define PERCPU_TEST_THREADS		4
+#define PERCPU_TEST_SLOTS		256
+
+static unsigned percpu_rand(unsigned *seed)			//xorshift32, each thread keeps its own state
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+static void* percpu_thread(void* arg)
+{
+	unsigned char *slots[PERCPU_TEST_SLOTS] = {0};
+	size_t sizes[PERCPU_TEST_SLOTS];
+	unsigned seed = (uintptr_t)arg + 1;
+	int i, slot, corrupted = 0;
+	size_t j;
+	
+	for(i = 0; i < 200000; i++)
+	{
+		slot = percpu_rand(&seed) % PERCPU_TEST_SLOTS;
+		
+		if(slots[slot])
+		{
+			//Every block is filled with its slot number, so blocks handed out twice are noticed
+			for(j = 0; j < sizes[slot]; j++)
+				corrupted |= slots[slot][j] != (unsigned char)slot;
+			my_free(slots[slot]);
+			slots[slot] = NULL;
+		}
+		else
+		{
+			sizes[slot] = percpu_rand(&seed) % (slot < 200 ? 256 : 2048) + 1;
+			if((slots[slot] = my_malloc(sizes[slot])) != NULL)
+				memset(slots[slot], slot, sizes[slot]);
+		}
+	}
+	
+	for(slot = 0; slot < PERCPU_TEST_SLOTS; slot++)
+		my_free(slots[slot]);
+	
+	return (void*)(uintptr_t)corrupted;
+}
+
+void test_percpu()
+{
+	static unsigned char memory[16 << 20];
+	pthread_t threads[PERCPU_TEST_THREADS];
+	void *corrupted;
+	int i, failed = 0;
+	char *str[2], *foreign;
+	
+	printf("\n***Freeing and allocating a small block again***\n");
+	init_malloc(memory, memory + sizeof(memory));
+	str[0] = my_malloc(40);
+	my_free(str[0]);
+	str[1] = my_malloc(40);
+	printf("%s\n", str[0] == str[1] ? "The block came back from the per-CPU cache" : "FAILED");
+	
+	printf("\n***Freeing a cached block again***\n");
+	my_free(str[1]);
+	my_free(str[1]);
+	
+	//The page in front of the pointer is unmapped, so reading its header would fault
+	printf("\n***Freeing a pointer from outside the heap***\n");
+	foreign = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	munmap(foreign, 4096);
+	my_free(foreign + 4096);
+	munmap(foreign + 4096, 4096);
+	
+	printf("\n***Churning on %d threads***\n", PERCPU_TEST_THREADS);
+	for(i = 0; i < PERCPU_TEST_THREADS; i++)
+		pthread_create(&threads[i], NULL, percpu_thread, (void*)(uintptr_t)i);
+	for(i = 0; i < PERCPU_TEST_THREADS; i++)
+	{
+		pthread_join(threads[i], &corrupted);
+		failed |= corrupted != NULL;
+	}
+	printf("%s\n", !failed ? "No block was handed out twice" : "FAILED");
+	
+	//Saving the heap hands the cached blocks back, after which everything has been freed
+	printf("%s\n", save_malloc_param().malloc_break == memory ? "The caches were flushed and the heap is empty" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+}
+
+#endif
+
+
+#ifdef MY_MALLOC_PROFILE
+
+#include <stdlib.h>
+
+#define PROFILE_BLOCKS		1000
+
+static unsigned char profile_heap[4 << 20];
+static void *profile_blocks[PROFILE_BLOCKS + PROFILE_BLOCKS / 10];
+
+static void __attribute__((noinline)) profile_small_blocks(void)
+{
+	int i;
+	
+	for(i = 0; i < PROFILE_BLOCKS; i++)
+		profile_blocks[i] = malloc_dbg(1000);
+}
+
+static void __attribute__((noinline)) profile_large_blocks(void)
+{
+	int i;
+	
+	for(i = 0; i < PROFILE_BLOCKS / 10; i++)
+		profile_blocks[PROFILE_BLOCKS + i] = malloc_dbg(10000);
+}
+
+//Sums the bytes at the end of every line of a folded profile
+static double profile_total(FILE* profile, int *lines)
+{
+	char line[4096], *bytes;
+	double total = 0;
+	
+	rewind(profile);
+	for(*lines = 0; fgets(line, sizeof(line), profile); (*lines)++)
+		if((bytes = strrchr(line, ' ')) != NULL)
+			total += atof(bytes + 1);
+	
+	return total;
+}
+
+void test_profile()
+{
+	FILE *profile = tmpfile();
+	double total;
+	int i, lines, dumped;
+	
+	init_malloc(profile_heap, profile_heap + sizeof(profile_heap));
+	my_mallopt(M_PROFILE_RATE, 4096);
+	
+	printf("\n***Sampling 2000000 bytes allocated from two functions***\n");
+	profile_small_blocks();
+	profile_large_blocks();
+	dumped = my_malloc_profile_dump(profile);
+	total = profile_total(profile, &lines);
+	printf("%d stacks, %.0f bytes estimated\n", dumped, total);
+	printf("%s\n", dumped >= 2 && lines == dumped && total > 1500000 && total < 2500000 ? "The estimate is close" : "FAILED");
+	
+	printf("\n***Freeing every block***\n");
+	for(i = 0; i < PROFILE_BLOCKS + PROFILE_BLOCKS / 10; i++)
+		free_dbg(profile_blocks[i]);
+	fclose(profile);
+	profile = tmpfile();
+	printf("%s\n", my_malloc_profile_dump(profile) == 0 ? "No live bytes are left" : "FAILED");
+	
+	fclose(profile);
+	my_mallopt(M_PROFILE_RATE, MY_MALLOC_PROFILE_RATE);
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+}
+
+#endif
+
+
+#ifdef MY_MALLOC_LATENCY
+void test_latency()
+{
+	char memory[4096];
+	char *str[5];
+	Malloc_Latency latency;
+	int i, path, ordered = 1;
+	
+	init_malloc(&memory[1024], &memory[4095]);
+	malloc_latency_reset();
+	
+	printf("\n***Taking every path of malloc, free and realloc***\n");
+	for(i = 0; i < 5; i++)
+		str[i] = malloc_dbg(100);
+	free_dbg(str[1]);
+	str[1] = malloc_dbg(100);
+	free_dbg(str[1]);
+	str[1] = malloc_dbg(40);
+	free_dbg(str[1]);
+	free_dbg(str[3]);
+	free_dbg(str[2]);
+	free_dbg(str[0]);
+	str[4] = realloc_dbg(str[4], 50);
+	str[0] = malloc_dbg(50);
+	str[0] = realloc_dbg(str[0], 1000);
+	free_dbg(str[0]);
+	free_dbg(str[4]);
+	malloc_latency_print(stdout);
+	
+	for(path = 0; path < LATENCY_PATHS; path++)
+	{
+		malloc_latency(path, &latency);
+		ordered &= latency.p50_ns <= latency.p90_ns && latency.p90_ns <= latency.p99_ns && latency.p99_ns <= latency.max_ns;
+	}
+	
+	#if !defined(MY_MALLOC_FASTBINS) && !defined(MY_MALLOC_QUARANTINE) && !defined(MY_MALLOC_PERCPU)
+	for(path = LATENCY_EXACT; path <= LATENCY_COPY; path++)
+	{
+		malloc_latency(path, &latency);
+		if(path != LATENCY_DEFERRED && !latency.count)
+			ordered = 0;
+	}
+	#endif
+	
+	printf("%s\n", ordered ? "Every path was timed" : "FAILED");
+	printf("Heap check: %s\n", heap_check() ? "passed" : "FAILED");
+}
+#endif
+
+
+#ifdef MY_MALLOC_FREE_INDEX
+
+#include <stdlib.h>
+
+void test_free_index()
+{
+	static unsigned char memory[1 << 20], other[4096];
+	void *slots[256];
+	Malloc_Param param;
+	int policy, i, slot, passed = 1;
+	
+	printf("\n***Keeping the free index in step with the freelist***\n");
+	for(policy = PLACEMENT_BEST_FIT; policy <= PLACEMENT_NEXT_FIT; policy++)
+	{
+		init_malloc(memory, memory + sizeof(memory));
+		my_mallopt(M_PLACEMENT, policy);
+		memset(slots, 0, sizeof(slots));
+		srand(policy);
+		
+		for(i = 0; i < 3000; i++)
+		{
+			slot = rand() % 256;
+			if(!slots[slot])
+				slots[slot] = my_malloc(rand() % 1024 + 1);
+			else if(rand() % 4 == 0)
+				slots[slot] = my_realloc(slots[slot], rand() % 1024 + 1);
+			else
+			{
+				my_free(slots[slot]);
+				slots[slot] = NULL;
+			}
+			
+			//Switching heaps drops the index, the next search rebuilds it
+			if(i % 1000 == 0)
+			{
+				param = save_malloc_param();
+				init_malloc(other, other + sizeof(other));
+				my_free(my_malloc(100));
+				load_malloc_param(param);
+			}
+			
+			if(i % 250 == 0)
+				passed &= heap_check();
+		}
+		
+		my_malloc_trim(0);
+		passed &= heap_check();
+	}
+	
+	printf("%s\n", passed ? "Free index matches the freelist" : "FAILED");
+}
+#endif
+
+
+#ifdef MY_MALLOC_PERSISTENT
+
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+void test_persistent()
+{
+	size_t heap_size = 1 << 20;
+	unsigned char *region = mmap(NULL, heap_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	void *slots[64];
+	pid_t child;
+	int crash, i;
+	
+	init_malloc(region, region + heap_size);
+	
+	for(crash = 0; crash < 20; crash++)
+	{
+		//The child churns on the shared heap until it gets killed at a random point
+		fflush(stdout);
+		child = fork();
+		if(child == 0)
+		{
+			freopen("/dev/null", "w", stdout);
+			freopen("/dev/null", "w", stderr);
+			attach_malloc(region, region + heap_size);
+			memset(slots, 0, sizeof(slots));
+			srand(crash);
+			
+			for(;;)
+			{
+				i = rand() % 64;
+				if(!slots[i])
+					slots[i] = malloc_dbg(rand() % 512 + 1);
+				else if(rand() % 2)
+					slots[i] = realloc_dbg(slots[i], rand() % 512 + 1);
+				else
+				{
+					free_dbg(slots[i]);
+					slots[i] = NULL;
+				}
+			}
+		}
+		
+		usleep(1000 + rand() % 5000);
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+		
+		printf("Crash %d: ", crash);
+		if(!attach_malloc(region, region + heap_size) || !heap_check())
+		{
+			printf("heap is corrupted!\n");
+			return;
+		}
+		printf("heap recovered, malloc break at %p\n", save_malloc_param().malloc_break);
+	}
+	
+	munmap(region, heap_size);
+}
+
+#endif
+
+
 int main()
 {
 	
@@ -475,5 +1624,60 @@ int main()
 	//test_calloc();
 	//test_free();
 	test_realloc();
+	test_expand();
+	test_memalign();
+	test_object_cache();
+	test_reserve();
+	test_placement();
+	test_wilderness();
+	test_heap_check();
+	
+	#ifdef MY_MALLOC_HARDENED
+	test_hardened();
+	#endif
+	
+	#ifdef MY_MALLOC_QUARANTINE
+	test_quarantine();
+	#endif
+	
+	#ifdef MY_MALLOC_STATS
+	test_stats();
+	#endif
+	
+	#ifdef MY_MALLOC_FASTBINS
+	test_fastbins();
+	#endif
+	
+	#ifdef MY_MALLOC_STACK_GUARD
+	test_stack_guard();
+	#endif
+	
+	#ifdef MY_MALLOC_OS_HEAP
+	test_os_heap();
+	#endif
+	
+	#ifdef MY_MALLOC_DECAY
+	test_decay();
+	#endif
+	
+	#ifdef MY_MALLOC_PERCPU
+	test_percpu();
+	#endif
+	
+	#ifdef MY_MALLOC_PROFILE
+	test_profile();
+	#endif
+	
+	#ifdef MY_MALLOC_LATENCY
+	test_latency();
+	#endif
+	
+	#ifdef MY_MALLOC_PERSISTENT
+	test_persistent();
+	#endif
+	
+	#ifdef MY_MALLOC_FREE_INDEX
+	test_free_index();
+	#endif
 	
 }